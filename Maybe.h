@@ -34,7 +34,8 @@ public:
   Maybe(const Maybe &other) : hasValue(other.hasValue) {
     if (other.hasValue) new (&x) T(other.x);
   }
-  Maybe(Maybe &&other) : hasValue(other.hasValue) { moveFrom(other); }
+  Maybe(Maybe &&other) noexcept(std::is_nothrow_move_constructible<T>::value)
+    : hasValue(other.hasValue) { moveFrom(other); }
   void operator=(const Maybe &other) {
     if (hasValue) x.~T();
     hasValue = other.hasValue;
@@ -1,14 +1,33 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <exception>
 #include <functional>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <system_error>
 #include <utility>
 
 #include <assert.h>
 #include <vector>
 #include "Maybe.h"
 
+#ifdef RX_TRACE
+#include "rx_trace.h"
+#define RX_TRACE_ALLOCATION(bytes) ::windberry::rx::trace_allocation(bytes)
+#define RX_TRACE_QUEUE_DEPTH(depth) ::windberry::rx::trace_queue_depth(depth)
+#else
+#define RX_TRACE_ALLOCATION(bytes) ((void)0)
+#define RX_TRACE_QUEUE_DEPTH(depth) ((void)0)
+#endif
+
 namespace windberry {
 namespace rx {
 
@@ -49,6 +68,490 @@ inline constexpr auto callable_or_empty(const std::tuple<Fs...> &t) {
 
 using default_error_type = std::exception_ptr;
 
+// The error type of observables that can't fail. There are no nevers, so
+// their error paths never run: type-erased observers leave out the error
+// slot, and recorded events don't make room for an error.
+struct never {
+    never() = delete;
+    // Stands in for any error type, since there's never one to convert.
+    template <typename E>
+    [[noreturn]] operator E() const { std::terminate(); }
+};
+
+template <typename E>
+using is_infallible = std::is_same<E, never>;
+
+// Converts errors from one type to another, for operators that join
+// observables with different error types. Errors are constructed from each
+// other by default; specialize it for types that don't convert that way.
+template <typename From, typename To, typename = void>
+struct error_conversion {
+    static To convert(From e) { return To(std::move(e)); }
+};
+
+template <typename To>
+struct error_conversion<never, To> {
+    [[noreturn]] static To convert(never) { std::terminate(); }
+};
+
+// Any error can be an exception.
+template <typename From>
+struct error_conversion<From, std::exception_ptr,
+                        std::enable_if_t<!std::is_same<From, std::exception_ptr>::value &&
+                                         !is_infallible<From>::value>> {
+    static std::exception_ptr convert(From e) { return std::make_exception_ptr(std::move(e)); }
+};
+
+template <>
+struct error_conversion<std::error_code, std::exception_ptr> {
+    static std::exception_ptr convert(std::error_code e) {
+        return std::make_exception_ptr(std::system_error(e));
+    }
+};
+
+template <typename To, typename From>
+inline To convert_error(From e) {
+    return error_conversion<From, To>::convert(std::move(e));
+}
+
+// The error type of an operator whose errors come from observables with
+// error types E1 and E2: E2, unless it's never. E1's errors are converted.
+template <typename E1, typename E2>
+using joined_error = std::conditional_t<is_infallible<E2>::value, E1, E2>;
+
+static constexpr size_t cache_line_size = 64;
+
+// A cache line's worth of padding, for keeping fields that different
+// threads write off each other's lines. Types that are allocated, through
+// make_state or new, pad rather than use alignas, which allocation doesn't
+// honour before C++17. With a whole line on each side, the fields between
+// are on lines of their own wherever the allocation starts.
+struct cache_line_pad {
+    char bytes[cache_line_size];
+};
+
+// Something that sends values as they're requested, resumed by
+// subscription::request.
+struct producer {
+    virtual ~producer() {}
+    virtual void resume() = 0;
+};
+
+// Where subscription arenas get their memory. Implement it to take blocks
+// from a pool of your own. Blocks are freed on whichever thread lets go of
+// the last of a subscription's state.
+struct block_allocator {
+    virtual ~block_allocator() {}
+    virtual void *allocate(size_t size) = 0;
+    virtual void deallocate(void *p, size_t size) = 0;
+};
+
+// Takes blocks from operator new.
+struct heap_block_allocator : block_allocator {
+    void *allocate(size_t size) override { return ::operator new(size); }
+    void deallocate(void *p, size_t) override { ::operator delete(p); }
+
+    static heap_block_allocator *instance() {
+        static heap_block_allocator a;
+        return &a;
+    }
+};
+
+// Keeps up to max_free freed blocks of block_size bytes for reuse, so that
+// subscribing and tearing down pipelines stops allocating once enough
+// blocks are in use. Blocks of other sizes come from operator new. It must
+// outlive the subscriptions using it.
+class block_pool : public block_allocator {
+  public:
+    explicit block_pool(size_t block_size_, size_t max_free_ = 64)
+        : block_size(block_size_), max_free(max_free_) {
+        free.reserve(max_free);
+    }
+    block_pool(const block_pool &) = delete;
+    block_pool &operator=(const block_pool &) = delete;
+
+    ~block_pool() {
+        for (void *p : free) {
+            ::operator delete(p);
+        }
+    }
+
+    void *allocate(size_t size) override {
+        if (size == block_size) {
+            std::lock_guard<std::mutex> lock(m);
+            if (!free.empty()) {
+                void *p = free.back();
+                free.pop_back();
+                return p;
+            }
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void *p, size_t size) override {
+        if (size == block_size) {
+            std::lock_guard<std::mutex> lock(m);
+            if (free.size() < max_free) {
+                free.push_back(p);
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+    const size_t block_size;
+
+  private:
+    const size_t max_free;
+    std::mutex m;
+    std::vector<void *> free;
+};
+
+// Bytes in each block of a subscription arena, by default.
+static constexpr size_t default_arena_block_size = 1024;
+
+// Memory for the state of one subscription and the operators subscribed
+// with it. It's carved out of blocks in order and never reused; the blocks
+// all go back to their allocator once everything allocated from them has
+// been deallocated. The arena itself lives at the start of its first block,
+// so a chain whose state fits in one block makes one allocation.
+//
+// Only state made once per subscription belongs here, since memory freed
+// while the subscription runs isn't reused.
+class subscription_arena {
+  public:
+    // The arena frees itself after the last deallocate, so something must
+    // be allocated from it.
+    static subscription_arena *create(block_allocator *blocks, size_t block_size) {
+        blocks = blocks ? blocks : heap_block_allocator::instance();
+        block_size = std::max(block_size, sizeof(subscription_arena) + sizeof(block));
+        void *p = blocks->allocate(block_size);
+        return new (p) subscription_arena(blocks, block_size);
+    }
+
+    void *allocate(size_t size, size_t align) {
+        live.fetch_add(1, std::memory_order_relaxed);
+        // Allocations rarely overlap, so a spinlock is cheaper than a mutex.
+        while (locked.test_and_set(std::memory_order_acquire)) {}
+        unsigned char *p = align_up(base + used, align);
+        if (p + size > base + capacity) {
+            // Too big for the rest of this block, so start another one.
+            size_t bytes = std::max(block_size, sizeof(block) + align + size);
+            auto *b = new (blocks->allocate(bytes)) block{last, bytes};
+            last = b;
+            base = reinterpret_cast<unsigned char *>(b);
+            capacity = bytes;
+            p = align_up(base + sizeof(block), align);
+        }
+        used = p + size - base;
+        locked.clear(std::memory_order_release);
+        return p;
+    }
+
+    void deallocate() {
+        if (live.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+        for (block *b = last; b;) {
+            block *prev = b->prev;
+            blocks->deallocate(b, b->size);
+            b = prev;
+        }
+        block_allocator *a = blocks;
+        size_t size = block_size;
+        this->~subscription_arena();
+        a->deallocate(this, size);
+    }
+
+  private:
+    static unsigned char *align_up(unsigned char *p, size_t align) {
+        auto n = reinterpret_cast<uintptr_t>(p);
+        return reinterpret_cast<unsigned char *>((n + align - 1) & ~uintptr_t(align - 1));
+    }
+
+    // The header of each block after the first.
+    struct block {
+        block *prev;
+        size_t size;
+    };
+
+    subscription_arena(block_allocator *blocks_, size_t block_size_)
+        : blocks(blocks_), block_size(block_size_),
+          base(reinterpret_cast<unsigned char *>(this)),
+          used(sizeof(subscription_arena)), capacity(block_size_) {}
+
+    block_allocator *blocks;
+    size_t block_size;
+    std::atomic<size_t> live{0};
+    std::atomic_flag locked = ATOMIC_FLAG_INIT;
+    unsigned char *base;
+    size_t used;
+    size_t capacity;
+    block *last = nullptr;
+};
+
+// An allocator for std::allocate_shared that takes memory from an arena.
+template <typename T>
+struct arena_allocator {
+    using value_type = T;
+    subscription_arena *arena;
+
+    explicit arena_allocator(subscription_arena *a) : arena(a) {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U> &o) : arena(o.arena) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T *, size_t) { arena->deallocate(); }
+
+    template <typename U>
+    bool operator==(const arena_allocator<U> &o) const { return arena == o.arena; }
+    template <typename U>
+    bool operator!=(const arena_allocator<U> &o) const { return arena != o.arena; }
+};
+
+// A handle to a running subscription, returned by subscribe. Disposing it
+// stops events from reaching the subscriber and tells the generator to stop.
+// Copies refer to the same subscription.
+//
+// Subscriptions also carry the subscriber's demand: how many more values it
+// is ready for. Demand is unbounded unless the subscription is created with
+// an initial demand, and only flowable generators respect it.
+//
+// A subscription made with_arena also carries an arena, which the operators
+// subscribed with it allocate their state from, through make_state.
+class subscription {
+  public:
+    static constexpr size_t unbounded = size_t(-1);
+
+    subscription() : subscription(unbounded) {}
+    explicit subscription(size_t initial_demand) : st(std::make_shared<state>(initial_demand, nullptr)) {}
+
+    // A subscription whose state, and that of the operators subscribed with
+    // it, comes from a new arena with blocks from blocks, or from operator
+    // new if it's null.
+    static subscription with_arena(block_allocator *blocks = nullptr,
+                                   size_t block_size = default_arena_block_size,
+                                   size_t initial_demand = unbounded) {
+        return subscription(subscription_arena::create(blocks, block_size), initial_demand);
+    }
+
+    // A new subscription from the same arena as this one, that's disposed
+    // along with it. For operators that don't pass on their subscriber's
+    // demand.
+    subscription child(size_t initial_demand = unbounded) const {
+        subscription sub = st->arena ? subscription(st->arena, initial_demand) : subscription(initial_demand);
+        add([sub]{ sub.dispose(); });
+        return sub;
+    }
+
+    // The arena to allocate the subscription's state from, if it has one.
+    inline subscription_arena *arena() const { return st->arena; }
+
+    inline bool is_disposed() const { return st->disposed.load(std::memory_order_acquire); }
+
+    void dispose() const {
+        if (st->disposed.exchange(true)) {
+            return;
+        }
+        // A teardown may drop the last handle to this subscription.
+        std::shared_ptr<state> self = st;
+        teardown *t;
+        std::shared_ptr<producer> p;
+        {
+            std::lock_guard<std::mutex> lock(st->m);
+            t = st->teardowns;
+            st->teardowns = nullptr;
+            st->last_teardown = nullptr;
+            p.swap(st->active);
+        }
+        while (t) {
+            teardown *next = t->next;
+            t->run();
+            self->destroy(t);
+            t = next;
+        }
+    }
+
+    // How many more values the subscriber is ready for.
+    inline size_t requested() const { return st->demand.load(std::memory_order_acquire); }
+
+    // Allows n more values, and resumes the producer if it's waiting.
+    void request(size_t n) const {
+        size_t d = st->demand.load(std::memory_order_relaxed);
+        if (d == unbounded || n == 0) {
+            return;
+        }
+        size_t next;
+        do {
+            next = n >= unbounded - d ? unbounded : d + n;
+        } while (!st->demand.compare_exchange_weak(d, next, std::memory_order_acq_rel));
+        std::shared_ptr<producer> p;
+        {
+            std::lock_guard<std::mutex> lock(st->m);
+            p = st->active;
+        }
+        if (p) {
+            p->resume();
+        }
+    }
+
+    // Called by the producer after sending n values.
+    inline void produced(size_t n) const {
+        size_t d = st->demand.load(std::memory_order_relaxed);
+        while (d != unbounded &&
+               !st->demand.compare_exchange_weak(d, d - n, std::memory_order_acq_rel)) {}
+    }
+
+    // Sets the producer that request resumes. A subscription has one
+    // producer at a time; it's released when the subscription is disposed.
+    void set_producer(std::shared_ptr<producer> p) const {
+        std::lock_guard<std::mutex> lock(st->m);
+        if (!is_disposed()) {
+            st->active = std::move(p);
+        }
+    }
+
+    // Releases p if it's still the producer.
+    void clear_producer(const producer *p) const {
+        std::shared_ptr<producer> old;
+        std::lock_guard<std::mutex> lock(st->m);
+        if (st->active.get() == p) {
+            old.swap(st->active);
+        }
+    }
+
+    // Runs f when the subscription is disposed, or now if it already is.
+    // Functions added earlier run first.
+    template <typename F>
+    void add(F &&f) const {
+        if (is_disposed()) {
+            f();
+            return;
+        }
+        using T = teardown_fn<std::decay_t<F>>;
+        teardown *t = new (st->allocate(sizeof(T), alignof(T))) T(std::forward<F>(f));
+        {
+            std::lock_guard<std::mutex> lock(st->m);
+            if (!is_disposed()) {
+                (st->last_teardown ? st->last_teardown->next : st->teardowns) = t;
+                st->last_teardown = t;
+                return;
+            }
+        }
+        t->run();
+        st->destroy(t);
+    }
+
+  private:
+    struct teardown {
+        teardown *next = nullptr;
+        virtual ~teardown() {}
+        virtual void run() = 0;
+    };
+
+    template <typename F>
+    struct teardown_fn : teardown {
+        F f;
+        explicit teardown_fn(F f_) : f(std::move(f_)) {}
+        void run() override { f(); }
+    };
+
+    struct state {
+        std::atomic<bool> disposed{false};
+        std::atomic<size_t> demand;
+        std::mutex m;
+        teardown *teardowns = nullptr;
+        teardown *last_teardown = nullptr;
+        std::shared_ptr<producer> active;
+        // Outlives this, which was allocated from it.
+        subscription_arena *arena;
+
+        state(size_t demand_, subscription_arena *arena_) : demand(demand_), arena(arena_) {}
+        ~state() {
+            for (teardown *t = teardowns; t;) {
+                teardown *next = t->next;
+                destroy(t);
+                t = next;
+            }
+        }
+
+        void *allocate(size_t size, size_t align) {
+            return arena ? arena->allocate(size, align) : ::operator new(size);
+        }
+        void destroy(teardown *t) {
+            t->~teardown();
+            if (arena) {
+                arena->deallocate();
+            } else {
+                ::operator delete(t);
+            }
+        }
+    };
+
+    subscription(subscription_arena *arena, size_t initial_demand)
+        : st(std::allocate_shared<state>(arena_allocator<state>(arena), initial_demand, arena)) {}
+
+    std::shared_ptr<state> st;
+};
+
+// Makes per-subscription state, from the subscription's arena if it has one.
+template <typename T, typename... Args>
+std::shared_ptr<T> make_state(const subscription &sub, Args &&... args) {
+    RX_TRACE_ALLOCATION(sizeof(T));
+    if (subscription_arena *arena = sub.arena()) {
+        return std::allocate_shared<T>(arena_allocator<T>(arena), std::forward<Args>(args)...);
+    }
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+template <typename O, typename = void>
+struct has_subscription : std::false_type {};
+
+template <typename O>
+struct has_subscription<O, decltype((void)std::declval<const O &>().get_subscription())>
+    : std::true_type {};
+
+// The end of a chain of observers: drops events once its subscription is
+// disposed, and disposes it after an error or completion.
+template <typename Observer>
+struct disposable_observer {
+    using value_type = typename Observer::value_type;
+    using error_type = typename Observer::error_type;
+    Observer o;
+    subscription sub;
+
+    disposable_observer(Observer o_, subscription sub_) : o(std::move(o_)), sub(std::move(sub_)) {}
+
+    inline subscription get_subscription() const { return sub; }
+    inline bool is_disposed() const { return sub.is_disposed(); }
+    inline void request(size_t n) const { sub.request(n); }
+
+    inline void send_next(const value_type &x) const {
+        if (!is_disposed()) o.send_next(x);
+    }
+    inline void send_next(value_type &&x) const {
+        if (!is_disposed()) o.send_next(std::move(x));
+    }
+    inline void send_error(error_type e) const {
+        if (!is_disposed()) {
+            o.send_error(std::move(e));
+            sub.dispose();
+        }
+    }
+    inline void send_completed() const {
+        if (!is_disposed()) {
+            o.send_completed();
+            sub.dispose();
+        }
+    }
+};
+
+// Gives an observer that doesn't track a subscription one.
+template <typename O>
+inline auto with_subscription(O &&o, subscription sub = subscription()) {
+    return disposable_observer<std::decay_t<O>>{std::forward<O>(o), std::move(sub)};
+}
+
 template <typename T, typename E, typename... Fs>
 struct tuple_observer {
     using value_type = T;
@@ -57,44 +560,296 @@ struct tuple_observer {
 
     tuple_observer(std::tuple<Fs...> &&fs_) : fs(std::move(fs_)) {}
 
-    inline void send_next(T x) const { std::get<0>(fs)(x); }
+    inline void send_next(const T &x) const { std::get<0>(fs)(x); }
+    inline void send_next(T &&x) const { std::get<0>(fs)(std::move(x)); }
     inline void send_error(E e) const { callable_or_empty<1, Fs...>(fs)(e); }
     inline void send_completed() const { callable_or_empty<2, Fs...>(fs)(); }
 };
 
-template <typename T, typename E = default_error_type>
+// Bytes of inline storage in any_observer and any_observable. Anything larger
+// is moved to the heap.
+static constexpr size_t default_inline_size = 6 * sizeof(void *);
+
+// Owns a polymorphic Base in N bytes of inline storage. Base provides
+// move_to (and clone_to, if copied) to relocate itself into another buffer.
+template <typename Base, size_t N>
+struct inline_ptr {
+    alignas(std::max_align_t) unsigned char storage[N];
+    Base *p = nullptr;
+
+    inline_ptr() {}
+    inline_ptr(inline_ptr &&other) noexcept {
+        if (other.p) {
+            p = other.p->move_to(storage);
+            other.reset();
+        }
+    }
+    inline_ptr(const inline_ptr &other) {
+        if (other.p) {
+            p = other.p->clone_to(storage);
+        }
+    }
+    inline_ptr &operator=(inline_ptr &&other) noexcept {
+        if (this != &other) {
+            reset();
+            if (other.p) {
+                p = other.p->move_to(storage);
+                other.reset();
+            }
+        }
+        return *this;
+    }
+    inline_ptr &operator=(const inline_ptr &other) {
+        if (this != &other) {
+            reset();
+            if (other.p) {
+                p = other.p->clone_to(storage);
+            }
+        }
+        return *this;
+    }
+    ~inline_ptr() { reset(); }
+
+    template <typename Model, typename... Args>
+    void emplace(Args &&... args) {
+        static_assert(sizeof(Model) <= N, "Model does not fit in inline storage");
+        reset();
+        p = new (storage) Model(std::forward<Args>(args)...);
+    }
+
+    void reset() {
+        if (p) {
+            p->~Base();
+            p = nullptr;
+        }
+    }
+
+    inline Base *operator->() const { return p; }
+};
+
+// Holds an O directly, or through a heap pointer when it's too large or
+// can't be relocated without throwing. Observers that don't fit are
+// allocated from their subscription's arena, if it has one.
+template <typename O, bool Inline>
+struct inline_holder {
+    O o;
+    template <typename O_>
+    explicit inline_holder(O_ &&o_) : o(std::forward<O_>(o_)) {}
+    inline const O &get() const { return o; }
+};
+
+template <typename O>
+struct inline_holder<O, false> {
+    std::shared_ptr<O> o;
+    template <typename O_>
+    explicit inline_holder(O_ &&o_) : o(make(std::forward<O_>(o_), has_subscription<O>{})) {}
+    inline_holder(inline_holder &&) = default;
+    inline_holder(const inline_holder &other) : o(std::make_shared<O>(*other.o)) {}
+    inline const O &get() const { return *o; }
+
+  private:
+    template <typename O_>
+    static std::shared_ptr<O> make(O_ &&o_, std::true_type) {
+        subscription sub = o_.get_subscription();
+        return make_state<O>(sub, std::forward<O_>(o_));
+    }
+    template <typename O_>
+    static std::shared_ptr<O> make(O_ &&o_, std::false_type) {
+        return std::make_shared<O>(std::forward<O_>(o_));
+    }
+};
+
+template <typename O, size_t N>
+struct fits_inline {
+    struct probe {
+        void *vptr;
+        O o;
+    };
+    static constexpr bool value = sizeof(probe) <= N &&
+                                  alignof(O) <= alignof(std::max_align_t) &&
+                                  std::is_nothrow_move_constructible<O>::value;
+};
+
+// The error slot of a type-erased observer's vtable, which infallible
+// observers do without.
+template <typename E>
+struct erased_error_slot {
+    virtual ~erased_error_slot() {}
+    virtual void send_error(E) const = 0;
+};
+
+template <>
+struct erased_error_slot<never> {
+    virtual ~erased_error_slot() {}
+    void send_error(never) const {}
+};
+
+// Fills in the error slot for Model, whose observer() is the observer it
+// erases.
+template <typename E, typename Base, typename Model>
+struct erased_error_model : Base {
+    void send_error(E e) const override {
+        static_cast<const Model *>(this)->observer().send_error(std::move(e));
+    }
+};
+
+template <typename Base, typename Model>
+struct erased_error_model<never, Base, Model> : Base {};
+
+// A type-erased observer that owns its observer exclusively. Observers up to
+// N bytes are stored inline. Use shared_observer where copies are needed.
+template <typename T, typename E = default_error_type, size_t N = default_inline_size>
 struct any_observer {
-    struct base;
+    using value_type = T;
+    using error_type = E;
+
+    template <typename O, typename = disable_if_same_or_derived<any_observer, O>>
+    any_observer(O &&o) { emplace(std::forward<O>(o), has_subscription<std::decay_t<O>>{}); }
+
+    any_observer(any_observer &&) noexcept = default;
+    any_observer &operator=(any_observer &&) noexcept = default;
+    any_observer(const any_observer &) = delete;
+    any_observer &operator=(const any_observer &) = delete;
+
+    inline subscription get_subscription() const { return p->get_subscription(); }
+    inline bool is_disposed() const { return p->is_disposed(); }
+    inline void request(size_t n) const { p->request(n); }
+    inline void send_next(const T &x) const { p->send_next(x); }
+    inline void send_next(T &&x) const { p->send_next(std::move(x)); }
+    inline void send_error(E e) const { p->send_error(e); }
+    inline void send_completed() const { p->send_completed(); }
+
+  private:
+    template <typename O>
+    void emplace(O &&o, std::true_type) {
+        using O2 = std::decay_t<O>;
+        p.template emplace<model<O2, fits_inline<O2, N>::value>>(std::forward<O>(o));
+    }
+    template <typename O>
+    void emplace(O &&o, std::false_type) {
+        emplace(with_subscription(std::forward<O>(o)), std::true_type{});
+    }
+
+    struct base : erased_error_slot<E> {
+        virtual base *move_to(void *dst) noexcept = 0;
+        virtual subscription get_subscription() const = 0;
+        virtual bool is_disposed() const = 0;
+        virtual void request(size_t) const = 0;
+        virtual void send_next(const T &) const = 0;
+        virtual void send_next(T &&) const = 0;
+        virtual void send_completed() const = 0;
+    };
+
+    template <typename O, bool Inline>
+    struct model : erased_error_model<E, base, model<O, Inline>> {
+        inline_holder<O, Inline> h;
+        template <typename O_>
+        explicit model(O_ &&o_) : h(std::forward<O_>(o_)) {}
+        inline const O &observer() const { return h.get(); }
+        base *move_to(void *dst) noexcept override { return new (dst) model(std::move(*this)); }
+        subscription get_subscription() const override { return h.get().get_subscription(); }
+        bool is_disposed() const override { return h.get().is_disposed(); }
+        void request(size_t n) const override { h.get().request(n); }
+        void send_next(const T &x) const override { h.get().send_next(x); }
+        void send_next(T &&x) const override { h.get().send_next(std::move(x)); }
+        void send_completed() const override { h.get().send_completed(); }
+    };
+
+    inline_ptr<base, N> p;
+};
 
+// A type-erased observer whose copies share one heap-allocated observer.
+template <typename T, typename E = default_error_type>
+struct shared_observer {
     using value_type = T;
+    using error_type = E;
 
-    std::shared_ptr<base> p;
-    template <typename O,
-              typename = disable_if_same_or_derived<std::decay_t<O>, any_observer<T>>>
-    any_observer(O &&o)
-        : p(new model<std::decay_t<O>>(std::forward<O>(o))) {}
+    template <typename O, typename = disable_if_same_or_derived<shared_observer, O>>
+    shared_observer(O &&o) : p(make(std::forward<O>(o), has_subscription<std::decay_t<O>>{})) {}
 
-    inline void send_next(T x) const { p->send_next(x); }
+    inline subscription get_subscription() const { return p->get_subscription(); }
+    inline bool is_disposed() const { return p->is_disposed(); }
+    inline void request(size_t n) const { p->request(n); }
+    inline void send_next(const T &x) const { p->send_next(x); }
+    inline void send_next(T &&x) const { p->send_next(std::move(x)); }
     inline void send_error(E e) const { p->send_error(e); }
     inline void send_completed() const { p->send_completed(); }
 
-    struct base {
-        using value_type = T;
-        virtual ~base() {}
-        virtual void send_next(T) const = 0;
-        virtual void send_error(E) const = 0;
+  private:
+    struct base;
+
+    template <typename O>
+    static std::shared_ptr<const base> make(O &&o, std::true_type) {
+        subscription sub = o.get_subscription();
+        return make_state<model<std::decay_t<O>>>(sub, std::forward<O>(o));
+    }
+    template <typename O>
+    static std::shared_ptr<const base> make(O &&o, std::false_type) {
+        return make(with_subscription(std::forward<O>(o)), std::true_type{});
+    }
+
+    struct base : erased_error_slot<E> {
+        virtual subscription get_subscription() const = 0;
+        virtual bool is_disposed() const = 0;
+        virtual void request(size_t) const = 0;
+        virtual void send_next(const T &) const = 0;
+        virtual void send_next(T &&) const = 0;
         virtual void send_completed() const = 0;
     };
 
     template <typename O>
-    struct model : base {
+    struct model : erased_error_model<E, base, model<O>> {
         O o;
         template <typename O_>
         model(O_ &&o_) : o(std::forward<O_>(o_)) {}
-        void send_next(T x) const override { o.send_next(x); }
-        void send_error(E e) const override { o.send_error(e); }
+        inline const O &observer() const { return o; }
+        subscription get_subscription() const override { return o.get_subscription(); }
+        bool is_disposed() const override { return o.is_disposed(); }
+        void request(size_t n) const override { o.request(n); }
+        void send_next(const T &x) const override { o.send_next(x); }
+        void send_next(T &&x) const override { o.send_next(std::move(x)); }
         void send_completed() const override { o.send_completed(); }
     };
+
+    std::shared_ptr<const base> p;
+};
+
+// Observers are kept as-is where they can be copied, and shared otherwise.
+template <typename T, typename E, typename O>
+using copyable_observer = std::conditional_t<std::is_copy_constructible<O>::value,
+                                             O, shared_observer<T, E>>;
+
+// The type-erased generator of an any_observable. Unlike any_observer it's
+// copyable, since observables are copied into the operators built on them.
+template <typename T, typename E = default_error_type, size_t N = default_inline_size>
+struct any_generator {
+    template <typename F, typename = disable_if_same_or_derived<any_generator, F>>
+    any_generator(F &&f) {
+        using F2 = std::decay_t<F>;
+        p.template emplace<model<F2, fits_inline<F2, N>::value>>(std::forward<F>(f));
+    }
+
+    inline void operator()(any_observer<T, E, N> o) const { p->subscribe(std::move(o)); }
+
+  private:
+    struct base {
+        virtual ~base() {}
+        virtual base *move_to(void *dst) noexcept = 0;
+        virtual base *clone_to(void *dst) const = 0;
+        virtual void subscribe(any_observer<T, E, N> o) const = 0;
+    };
+
+    template <typename F, bool Inline>
+    struct model : base {
+        inline_holder<F, Inline> h;
+        template <typename F_>
+        explicit model(F_ &&f_) : h(std::forward<F_>(f_)) {}
+        base *move_to(void *dst) noexcept override { return new (dst) model(std::move(*this)); }
+        base *clone_to(void *dst) const override { return new (dst) model(*this); }
+        void subscribe(any_observer<T, E, N> o) const override { h.get()(std::move(o)); }
+    };
+
+    inline_ptr<base, N> p;
 };
 
 template <typename T>
@@ -128,7 +883,7 @@ template <typename F>
 using result_type = typename function_traits<F>::result_type;
 
 template <typename F>
-using first_argument_type = typename function_traits<F>::template arg<0>::type;
+using first_argument_type = std::decay_t<typename function_traits<F>::template arg<0>::type>;
 
 template <typename E = default_error_type, typename F>
 inline auto make_observer(F &&f) -> tuple_observer<first_argument_type<F>, E, F> {
@@ -145,17 +900,50 @@ inline auto make_observer(F &&f, G &&g, H &&h)
     return std::make_tuple(std::forward<F>(f), std::forward<G>(g), std::forward<H>(h));
 }
 
+// Makes the observer for subscribe's functions. One without an error
+// handler takes the observable's error type.
+template <typename E, typename F>
+inline auto make_observer_for(F &&f) {
+    return make_observer<E>(std::forward<F>(f));
+}
+template <typename E, typename F, typename... Fs>
+inline auto make_observer_for(F &&f, Fs &&... fs) {
+    return make_observer(std::forward<F>(f), std::forward<Fs>(fs)...);
+}
+
 template <typename T, typename E, typename F>
 struct observable;
 
-template <typename T, typename E = default_error_type, typename F>
-inline auto make_observable(F &&f) -> observable<T, E, F> {
+// Makes the observable for an operator. With RX_TRACE defined, each
+// subscription to it is traced as a stage with the given name.
+template <typename T, typename E, typename F>
+inline auto make_operator(const char *name, F &&f) {
+#ifdef RX_TRACE
+    using G = traced_generator<std::decay_t<F>>;
+    return observable<T, E, G>{G{name, std::forward<F>(f)}};
+#else
+    (void)name;
     return observable<T, E, F>{std::forward<F>(f)};
+#endif
+}
+
+template <typename T, typename E = default_error_type, typename F>
+inline auto make_observable(F &&f) {
+    return make_operator<T, E>("make_observable", std::forward<F>(f));
+}
+
+// Traces subscriptions to o under the given name, for sources and other
+// observables not made by an operator.
+template <typename Observable>
+inline auto traced(Observable o, const char *name) {
+    using T = typename Observable::value_type;
+    using E = typename Observable::error_type;
+    return make_operator<T, E>(name, [o](auto s){ o.subscribe(std::move(s)); });
 }
 
 template <typename E = default_error_type, typename T>
 inline auto pure_observable(T x) {
-    return make_observable<T, E>([x](auto s) {
+    return make_operator<T, E>("pure_observable", [x = std::move(x)](auto s) {
         s.send_next(x);
         s.send_completed();
     });
@@ -163,67 +951,1092 @@ inline auto pure_observable(T x) {
 
 template <typename T, typename E = default_error_type>
 inline auto empty_observable() {
-    return make_observable<T, E>([](auto s) { s.send_completed(); });
+    return make_operator<T, E>("empty_observable", [](auto s) { s.send_completed(); });
 }
 
 template <typename T, typename E>
 static auto error_observable(E e) {
-    return rx::make_observable<T, E>([e](auto s) { s.send_error(e); });
+    return make_operator<T, E>("error_observable", [e](auto s) { s.send_error(e); });
 }
 
-template <typename T, typename E = default_error_type>
-using any_observable = observable<T, E, std::function<void(any_observer<T>)>>;
+// Runs a flowable generator whenever its subscriber has outstanding demand.
+// One thread runs the loop at a time; requests made meanwhile from other
+// threads, or from inside emit, make it go round again.
+template <typename Observer, typename State, typename F>
+struct flowable_producer : producer {
+    Observer s;
+    State state;
+    F emit;
+    subscription sub;
+    std::atomic<int> wip{0};
+    bool done = false;
+
+    flowable_producer(Observer s_, State state_, F emit_)
+        : s(std::move(s_)), state(std::move(state_)), emit(std::move(emit_)),
+          sub(s.get_subscription()) {}
+
+    void resume() override {
+        if (wip.fetch_add(1, std::memory_order_acq_rel) != 0) {
+            return;
+        }
+        bool finished = false;
+        int missed = 1;
+        do {
+            for (size_t r; !done && (r = sub.requested()) != 0;) {
+                size_t n = 0;
+                for (; n < r && !done; ++n) {
+                    done = s.is_disposed() || !emit(state, s);
+                }
+                sub.produced(n);
+            }
+            finished = done;
+            missed = wip.fetch_sub(missed, std::memory_order_acq_rel) - missed;
+        } while (missed != 0);
+        if (finished) {
+            sub.clear_producer(this);
+        }
+    }
+};
+
+// Creates an observable that only sends values as they're requested. Each
+// subscription starts with a copy of initial, and emit(state, subscriber) is
+// called each time the subscriber is ready for another value. It should send
+// one value and return true, or send an error or completion and return false.
+//
+// Subscribers with unbounded demand run emit in a loop, like make_observable.
+// Otherwise emit may run on the thread that calls request.
+template <typename T, typename E = default_error_type, typename State, typename F>
+inline auto make_flowable(State initial, F &&emit) {
+    using F2 = std::decay_t<F>;
+    return make_operator<T, E>("make_flowable", [initial, emit = F2(std::forward<F>(emit))](auto s){
+        subscription sub = s.get_subscription();
+        if (sub.requested() == subscription::unbounded) {
+            State state = initial;
+            while (!s.is_disposed() && emit(state, s)) {}
+            return;
+        }
+        using P = flowable_producer<decltype(s), State, F2>;
+        auto p = make_state<P>(sub, std::move(s), initial, emit);
+        sub.set_producer(p);
+        p->resume();
+    });
+}
+
+template <typename T, typename E = default_error_type, size_t N = default_inline_size>
+using any_observable = observable<T, E, any_generator<T, E, N>>;
 
 // Specialize to implement
 template <typename> struct schedule_on;
 
-template <typename T, typename E, typename Observer>
-struct forwarding_observer {
-    using value_type = T;
-    Observer s;
-    forwarding_observer(Observer s_) : s(s_) {}
-
-    inline void send_next(T x) const { s.send_next(x); }
-    inline void send_error(E e) const { s.send_error(e); }
-    inline void send_completed() const { s.send_completed(); }
+// Converts the exception being handled into an error, for operators that run
+// functions that might throw. Other error types let the exception propagate.
+template <typename E>
+struct exception_error {
+    static Maybe<E> current() { return Nothing<E>(); }
+};
+
+template <>
+struct exception_error<std::exception_ptr> {
+    static Maybe<std::exception_ptr> current() { return Just(std::current_exception()); }
+};
+
+// std::system_errors become their error codes.
+template <>
+struct exception_error<std::error_code> {
+    static Maybe<std::error_code> current() {
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+        try {
+            throw;
+        } catch (const std::system_error &e) {
+            return Just(e.code());
+        } catch (...) {
+        }
+#endif
+        return Nothing<std::error_code>();
+    }
+};
+
+// Returns a scheduler that runs functions in the order they're scheduled, for
+// one subscription's deliveries. Schedulers for concurrent queues overload this.
+template <typename F>
+inline F serial_scheduler(const F &f) { return f; }
+
+// Lets a closure that's called as const move its captured value out, once.
+template <typename T>
+struct moving_value {
+    mutable T x;
+    inline T &&take() const { return std::move(x); }
+};
+
+template <typename T, typename E, typename Observer>
+struct forwarding_observer {
+    using value_type = T;
+    using error_type = E;
+    Observer s;
+    forwarding_observer(Observer s_) : s(std::move(s_)) {}
+
+    inline subscription get_subscription() const { return s.get_subscription(); }
+    inline bool is_disposed() const { return s.is_disposed(); }
+    inline void request(size_t n) const { s.request(n); }
+    inline void send_next(const T &x) const { s.send_next(x); }
+    inline void send_next(T &&x) const { s.send_next(std::move(x)); }
+    inline void send_error(E e) const { s.send_error(e); }
+    inline void send_completed() const { s.send_completed(); }
 };
 
 template <typename T, typename E, typename Observer>
 struct uncompletable_observer : forwarding_observer<T, E, Observer> {
-    uncompletable_observer(Observer s_) : forwarding_observer<T, E, Observer>(s_) {}
+    uncompletable_observer(Observer s_) : forwarding_observer<T, E, Observer>(std::move(s_)) {}
     inline void send_completed() const {}
 };
 
+enum class event_type : char { next, error, completed };
+
+// A recorded value, error or completion. The value and error share storage,
+// so events of infallible observables take no room for errors.
+template <typename T, typename E>
+struct notification {
+    // Wrap Objective-C objects to avoid hitting ARC restrictions on putting them
+    // directly in a union.
+    struct WT { T unwrap; };
+    struct WE { E unwrap; };
+
+    union {
+        WT value;
+        WE error;
+    };
+    event_type type;
+
+    explicit notification(WT x) : value(std::move(x)), type(event_type::next) {}
+    explicit notification(WE e) : error(std::move(e)), type(event_type::error) {}
+    explicit notification() : type(event_type::completed) {}
+
+    notification(const notification &other) : type(other.type) {
+        switch (type) {
+            case event_type::next:      new (&value) WT(other.value); break;
+            case event_type::error:     new (&error) WE(other.error); break;
+            case event_type::completed: break;
+        }
+    }
+    notification(notification &&other) noexcept(std::is_nothrow_move_constructible<T>::value &&
+                                                 std::is_nothrow_move_constructible<E>::value)
+        : type(other.type) {
+        switch (type) {
+            case event_type::next:      new (&value) WT(std::move(other.value)); break;
+            case event_type::error:     new (&error) WE(std::move(other.error)); break;
+            case event_type::completed: break;
+        }
+    }
+    notification &operator=(const notification &other) {
+        if (this != &other) {
+            this->~notification();
+            new (this) notification(other);
+        }
+        return *this;
+    }
+    notification &operator=(notification &&other) {
+        if (this != &other) {
+            this->~notification();
+            new (this) notification(std::move(other));
+        }
+        return *this;
+    }
+    ~notification() {
+        switch (type) {
+            case event_type::next:      value.~WT(); break;
+            case event_type::error:     error.~WE(); break;
+            case event_type::completed: break;
+        }
+    }
+
+    template <typename Observer>
+    void send(const Observer &o) const {
+        switch (type) {
+            case event_type::next:      o.send_next(value.unwrap); break;
+            case event_type::error:     o.send_error(error.unwrap); break;
+            case event_type::completed: o.send_completed(); break;
+        }
+    }
+
+    // Sends the event, moving the value out.
+    template <typename Observer>
+    void send_moved(const Observer &o) {
+        switch (type) {
+            case event_type::next:      o.send_next(std::move(value.unwrap)); break;
+            case event_type::error:     o.send_error(std::move(error.unwrap)); break;
+            case event_type::completed: o.send_completed(); break;
+        }
+    }
+};
+
+template <typename T> class batch_pool;
+
+// The storage behind a batch. It goes back to its pool when the last batch
+// referring to it is destroyed.
+template <typename T>
+struct batch_buffer {
+    std::vector<T> values;
+    std::atomic<size_t> refs{1};
+    // Set while the buffer is out of the pool.
+    std::shared_ptr<typename batch_pool<T>::state> pool;
+};
+
+// A reference-counted run of contiguous values from a batch_pool. Copies
+// share the values. Values can only be added while there are no copies.
+template <typename T>
+class batch {
+  public:
+    batch() = default;
+    batch(const batch &o) : b(o.b) {
+        if (b) {
+            b->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    batch(batch &&o) noexcept : b(o.b) { o.b = nullptr; }
+    batch &operator=(batch o) noexcept {
+        std::swap(b, o.b);
+        return *this;
+    }
+    ~batch() {
+        if (b && b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            batch_pool<T>::release(b);
+        }
+    }
+
+    const T *data() const { return b ? b->values.data() : nullptr; }
+    size_t size() const { return b ? b->values.size() : 0; }
+    bool empty() const { return size() == 0; }
+    const T *begin() const { return data(); }
+    const T *end() const { return data() + size(); }
+    const T &operator[](size_t i) const { return b->values[i]; }
+
+    // Whether this is the only reference to the values.
+    bool unique() const { return b && b->refs.load(std::memory_order_acquire) == 1; }
+
+    template <typename U>
+    void push_back(U &&x) {
+        assert(unique());
+        b->values.push_back(std::forward<U>(x));
+    }
+
+    // For filling the values in place, while there are no copies.
+    void resize(size_t n) {
+        assert(unique());
+        b->values.resize(n);
+    }
+    T *mutable_data() {
+        assert(unique());
+        return b->values.data();
+    }
+
+    // Moves the values out if this is the only reference to them, and
+    // copies them otherwise.
+    template <typename F>
+    void consume(F &&f) && {
+        if (unique()) {
+            for (T &x : b->values) {
+                f(std::move(x));
+            }
+        } else {
+            for (const T &x : *this) {
+                f(x);
+            }
+        }
+    }
+
+  private:
+    friend class batch_pool<T>;
+    explicit batch(batch_buffer<T> *b_) : b(b_) {}
+    batch_buffer<T> *b = nullptr;
+};
+
+template <typename T>
+bool operator==(const batch<T> &a, const batch<T> &b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end());
+}
+
+// Hands out batches whose buffers are reused once they're let go of, so a
+// steady stream of batches stops allocating once enough buffers are in use.
+// Copies refer to the same pool. Batches can be let go of on any thread, and
+// can outlive the pool.
+template <typename T>
+class batch_pool {
+  public:
+    // Keeps up to max_free unused buffers, each with room for capacity values.
+    explicit batch_pool(size_t capacity, size_t max_free = 16)
+        : st(std::make_shared<state>(capacity, max_free)) {}
+
+    batch<T> make() const {
+        batch_buffer<T> *b = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(st->m);
+            if (!st->free.empty()) {
+                b = st->free.back().release();
+                st->free.pop_back();
+            }
+        }
+        if (!b) {
+            b = new batch_buffer<T>;
+            b->values.reserve(st->capacity);
+        }
+        b->refs.store(1, std::memory_order_relaxed);
+        b->pool = st;
+        return batch<T>(b);
+    }
+
+  private:
+    friend class batch<T>;
+    friend struct batch_buffer<T>;
+
+    struct state {
+        size_t capacity;
+        size_t max_free;
+        std::mutex m;
+        std::vector<std::unique_ptr<batch_buffer<T>>> free;
+        state(size_t capacity_, size_t max_free_) : capacity(capacity_), max_free(max_free_) {}
+    };
+
+    static void release(batch_buffer<T> *b) {
+        b->values.clear();
+        // Dropped after b is back in the pool, which may free the pool and b.
+        std::shared_ptr<state> st = std::move(b->pool);
+        std::lock_guard<std::mutex> lock(st->m);
+        if (st->free.size() < st->max_free) {
+            st->free.emplace_back(b);
+        } else {
+            delete b;
+        }
+    }
+
+    std::shared_ptr<state> st;
+};
+
+// Sends a batch's values to each subscriber, then completes. Like
+// pure_observable, it ignores demand.
+template <typename T>
+struct batch_replay {
+    batch<T> values;
+
+    template <typename Observer>
+    void operator()(Observer s) const {
+        for (const T &x : values) {
+            if (s.is_disposed()) {
+                return;
+            }
+            s.send_next(x);
+        }
+        s.send_completed();
+    }
+};
+
+template <typename T, typename E = default_error_type>
+using batch_observable = observable<T, E, batch_replay<T>>;
+
+struct replay_limits;
+template <typename T, typename E> struct replay_subject;
+template <typename T, typename E> struct publish_subject;
+template <typename Subject> struct locked_subject;
+template <typename T, typename E, typename Source, typename Subject> class connectable_observable;
+
 template <typename T, typename E, typename Derived>
 struct observable_methods {
     using value_type = T;
     using error_type = E;
 
+    template <typename Observer, typename F>
+    struct map_observer : forwarding_observer<T, E, Observer> {
+        F f;
+        map_observer(Observer s_, F f_)
+            : forwarding_observer<T, E, Observer>(std::move(s_)), f(f_) {}
+
+        inline void send_next(const T &x) const { this->s.send_next(f(x)); }
+        inline void send_next(T &&x) const { this->s.send_next(f(std::move(x))); }
+    };
+
     template <typename F>
     auto map(F &&f) {
-        return bind([f](T x){
-            return pure_observable(f(x));
+        using F2 = std::decay_t<F>;
+        using T2 = decltype(f(std::declval<T>()));
+        return make_operator<T2, E>("map", [f, me = *This()](auto s){
+            me.subscribe(map_observer<decltype(s), F2>{std::move(s), f});
+        });
+    }
+
+    template <typename Observer, typename F>
+    struct filter_observer : forwarding_observer<T, E, Observer> {
+        F f;
+        filter_observer(Observer s_, F f_)
+            : forwarding_observer<T, E, Observer>(std::move(s_)), f(f_) {}
+
+        // Dropped values are requested again, so that a flowable source
+        // sends as many values as the subscriber asked for.
+        inline void send_next(const T &x) const {
+            if (f(x)) {
+                this->s.send_next(x);
+            } else {
+                this->s.request(1);
+            }
+        }
+        inline void send_next(T &&x) const {
+            if (f(static_cast<const T &>(x))) {
+                this->s.send_next(std::move(x));
+            } else {
+                this->s.request(1);
+            }
+        }
+    };
+
+    template <typename F>
+    auto filter(F &&f) {
+        using F2 = std::decay_t<F>;
+        return make_operator<T, E>("filter", [f, me = *This()](auto s){
+            me.subscribe(filter_observer<decltype(s), F2>{std::move(s), f});
+        });
+    }
+
+    // Stateful operators keep their state behind a pointer created once per
+    // subscription, since observers are copied freely (e.g. by bind).
+    template <typename Observer, typename U, typename F>
+    struct scan_observer : forwarding_observer<T, E, Observer> {
+        F f;
+        std::shared_ptr<U> acc;
+        scan_observer(Observer s_, F f_, U seed)
+            : forwarding_observer<T, E, Observer>(std::move(s_)), f(f_),
+              acc(make_state<U>(this->s.get_subscription(), std::move(seed))) {}
+
+        inline void send_next(const T &x) const { next(x); }
+        inline void send_next(T &&x) const { next(std::move(x)); }
+
+        // The accumulator is moved into f so growing accumulators aren't
+        // copied; the value sent on is the one copy scan has to keep.
+        template <typename X>
+        inline void next(X &&x) const {
+            *acc = f(std::move(*acc), std::forward<X>(x));
+            this->s.send_next(static_cast<const U &>(*acc));
+        }
+    };
+
+    template <typename U, typename F>
+    auto scan(U seed, F &&f) {
+        using F2 = std::decay_t<F>;
+        return make_operator<U, E>("scan", [seed, f, me = *This()](auto s){
+            me.subscribe(scan_observer<decltype(s), U, F2>{std::move(s), f, seed});
+        });
+    }
+
+    template <typename Observer>
+    struct take_observer : forwarding_observer<T, E, Observer> {
+        std::shared_ptr<size_t> remaining;
+        take_observer(Observer s_, size_t n)
+            : forwarding_observer<T, E, Observer>(std::move(s_)), remaining(make_state<size_t>(this->s.get_subscription(), n)) {}
+
+        // Lets the generator stop once enough values have been taken.
+        inline bool is_disposed() const { return *remaining == 0 || this->s.is_disposed(); }
+        inline void send_next(const T &x) const { next(x); }
+        inline void send_next(T &&x) const { next(std::move(x)); }
+
+        template <typename X>
+        inline void next(X &&x) const {
+            if (*remaining == 0) {
+                return;
+            }
+            this->s.send_next(std::forward<X>(x));
+            if (--*remaining == 0) {
+                this->s.send_completed();
+            }
+        }
+        inline void send_error(E e) const {
+            if (*remaining != 0) {
+                this->s.send_error(e);
+            }
+        }
+        inline void send_completed() const {
+            if (*remaining != 0) {
+                this->s.send_completed();
+            }
+        }
+    };
+
+    auto take(size_t n) {
+        return make_operator<T, E>("take", [n, me = *This()](auto s){
+            if (n == 0) {
+                s.send_completed();
+                return;
+            }
+            me.subscribe(take_observer<decltype(s)>{std::move(s), n});
+        });
+    }
+
+    template <typename Observer, typename F>
+    struct take_while_observer : forwarding_observer<T, E, Observer> {
+        F f;
+        std::shared_ptr<bool> done;
+        take_while_observer(Observer s_, F f_)
+            : forwarding_observer<T, E, Observer>(std::move(s_)), f(f_), done(make_state<bool>(this->s.get_subscription(), false)) {}
+
+        inline bool is_disposed() const { return *done || this->s.is_disposed(); }
+        inline void send_next(const T &x) const { next(x); }
+        inline void send_next(T &&x) const { next(std::move(x)); }
+
+        template <typename X>
+        inline void next(X &&x) const {
+            if (*done) {
+                return;
+            }
+            if (f(static_cast<const T &>(x))) {
+                this->s.send_next(std::forward<X>(x));
+            } else {
+                *done = true;
+                this->s.send_completed();
+            }
+        }
+        inline void send_error(E e) const {
+            if (!*done) {
+                this->s.send_error(e);
+            }
+        }
+        inline void send_completed() const {
+            if (!*done) {
+                this->s.send_completed();
+            }
+        }
+    };
+
+    // Completes at the first value f rejects.
+    template <typename F>
+    auto take_while(F &&f) {
+        using F2 = std::decay_t<F>;
+        return make_operator<T, E>("take_while", [f, me = *This()](auto s){
+            me.subscribe(take_while_observer<decltype(s), F2>{std::move(s), f});
+        });
+    }
+
+    // Events from the source and the notifier can arrive on different
+    // threads, so they're passed on under a lock. It's recursive so that a
+    // subscriber can trigger the notifier itself.
+    template <typename Observer>
+    struct take_until_state {
+        Observer s;
+        subscription notifier;
+        std::recursive_mutex m;
+        std::atomic<bool> done{false};
+
+        explicit take_until_state(Observer s_) : s(std::move(s_)) {}
+
+        template <typename F>
+        void send(F &&f, bool last) {
+            {
+                std::lock_guard<std::recursive_mutex> lock(m);
+                if (done.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                if (last) {
+                    done.store(true, std::memory_order_release);
+                }
+                f(s);
+            }
+            if (last) {
+                notifier.dispose();
+            }
+        }
+    };
+
+    template <typename Observer>
+    struct take_until_observer {
+        using value_type = T;
+        using error_type = E;
+        std::shared_ptr<take_until_state<Observer>> st;
+
+        inline subscription get_subscription() const { return st->s.get_subscription(); }
+        inline bool is_disposed() const {
+            return st->done.load(std::memory_order_acquire) || st->s.is_disposed();
+        }
+        inline void request(size_t n) const { st->s.request(n); }
+        inline void send_next(const T &x) const {
+            st->send([&x](const Observer &s){ s.send_next(x); }, false);
+        }
+        inline void send_next(T &&x) const {
+            st->send([&x](const Observer &s){ s.send_next(std::move(x)); }, false);
+        }
+        inline void send_error(E e) const {
+            st->send([&e](const Observer &s){ s.send_error(std::move(e)); }, true);
+        }
+        inline void send_completed() const {
+            st->send([](const Observer &s){ s.send_completed(); }, true);
+        }
+    };
+
+    template <typename Observer, typename U>
+    struct take_until_notifier {
+        using value_type = U;
+        using error_type = E;
+        std::shared_ptr<take_until_state<Observer>> st;
+
+        inline void send_next(const U &) const {
+            st->send([](const Observer &s){ s.send_completed(); }, true);
+        }
+        inline void send_next(U &&x) const { send_next(static_cast<const U &>(x)); }
+        inline void send_error(E e) const {
+            st->send([&e](const Observer &s){ s.send_error(std::move(e)); }, true);
+        }
+        inline void send_completed() const {}
+    };
+
+    // Completes when other sends its first value. other is unsubscribed from
+    // when this completes, errors or is disposed.
+    template <typename Observable>
+    auto take_until(Observable other) {
+        using U = typename Observable::value_type;
+        static_assert(std::is_same<E, typename Observable::error_type>(), "Error types must match");
+        return make_operator<T, E>("take_until", [other, me = *This()](auto s){
+            using S = decltype(s);
+            using State = take_until_state<S>;
+            auto st = make_state<State>(s.get_subscription(), std::move(s));
+            st->s.get_subscription().add([n = st->notifier]{ n.dispose(); });
+            other.subscribe(with_subscription(take_until_notifier<S, U>{st}, st->notifier));
+            me.subscribe(take_until_observer<S>{st});
         });
     }
 
+    template <typename Observer>
+    struct skip_observer : forwarding_observer<T, E, Observer> {
+        std::shared_ptr<size_t> remaining;
+        skip_observer(Observer s_, size_t n)
+            : forwarding_observer<T, E, Observer>(std::move(s_)), remaining(make_state<size_t>(this->s.get_subscription(), n)) {}
+
+        inline void send_next(const T &x) const { next(x); }
+        inline void send_next(T &&x) const { next(std::move(x)); }
+
+        template <typename X>
+        inline void next(X &&x) const {
+            if (*remaining != 0) {
+                --*remaining;
+                this->s.request(1);
+                return;
+            }
+            this->s.send_next(std::forward<X>(x));
+        }
+    };
+
+    auto skip(size_t n) {
+        return make_operator<T, E>("skip", [n, me = *This()](auto s){
+            me.subscribe(skip_observer<decltype(s)>{std::move(s), n});
+        });
+    }
+
+    template <typename Observer>
+    struct distinct_observer : forwarding_observer<T, E, Observer> {
+        std::shared_ptr<Maybe<T>> last;
+        distinct_observer(Observer s_)
+            : forwarding_observer<T, E, Observer>(std::move(s_)), last(make_state<Maybe<T>>(this->s.get_subscription())) {}
+
+        inline void send_next(const T &x) const { next(x); }
+        inline void send_next(T &&x) const { next(std::move(x)); }
+
+        template <typename X>
+        inline void next(X &&x) const {
+            const T *prev = last->orNull();
+            if (prev && *prev == x) {
+                this->s.request(1);
+                return;
+            }
+            *last = Just<T>(x);
+            this->s.send_next(std::forward<X>(x));
+        }
+    };
+
+    auto distinct_until_changed() {
+        return make_operator<T, E>("distinct_until_changed", [me = *This()](auto s){
+            me.subscribe(distinct_observer<decltype(s)>{std::move(s)});
+        });
+    }
+
+    // The source and the inner observables of bind don't send values one
+    // for one, so they can't share the subscriber's demand. They're given an
+    // unbounded subscription that's disposed along with the subscriber's.
+    template <typename U, typename E2, typename Observer>
+    struct bind_inner_observer : uncompletable_observer<U, E2, Observer> {
+        subscription sub;
+        bind_inner_observer(Observer s_, subscription sub_)
+            : uncompletable_observer<U, E2, Observer>(std::move(s_)), sub(std::move(sub_)) {}
+
+        inline subscription get_subscription() const { return sub; }
+        inline void request(size_t) const {}
+        inline void send_error(E2 e) const {
+            this->s.send_error(convert_error<typename Observer::error_type>(std::move(e)));
+        }
+    };
+
     template <typename Observer, typename F>
     struct bind_observer : forwarding_observer<T, E, Observer> {
         F f;
-        bind_observer(Observer s_, F f_)
-            : forwarding_observer<T, E, Observer>(s_), f(f_) {}
+        subscription sub;
+        bind_observer(Observer s_, F f_, subscription sub_)
+            : forwarding_observer<T, E, Observer>(std::move(s_)), f(f_), sub(std::move(sub_)) {}
+
+        inline subscription get_subscription() const { return sub; }
+        inline void request(size_t) const {}
+        inline void send_next(const T &x) const { next(x); }
+        inline void send_next(T &&x) const { next(std::move(x)); }
+
+        template <typename X>
+        inline void next(X &&x) const {
+            using O = decltype(f(std::forward<X>(x)));
+            using U = typename O::value_type;
+            using E2 = typename O::error_type;
+            f(std::forward<X>(x)).subscribe(bind_inner_observer<U, E2, Observer>{this->s, sub});
+        }
 
-        inline void send_next(T x) const {
-            using U = typename decltype(f(x))::value_type;
-            f(x).subscribe(uncompletable_observer<U, E, Observer>{this->s});
+        inline void send_error(E e) const {
+            this->s.send_error(convert_error<typename Observer::error_type>(std::move(e)));
         }
     };
 
+    // The inner observables' error type can differ from the source's: see
+    // joined_error.
     template <typename F>
     auto bind(F &&f) {
         using T2 = typename result_type<F>::value_type;
-        using E2 = typename result_type<F>::error_type;
-        return make_observable<T2, E2>([f, me = *This()](auto s){
-            me.subscribe(bind_observer<decltype(s), F>{s,f});
+        using E2 = joined_error<E, typename result_type<F>::error_type>;
+        return make_operator<T2, E2>("bind", [f, me = *This()](auto s){
+            // Each inner observable gets its own copy of the subscriber.
+            using S = copyable_observer<T2, E2, decltype(s)>;
+            subscription sub = s.get_subscription().child();
+            me.subscribe(bind_observer<S, std::decay_t<F>>{S(std::move(s)), f, sub});
+        });
+    }
+
+    // Inner observables can send from any thread, so events are passed on
+    // under a lock. It's recursive so that inner observables can send while
+    // they're being subscribed to from a subscriber callback.
+    template <typename Observer, typename F>
+    struct flat_map_state {
+        Observer s;
+        F f;
+        size_t max_concurrent;
+        // The source's subscription. It's bounded by max_concurrent, and an
+        // inner observable finishing requests one more.
+        subscription outer;
+
+        std::recursive_mutex m;
+        // Values waiting for an inner observable to finish.
+        std::deque<T> pending;
+        // The subscriptions of the inner observables that haven't finished.
+        std::list<subscription> inners;
+        bool draining = false;
+        bool outer_done = false;
+        std::atomic<bool> done{false};
+
+        flat_map_state(Observer s_, F f_, size_t max_concurrent_)
+            : s(std::move(s_)), f(std::move(f_)),
+              max_concurrent(max_concurrent_ ? max_concurrent_ : 1),
+              outer(s.get_subscription().child(max_concurrent)) {}
+
+        template <typename X>
+        static void push(const std::shared_ptr<flat_map_state> &st, X &&x) {
+            {
+                std::lock_guard<std::recursive_mutex> lock(st->m);
+                if (st->done.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                st->pending.push_back(std::forward<X>(x));
+            }
+            drain(st);
+        }
+
+        // Subscribes to inner observables while there's room, on one thread
+        // at a time. Values pushed meanwhile, including by inner observables
+        // that finish before subscribe returns, are picked up by its loop.
+        static void drain(const std::shared_ptr<flat_map_state> &st) {
+            std::unique_lock<std::recursive_mutex> lock(st->m);
+            if (st->draining) {
+                return;
+            }
+            st->draining = true;
+            while (!st->done.load(std::memory_order_relaxed) && !st->pending.empty() &&
+                   st->inners.size() < st->max_concurrent) {
+                T x = std::move(st->pending.front());
+                st->pending.pop_front();
+                auto it = st->inners.emplace(st->inners.end());
+                lock.unlock();
+                auto inner = st->f(std::move(x));
+                using U = typename decltype(inner)::value_type;
+                using E2 = typename decltype(inner)::error_type;
+                inner.subscribe(flat_map_inner_observer<U, E2, flat_map_state>{st, it, *it});
+                lock.lock();
+            }
+            st->draining = false;
+            st->complete_if_finished();
+        }
+
+        void complete_if_finished() {
+            if (!done.load(std::memory_order_relaxed) && !draining && outer_done &&
+                pending.empty() && inners.empty()) {
+                done.store(true, std::memory_order_release);
+                s.send_completed();
+            }
+        }
+
+        template <typename U>
+        void next(U &&x) {
+            std::lock_guard<std::recursive_mutex> lock(m);
+            if (!done.load(std::memory_order_relaxed)) {
+                s.send_next(std::forward<U>(x));
+            }
+        }
+
+        void outer_completed() {
+            std::lock_guard<std::recursive_mutex> lock(m);
+            outer_done = true;
+            complete_if_finished();
+        }
+
+        static void inner_completed(const std::shared_ptr<flat_map_state> &st,
+                                    std::list<subscription>::iterator it) {
+            subscription sub = *it;
+            {
+                std::lock_guard<std::recursive_mutex> lock(st->m);
+                if (st->done.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                st->inners.erase(it);
+            }
+            sub.dispose();
+            if (st->max_concurrent != subscription::unbounded) {
+                st->outer.request(1);
+            }
+            drain(st);
+        }
+
+        // Sends the first error, and disposes the source and every inner
+        // observable.
+        template <typename E2>
+        void fail(E2 e) {
+            {
+                std::lock_guard<std::recursive_mutex> lock(m);
+                if (done.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                done.store(true, std::memory_order_release);
+                s.send_error(convert_error<typename Observer::error_type>(std::move(e)));
+            }
+            cancel();
+        }
+
+        void cancel() {
+            std::vector<subscription> subs;
+            {
+                std::lock_guard<std::recursive_mutex> lock(m);
+                done.store(true, std::memory_order_release);
+                subs.assign(inners.begin(), inners.end());
+                pending.clear();
+            }
+            outer.dispose();
+            for (auto &sub : subs) {
+                sub.dispose();
+            }
+        }
+    };
+
+    template <typename State>
+    struct flat_map_outer_observer {
+        using value_type = T;
+        using error_type = E;
+        std::shared_ptr<State> st;
+
+        inline subscription get_subscription() const { return st->outer; }
+        inline bool is_disposed() const {
+            return st->done.load(std::memory_order_acquire) || st->outer.is_disposed();
+        }
+        inline void request(size_t n) const { st->outer.request(n); }
+        inline void send_next(const T &x) const { State::push(st, x); }
+        inline void send_next(T &&x) const { State::push(st, std::move(x)); }
+        inline void send_error(E e) const { st->fail(std::move(e)); }
+        inline void send_completed() const { st->outer_completed(); }
+    };
+
+    template <typename U, typename E2, typename State>
+    struct flat_map_inner_observer {
+        using value_type = U;
+        using error_type = E2;
+        std::shared_ptr<State> st;
+        std::list<subscription>::iterator it;
+        subscription sub;
+
+        inline subscription get_subscription() const { return sub; }
+        inline bool is_disposed() const { return sub.is_disposed(); }
+        inline void request(size_t) const {}
+        inline void send_next(const U &x) const { st->next(x); }
+        inline void send_next(U &&x) const { st->next(std::move(x)); }
+        inline void send_error(E2 e) const { st->fail(std::move(e)); }
+        inline void send_completed() const { State::inner_completed(st, it); }
+    };
+
+    // Like bind, but subscribes to up to max_concurrent inner observables at
+    // once, which may send from any thread. Their events are sent on one at a
+    // time. Completes once the source and every inner observable have.
+    template <typename F>
+    auto flat_map(F &&f, size_t max_concurrent = subscription::unbounded) {
+        using T2 = typename result_type<F>::value_type;
+        using E2 = joined_error<E, typename result_type<F>::error_type>;
+        using F2 = std::decay_t<F>;
+        return make_operator<T2, E2>("flat_map", [f, max_concurrent, me = *This()](auto s){
+            using State = flat_map_state<decltype(s), F2>;
+            auto st = make_state<State>(s.get_subscription(), std::move(s), f, max_concurrent);
+            std::weak_ptr<State> weak = st;
+            st->s.get_subscription().add([weak]{
+                if (auto st = weak.lock()) {
+                    st->cancel();
+                }
+            });
+            me.subscribe(flat_map_outer_observer<State>{st});
+        });
+    }
+
+    // For an observable of observables, sends the values of all of them as
+    // they arrive.
+    auto merge(size_t max_concurrent = subscription::unbounded) {
+        return flat_map([](T o){ return o; }, max_concurrent);
+    }
+
+    // For an observable of observables, sends the values of each of them in
+    // turn.
+    auto concat() {
+        return merge(1);
+    }
+
+    // Batches don't go one for one with the source's values, so like bind,
+    // the source is given an unbounded subscription that's disposed along
+    // with the subscriber's.
+    template <typename Observer>
+    struct buffer_observer : forwarding_observer<T, E, Observer> {
+        struct state {
+            batch_pool<T> pool;
+            size_t n, skip;
+            size_t index = 0;
+            // Batches being filled, oldest first. There are at most n / skip
+            // of them, and a vector doesn't allocate as they come and go.
+            std::vector<batch<T>> open;
+            state(size_t n_, size_t skip_) : pool(n_), n(n_), skip(skip_) {}
+        };
+        std::shared_ptr<state> st;
+        subscription sub;
+        buffer_observer(Observer s_, size_t n, size_t skip, subscription sub_)
+            : forwarding_observer<T, E, Observer>(std::move(s_)),
+              st(make_state<state>(sub_, n, skip)), sub(std::move(sub_)) {}
+
+        inline subscription get_subscription() const { return sub; }
+        inline bool is_disposed() const { return sub.is_disposed(); }
+        inline void request(size_t) const {}
+        inline void send_next(const T &x) const { next(x); }
+        inline void send_next(T &&x) const { next(std::move(x)); }
+
+        // Every open batch but the newest gets a copy.
+        template <typename X>
+        inline void next(X &&x) const {
+            if (st->index++ % st->skip == 0) {
+                st->open.push_back(st->pool.make());
+            }
+            if (st->open.empty()) {
+                return;
+            }
+            for (size_t i = 0, last = st->open.size() - 1; i < last; ++i) {
+                st->open[i].push_back(static_cast<const T &>(x));
+            }
+            st->open.back().push_back(std::forward<X>(x));
+            if (st->open.front().size() == st->n) {
+                batch<T> full = std::move(st->open.front());
+                st->open.erase(st->open.begin());
+                this->s.send_next(std::move(full));
+            }
+        }
+
+        inline void send_error(E e) const {
+            st->open.clear();
+            this->s.send_error(std::move(e));
+        }
+
+        inline void send_completed() const {
+            std::vector<batch<T>> rest;
+            rest.swap(st->open);
+            for (auto &b : rest) {
+                this->s.send_next(std::move(b));
+            }
+            this->s.send_completed();
+        }
+    };
+
+    // Sends batches of n values, starting a new batch every skip values.
+    // Batches overlap if skip is less than n, and values are dropped between
+    // them if it's more. Batches come from a pool for each subscription, and
+    // their buffers are reused once the subscriber lets go of them. Values
+    // left over when the source completes are sent in shorter batches.
+    auto buffer(size_t n, size_t skip) {
+        n = n ? n : 1;
+        skip = skip ? skip : 1;
+        return make_operator<batch<T>, E>("buffer", [n, skip, me = *This()](auto s){
+            subscription sub = s.get_subscription().child();
+            me.subscribe(buffer_observer<decltype(s)>{std::move(s), n, skip, sub});
+        });
+    }
+
+    auto buffer(size_t n) {
+        return buffer(n, n);
+    }
+
+    // Sends an observable for each run of n values once the run is complete,
+    // which replays the run to each subscriber. Runs are kept in batches from
+    // a pool for each subscription, as with buffer. What's left when the
+    // source completes is sent as a shorter run, and dropped on an error.
+    auto window(size_t n);
+
+    // Each value sent may be many, so the source is given an unbounded
+    // subscription, as with bind.
+    template <typename Observer>
+    struct flatten_observer : forwarding_observer<T, E, Observer> {
+        subscription sub;
+        flatten_observer(Observer s_, subscription sub_)
+            : forwarding_observer<T, E, Observer>(std::move(s_)), sub(std::move(sub_)) {}
+
+        inline subscription get_subscription() const { return sub; }
+        inline bool is_disposed() const { return sub.is_disposed(); }
+        inline void request(size_t) const {}
+        inline void send_next(const T &xs) const {
+            for (const auto &x : xs) {
+                if (sub.is_disposed()) {
+                    return;
+                }
+                this->s.send_next(x);
+            }
+        }
+        inline void send_next(T &&xs) const { move_out(std::move(xs)); }
+
+        template <typename U>
+        inline void move_out(batch<U> &&xs) const {
+            std::move(xs).consume([this](auto &&x){
+                if (!sub.is_disposed()) {
+                    this->s.send_next(std::forward<decltype(x)>(x));
+                }
+            });
+        }
+        template <typename Container>
+        inline void move_out(Container &&xs) const {
+            for (auto &x : xs) {
+                if (sub.is_disposed()) {
+                    return;
+                }
+                this->s.send_next(std::move(x));
+            }
+        }
+    };
+
+    // For an observable of batches or other containers, sends each of their
+    // values in turn.
+    auto flatten() {
+        using T2 = std::decay_t<decltype(*std::begin(std::declval<T &>()))>;
+        return make_operator<T2, E>("flatten", [me = *This()](auto s){
+            subscription sub = s.get_subscription().child();
+            me.subscribe(flatten_observer<decltype(s)>{std::move(s), sub});
         });
     }
 
@@ -231,44 +2044,163 @@ struct observable_methods {
     struct catch_to_observer : forwarding_observer<T, E, Observer> {
         Observable o;
         catch_to_observer(Observer s_, Observable o_)
-            : forwarding_observer<T, E, Observer>(s_), o(o_) {}
+            : forwarding_observer<T, E, Observer>(std::move(s_)), o(o_) {}
 
         inline void send_error(E) const { o.subscribe(this->s); }
     };
 
+    // Errors come from o from then on, so the result has o's error type. An
+    // infallible o makes the result infallible.
     template <typename Observable>
     auto catch_to(Observable o) {
         using T2 = typename Observable::value_type;
         using E2 = typename Observable::error_type;
         static_assert(std::is_same<T, T2>(), "Value types must match");
-        static_assert(std::is_same<E, E2>(), "Error types must match");
-        return make_observable<T2, E2>([o, me = *This()](auto s) {
-            me.subscribe(catch_to_observer<decltype(s), Observable>{s, o});
+        return make_operator<T2, E2>("catch_to", [o, me = *This()](auto s) {
+            using S = copyable_observer<T2, E2, decltype(s)>;
+            me.subscribe(catch_to_observer<S, Observable>{S(std::move(s)), o});
         });
     }
 
+    template <typename Observer, typename F>
+    struct map_error_observer : forwarding_observer<T, E, Observer> {
+        F f;
+        map_error_observer(Observer s_, F f_)
+            : forwarding_observer<T, E, Observer>(std::move(s_)), f(f_) {}
+
+        inline void send_error(E e) const { this->s.send_error(f(std::move(e))); }
+    };
+
+    // Sends f(e) for the error e.
+    template <typename F>
+    auto map_error(F &&f) {
+        using F2 = std::decay_t<F>;
+        using E2 = std::decay_t<decltype(f(std::declval<E>()))>;
+        return make_operator<T, E2>("map_error", [f, me = *This()](auto s){
+            me.subscribe(map_error_observer<decltype(s), F2>{std::move(s), f});
+        });
+    }
+
+    // Converts errors to E2 with error_conversion. Infallible observables
+    // can take any error type, for operators that need one.
+    template <typename E2>
+    auto with_error_type() {
+        return map_error([](E e){ return convert_error<E2>(std::move(e)); });
+    }
+
+    template <typename Observer, typename F>
+    struct deliver_observer {
+        using value_type = T;
+        using error_type = E;
+        F f;
+        Observer s;
+        deliver_observer(F f_, Observer s_) : f(f_), s(std::move(s_)) {}
+
+        inline subscription get_subscription() const { return s.get_subscription(); }
+        inline bool is_disposed() const { return s.is_disposed(); }
+        inline void request(size_t n) const { s.request(n); }
+
+        inline void send_next(const T &x) const { send_next(T(x)); }
+        inline void send_next(T &&x) const {
+            f([s = s, v = moving_value<T>{std::move(x)}]{ s.send_next(v.take()); });
+        }
+        inline void send_error(E e)  const { f([s = s, e]{ s.send_error(e); }); }
+        inline void send_completed() const { f([s = s]{ s.send_completed(); }); }
+    };
+
     template <typename F>
     auto deliver_with(F f) {
-        struct deliver_observer {
-            using value_type = T;
-            F f;
-            any_observer<T> s;
-            deliver_observer(F fn_, any_observer<T> s_) : f(fn_), s(s_) {}
+        return make_operator<T, E>("deliver_on", [f, me = *This()](auto s){
+            // Each scheduled event carries its own copy of the subscriber.
+            using S = copyable_observer<T, E, decltype(s)>;
+            auto g = serial_scheduler(f);
+            me.subscribe(deliver_observer<S, decltype(g)>{g, S(std::move(s))});
+        });
+    }
+
+    // Events are queued per subscription and delivered by at most one scheduled
+    // drain at a time, up to max_batch events per drain.
+    template <typename Observer, typename F>
+    struct batch_deliver_observer {
+        using value_type = T;
+        using error_type = E;
+        using event = notification<T, E>;
 
-            inline void send_next(T x)   const { f([s = s, x]{ s.send_next(x); }); }
-            inline void send_error(E e)  const { f([s = s, e]{ s.send_error(e); }); }
-            inline void send_completed() const { f([s = s]{ s.send_completed(); }); }
+        struct state {
+            Observer s;
+            F f;
+            size_t max_batch;
+            std::mutex m;
+            std::vector<event> incoming;
+            bool scheduled = false;
+            // Only touched by the drain.
+            std::vector<event> outgoing;
+            size_t next = 0;
+
+            state(Observer s_, F f_, size_t max_batch_)
+                : s(std::move(s_)), f(std::move(f_)), max_batch(max_batch_ ? max_batch_ : 1) {}
         };
-        return make_observable<T, E>([f, me = *This()](auto s){
-            me.subscribe(deliver_observer{f, s});
+        std::shared_ptr<state> st;
+
+        batch_deliver_observer(F f, Observer s, size_t max_batch)
+            : st(make_state<state>(s.get_subscription(), std::move(s), std::move(f), max_batch)) {}
+
+        inline subscription get_subscription() const { return st->s.get_subscription(); }
+        inline bool is_disposed() const { return st->s.is_disposed(); }
+        inline void request(size_t n) const { st->s.request(n); }
+        inline void send_next(const T &x) const { push(event{typename event::WT{x}}); }
+        inline void send_next(T &&x) const { push(event{typename event::WT{std::move(x)}}); }
+        inline void send_error(E e) const { push(event{typename event::WE{std::move(e)}}); }
+        inline void send_completed() const { push(event{}); }
+
+        void push(event &&e) const {
+            {
+                std::lock_guard<std::mutex> lock(st->m);
+                st->incoming.push_back(std::move(e));
+                RX_TRACE_QUEUE_DEPTH(st->incoming.size());
+                if (st->scheduled) {
+                    return;
+                }
+                st->scheduled = true;
+            }
+            st->f([st = st]{ drain(st); });
+        }
+
+        static void drain(const std::shared_ptr<state> &st) {
+            for (size_t n = 0;; ++n) {
+                if (st->next == st->outgoing.size()) {
+                    st->outgoing.clear();
+                    st->next = 0;
+                    std::lock_guard<std::mutex> lock(st->m);
+                    if (st->incoming.empty()) {
+                        st->scheduled = false;
+                        return;
+                    }
+                    st->outgoing.swap(st->incoming);
+                }
+                if (n == st->max_batch) {
+                    st->f([st]{ drain(st); });
+                    return;
+                }
+                st->outgoing[st->next++].send_moved(st->s);
+            }
+        }
+    };
+
+    template <typename F>
+    auto deliver_with(F f, size_t max_batch) {
+        return make_operator<T, E>("deliver_on", [f, max_batch, me = *This()](auto s){
+            auto g = serial_scheduler(f);
+            me.subscribe(batch_deliver_observer<decltype(s), decltype(g)>{g, std::move(s), max_batch});
         });
     }
 
     template <typename F>
     auto subscribe_with(F f) {
         auto me = *This();
-        return make_observable<T, E>([f, me](auto s){
-            f([s, me]{
+        return make_operator<T, E>("subscribe_on", [f, me](auto s){
+            using S = copyable_observer<T, E, decltype(s)>;
+            f([s = S(std::move(s)), me]{
                 me.subscribe(s);
             });
         });
@@ -279,17 +2211,236 @@ struct observable_methods {
         return deliver_with(schedule_on<Q>{}(q));
     }
 
+    template <typename Q>
+    auto deliver_on(Q q, size_t max_batch) {
+        return deliver_with(schedule_on<Q>{}(q), max_batch);
+    }
+
     template <typename Q>
     auto subscribe_on(Q q) {
         return subscribe_with(schedule_on<Q>{}(q));
     }
 
-    auto any() -> any_observable<T, E> {
-        return any_observable<T, E>([me = *This()](auto s){
-            me.subscribe(s);
+    // Runs f on a scheduler for up to max_in_flight values at a time. The
+    // source waits when that many are in flight. Results wait in a ring of
+    // max_in_flight slots until the ones before them have been sent, unless
+    // Ordered is false, in which case they're sent as soon as they're ready.
+    template <typename Observer, typename U, typename F, typename G, bool Ordered>
+    struct parallel_map_state {
+        Observer s;
+        F f;
+        G g;
+        size_t max_in_flight;
+
+        std::mutex m;
+        std::condition_variable room;
+        std::vector<Maybe<U>> slots;
+        std::deque<U> ready;
+        // Values taken from the source, and results sent on.
+        size_t started = 0;
+        size_t emitted = 0;
+        bool emitting = false;
+        bool source_done = false;
+        bool finished = false;
+        std::atomic<bool> failed{false};
+        Maybe<E> error;
+
+        parallel_map_state(Observer s_, F f_, G g_, size_t max_in_flight_)
+            : s(std::move(s_)), f(std::move(f_)), g(std::move(g_)),
+              max_in_flight(max_in_flight_ ? max_in_flight_ : 1),
+              slots(Ordered ? max_in_flight : 0) {}
+
+        bool stopped() const { return failed.load(std::memory_order_acquire) || s.is_disposed(); }
+
+        template <typename X>
+        static void start(const std::shared_ptr<parallel_map_state> &st, X &&x) {
+            size_t seq;
+            {
+                std::unique_lock<std::mutex> lock(st->m);
+                st->room.wait(lock, [&]{
+                    return st->started - st->emitted < st->max_in_flight || st->stopped();
+                });
+                if (st->stopped()) {
+                    return;
+                }
+                seq = st->started++;
+            }
+            st->g([st, seq, v = moving_value<T>{std::forward<X>(x)}]{
+                st->run(seq, v.take());
+            });
+        }
+
+        void run(size_t seq, T &&x) {
+            if (stopped()) {
+                return;
+            }
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+            try {
+                finish(seq, f(std::move(x)));
+            } catch (...) {
+                Maybe<E> e = exception_error<E>::current();
+                if (!e.orNull()) {
+                    throw;
+                }
+                fail(std::move(*e.orNull()));
+            }
+#else
+            finish(seq, f(std::move(x)));
+#endif
+        }
+
+        void finish(size_t seq, U &&r) {
+            std::unique_lock<std::mutex> lock(m);
+            if (Ordered) {
+                slots[seq % max_in_flight] = Just(std::move(r));
+            } else {
+                ready.push_back(std::move(r));
+            }
+            drain(lock);
+        }
+
+        // The first error wins. Work that hasn't started yet is skipped.
+        void fail(E e) {
+            std::unique_lock<std::mutex> lock(m);
+            if (!failed.load()) {
+                error = Just(std::move(e));
+                failed.store(true, std::memory_order_release);
+            }
+            room.notify_all();
+            drain(lock);
+        }
+
+        void complete() {
+            std::unique_lock<std::mutex> lock(m);
+            source_done = true;
+            drain(lock);
+        }
+
+        Maybe<U> take_ready() {
+            if (Ordered) {
+                Maybe<U> &slot = slots[emitted % max_in_flight];
+                if (U *r = slot.orNull()) {
+                    Maybe<U> out = Just(std::move(*r));
+                    slot = Nothing<U>();
+                    return out;
+                }
+            } else if (!ready.empty()) {
+                Maybe<U> out = Just(std::move(ready.front()));
+                ready.pop_front();
+                return out;
+            }
+            return Nothing<U>();
+        }
+
+        // Sends results from one thread at a time. Other threads leave
+        // theirs for the thread that's already sending.
+        void drain(std::unique_lock<std::mutex> &lock) {
+            if (emitting || finished) {
+                return;
+            }
+            emitting = true;
+            for (;;) {
+                if (failed.load()) {
+                    finished = true;
+                    E e = std::move(*error.orNull());
+                    lock.unlock();
+                    s.send_error(std::move(e));
+                    lock.lock();
+                    break;
+                }
+                Maybe<U> r = take_ready();
+                if (!r.orNull()) {
+                    if (source_done && emitted == started) {
+                        finished = true;
+                        lock.unlock();
+                        s.send_completed();
+                        lock.lock();
+                    }
+                    break;
+                }
+                ++emitted;
+                room.notify_one();
+                lock.unlock();
+                s.send_next(std::move(*r.orNull()));
+                lock.lock();
+            }
+            emitting = false;
+        }
+    };
+
+    template <typename State>
+    struct parallel_map_observer {
+        using value_type = T;
+        using error_type = E;
+        std::shared_ptr<State> st;
+
+        inline subscription get_subscription() const { return st->s.get_subscription(); }
+        inline bool is_disposed() const { return st->stopped(); }
+        inline void request(size_t n) const { st->s.request(n); }
+        inline void send_next(const T &x) const { State::start(st, x); }
+        inline void send_next(T &&x) const { State::start(st, std::move(x)); }
+        inline void send_error(E e) const { st->fail(std::move(e)); }
+        inline void send_completed() const { st->complete(); }
+    };
+
+    template <bool Ordered, typename F, typename Q>
+    auto parallel_map_with(F &&f, Q q, size_t max_in_flight) {
+        using F2 = std::decay_t<F>;
+        using U = std::decay_t<decltype(f(std::declval<T>()))>;
+        return make_operator<U, E>(Ordered ? "parallel_map" : "parallel_map_unordered", [f, q, max_in_flight, me = *This()](auto s){
+            auto g = schedule_on<Q>{}(q);
+            using State = parallel_map_state<decltype(s), U, F2, decltype(g), Ordered>;
+            auto st = make_state<State>(s.get_subscription(), std::move(s), f, g, max_in_flight);
+            // Wakes the source if it's waiting for room when the subscriber leaves.
+            std::weak_ptr<State> weak = st;
+            st->s.get_subscription().add([weak]{
+                if (auto st = weak.lock()) {
+                    std::lock_guard<std::mutex> lock(st->m);
+                    st->room.notify_all();
+                }
+            });
+            me.subscribe(parallel_map_observer<State>{st});
+        });
+    }
+
+    // Applies f to values on Queue, up to max_in_flight at a time, and sends
+    // the results in the order of the values.
+    template <typename F, typename Q>
+    auto parallel_map(F &&f, Q q, size_t max_in_flight) {
+        return parallel_map_with<true>(std::forward<F>(f), q, max_in_flight);
+    }
+
+    // Like parallel_map, but sends results as soon as they're ready.
+    template <typename F, typename Q>
+    auto parallel_map_unordered(F &&f, Q q, size_t max_in_flight) {
+        return parallel_map_with<false>(std::forward<F>(f), q, max_in_flight);
+    }
+
+    template <size_t N = default_inline_size>
+    auto any() -> any_observable<T, E, N> {
+        return any_observable<T, E, N>([me = *This()](auto s){
+            me.subscribe(std::move(s));
         });
     }
 
+    // Shares one run of the generator between all subscribers, once
+    // connect is called.
+    auto publish() {
+        using Subject = publish_subject<T, E>;
+        return connectable_observable<T, E, Derived, Subject>(*This(), []{ return Subject(); }, false);
+    }
+
+    // Like publish, but connects when the first subscriber arrives and
+    // disconnects when the last one leaves.
+    auto share() {
+        return publish().ref_count();
+    }
+
+    // Like share, but replays values to later subscribers within the given
+    // limits. Once the source has finished, it isn't run again.
+    auto share_replay(replay_limits limits);
+    auto share_replay(size_t n);
+
 private:
     // Use the correct pointer type when copying to prevent slicing.
     inline Derived* This() { return static_cast<Derived *>(this); }
@@ -312,78 +2463,775 @@ struct observable : observable_methods<T, E, observable<T, E, DoSub>> {
         : do_subscribe(std::forward<DoSubscribe>(o)) {}
 
     template <typename Observer, typename U = typename std::decay_t<Observer>::value_type>
-    void subscribe(Observer &&o) const {
-        //printf("observer size: %zu [%s]\n", sizeof(typename std::decay_t<Observer>), typeid(o).name());
-        do_subscribe(std::forward<Observer>(o));
+    subscription subscribe(Observer &&o) const {
+        return subscribe_observer(std::forward<Observer>(o), has_subscription<std::decay_t<Observer>>{});
     }
 
     template <typename... Args>
-    void subscribe(Args &&... args) const {
-        subscribe(make_observer(std::forward<Args>(args)...));
+    subscription subscribe(Args &&... args) const {
+        return subscribe(make_observer_for<E>(std::forward<Args>(args)...));
+    }
+
+  private:
+    template <typename Observer>
+    subscription subscribe_observer(Observer &&o, std::true_type) const {
+        subscription sub = o.get_subscription();
+        do_subscribe(std::forward<Observer>(o));
+        return sub;
+    }
+
+    template <typename Observer>
+    subscription subscribe_observer(Observer &&o, std::false_type) const {
+        return subscribe_observer(with_subscription(std::forward<Observer>(o)), std::true_type{});
+    }
+};
+
+// Sends each of the observables, as any_observables so that their generator
+// types can differ.
+template <typename Observable, typename... Observables>
+auto any_observables(Observable first, Observables... rest) {
+    using T = typename Observable::value_type;
+    using E = typename Observable::error_type;
+    using A = any_observable<T, E>;
+    std::vector<A> sources{first.any(), rest.any()...};
+    return make_operator<A, E>("any_observables", [sources](auto s){
+        for (const A &o : sources) {
+            s.send_next(o);
+        }
+        s.send_completed();
+    });
+}
+
+// Sends the values of all the observables as they arrive, and completes once
+// they all have.
+template <typename Observable, typename... Observables>
+auto merge(Observable first, Observables... rest) {
+    return any_observables(first, rest...).merge();
+}
+
+// Sends the values of each observable in turn.
+template <typename Observable, typename... Observables>
+auto concat(Observable first, Observables... rest) {
+    return any_observables(first, rest...).concat();
+}
+
+// How many recorded values a replay_subject keeps. Once a limit is reached,
+// the oldest values are dropped to make room.
+struct replay_limits {
+    using duration = std::chrono::steady_clock::duration;
+
+    size_t max_count = size_t(-1);
+    size_t max_bytes = size_t(-1);
+    duration max_age = duration::max();
+
+    replay_limits &count(size_t n) { max_count = n; return *this; }
+    replay_limits &bytes(size_t n) { max_bytes = n; return *this; }
+    replay_limits &age(duration d) { max_age = d; return *this; }
+};
+
+// The number of bytes a value counts for against replay_limits::bytes.
+// Specialize for types that own memory outside of themselves.
+template <typename T>
+struct value_size {
+    size_t operator()(const T &) const { return sizeof(T); }
+};
+
+// Values in the order they were added, in a ring that doubles in size when
+// it's full. Walking it from front to back covers at most two runs of
+// contiguous memory.
+template <typename T>
+class replay_buffer {
+  public:
+    replay_buffer() = default;
+    replay_buffer(const replay_buffer &) = delete;
+    replay_buffer &operator=(const replay_buffer &) = delete;
+
+    ~replay_buffer() {
+        while (!empty()) {
+            pop_front();
+        }
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    const T &operator[](size_t i) const { return *at((head + i) & mask); }
+    const T &front() const { return *at(head); }
+    const T &back() const { return (*this)[count - 1]; }
+
+    template <typename U>
+    void push_back(U &&x) {
+        if (count == mask + 1) {
+            grow();
+        }
+        new (slots[(head + count) & mask].storage) T(std::forward<U>(x));
+        ++count;
+    }
+
+    void pop_front() {
+        at(head)->~T();
+        head = (head + 1) & mask;
+        --count;
     }
+
+  private:
+    struct slot {
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    T *at(size_t i) const { return reinterpret_cast<T *>(slots[i].storage); }
+
+    void grow() {
+        size_t capacity = slots ? (mask + 1) * 2 : 8;
+        std::unique_ptr<slot[]> next(new slot[capacity]);
+        for (size_t i = 0; i < count; ++i) {
+            T *x = at((head + i) & mask);
+            new (next[i].storage) T(std::move(*x));
+            x->~T();
+        }
+        slots = std::move(next);
+        mask = capacity - 1;
+        head = 0;
+    }
+
+    std::unique_ptr<slot[]> slots;
+    size_t mask = size_t(-1);
+    size_t head = 0;
+    size_t count = 0;
 };
 
 template <typename T, typename E = default_error_type>
 struct replay_subject : observable_methods<T, E, replay_subject<T, E>> {
-    replay_subject() : st(std::make_shared<state>()) {}
-
-    void subscribe(const any_observer<T> &original) const {
-        st->observers.push_back(original);
-        auto &o = st->observers.back();
-        for (auto &e : st->events) {
-            e.send(o);
+    replay_subject() : st(std::make_shared<state>(replay_limits())) {}
+    explicit replay_subject(replay_limits limits) : st(std::make_shared<state>(limits)) {}
+
+    subscription subscribe(any_observer<T, E> original) const {
+        subscription sub = original.get_subscription();
+        size_t id = st->add_observer(std::move(original));
+        {
+            dispatch_scope scope(*st);
+            st->expire();
+            const auto &o = st->observers[st->positions[id]].o;
+            for (size_t i = 0, n = st->values.size(); i < n && !o.is_disposed(); ++i) {
+                o.send_next(st->values[i]);
+            }
+            if (!o.is_disposed()) {
+                st->send_terminal(o);
+            }
         }
+        std::weak_ptr<state> weak = st;
+        sub.add([weak, id]{
+            if (auto st = weak.lock()) {
+                st->remove_observer(id);
+            }
+        });
+        return sub;
     }
 
-    void send_next(T x)   const { st->add_event(event{WT{x}}); }
-    void send_error(E e)     const { st->add_event(event{WE{e}}); }
-    void send_completed() const { st->add_event(event{}); }
+    void send_next(const T &x) const { st->add_value(x); }
+    void send_next(T &&x) const { st->add_value(std::move(x)); }
+    void send_error(E e)     const { st->terminate(event_type::error, Just(std::move(e))); }
+    void send_completed() const { st->terminate(event_type::completed, Nothing<E>()); }
 
   private:
-    // Wrap Objective-C objects to avoid hitting ARC restrictions on putting them
-    // directly in the Maybe union.
-    struct WT { T unwrap; };
-    struct WE { E unwrap; };
+    using clock = std::chrono::steady_clock;
+
+    static constexpr size_t no_position = size_t(-1);
+
+    struct entry {
+        any_observer<T, E> o;
+        size_t id;
+    };
+
+    struct state {
+        replay_limits limits;
+        replay_buffer<T> values;
+        // When each value was added, if there's an age limit.
+        replay_buffer<clock::time_point> times;
+        size_t bytes = 0;
+
+        // final when error or complete; next is not final. The error is kept
+        // apart from the values so they stay densely packed.
+        event_type final_event_type = event_type::next;
+        Maybe<E> error;
+
+        // A deque, so observers subscribed while sending don't move the
+        // one being sent to.
+        std::deque<entry> observers;
+        // Index into observers by subscription id, for O(1) removal.
+        std::vector<size_t> positions;
+        std::vector<size_t> free_ids;
+        // Removals requested while sending wait until it's done, so the
+        // observers being iterated over stay put.
+        std::vector<size_t> deferred;
+        int dispatching = 0;
+
+        explicit state(replay_limits limits_) : limits(limits_) {}
+
+        size_t add_observer(any_observer<T, E> &&o) {
+            size_t id;
+            if (free_ids.empty()) {
+                id = positions.size();
+                positions.push_back(0);
+            } else {
+                id = free_ids.back();
+                free_ids.pop_back();
+            }
+            positions[id] = observers.size();
+            observers.push_back(entry{std::move(o), id});
+            return id;
+        }
+
+        void remove_observer(size_t id) {
+            if (dispatching) {
+                deferred.push_back(id);
+                return;
+            }
+            size_t i = positions[id];
+            if (i != observers.size() - 1) {
+                observers[i] = std::move(observers.back());
+                positions[observers[i].id] = i;
+            }
+            observers.pop_back();
+            positions[id] = no_position;
+            free_ids.push_back(id);
+        }
+
+        bool aged() const { return limits.max_age != replay_limits::duration::max(); }
+
+        void drop_oldest() {
+            bytes -= value_size<T>()(values.front());
+            values.pop_front();
+            if (aged()) {
+                times.pop_front();
+            }
+        }
+
+        void expire() {
+            if (!aged()) {
+                return;
+            }
+            auto now = clock::now();
+            while (!times.empty() && now - times.front() > limits.max_age) {
+                drop_oldest();
+            }
+        }
+
+        template <typename X>
+        void add_value(X &&x) {
+            assert(final_event_type == event_type::next);
+            expire();
+            size_t size = value_size<T>()(x);
+            if (limits.max_count == 0 || size > limits.max_bytes) {
+                dispatch(x);
+                return;
+            }
+            while (!values.empty() &&
+                   (values.size() >= limits.max_count || bytes + size > limits.max_bytes)) {
+                drop_oldest();
+            }
+            values.push_back(std::forward<X>(x));
+            bytes += size;
+            if (aged()) {
+                times.push_back(clock::now());
+            }
+            dispatch(values.back());
+        }
 
-    enum class event_type : char { next, error, completed };
-    struct event {
-        Maybe<WT> value;
-        Maybe<WE> error;
-        event_type type;
+        void dispatch(const T &x) {
+            dispatch_scope scope(*this);
+            // Observers subscribed while sending have already been replayed this value.
+            for (size_t i = 0, count = observers.size(); i < count; ++i) {
+                const auto &o = observers[i].o;
+                if (!o.is_disposed()) {
+                    o.send_next(x);
+                }
+            }
+        }
 
-        explicit event(WT x) : value(Just(std::move(x))), type(event_type::next) {}
-        explicit event(WE e) : error(Just(std::move(e))), type(event_type::error) {}
-        explicit event() : type(event_type::completed) {}
+        void terminate(event_type type, Maybe<E> &&e) {
+            assert(final_event_type == event_type::next);
+            final_event_type = type;
+            error = std::move(e);
+            dispatch_scope scope(*this);
+            for (size_t i = 0, count = observers.size(); i < count; ++i) {
+                const auto &o = observers[i].o;
+                if (!o.is_disposed()) {
+                    send_terminal(o);
+                }
+            }
+        }
 
-        void send(any_observer<T> &o) {
-            switch (type) {
-                case event_type::next:      o.send_next((*value.orNull()).unwrap); break;
-                case event_type::error:     o.send_error((*error.orNull()).unwrap); break;
+        void send_terminal(const any_observer<T, E> &o) const {
+            switch (final_event_type) {
+                case event_type::next:      break;
+                case event_type::error:     o.send_error(*error.orNull()); break;
                 case event_type::completed: o.send_completed(); break;
             }
         }
     };
 
+    struct dispatch_scope {
+        state &st;
+        explicit dispatch_scope(state &st_) : st(st_) { ++st.dispatching; }
+        ~dispatch_scope() {
+            if (--st.dispatching == 0) {
+                std::vector<size_t> ids;
+                ids.swap(st.deferred);
+                for (size_t id : ids) {
+                    st.remove_observer(id);
+                }
+            }
+        }
+    };
+
+    std::shared_ptr<state> st;
+};
+
+// A subject that sends events only to its current subscribers. Events can be
+// sent from any number of threads, and subscribers can come and go from any
+// thread while they're being sent.
+//
+// Sending reads the subscriber list without locking or allocating. The list
+// is copied on each subscribe and dispose, and old copies are freed once no
+// sender can still be reading them. Events sent concurrently reach each
+// subscriber concurrently; deliver them on a serial queue if that matters.
+template <typename T, typename E = default_error_type>
+struct publish_subject : observable_methods<T, E, publish_subject<T, E>> {
+    publish_subject() : st(std::make_shared<state>()) {}
+
+    subscription subscribe(any_observer<T, E> original) const {
+        subscription sub = original.get_subscription();
+        auto e = make_state<entry>(sub, std::move(original));
+        if (!st->add(e)) {
+            // Subscribers that arrive after an error or completion get it straight away.
+            st->terminal.orNull()->send(e->o);
+            return sub;
+        }
+        std::weak_ptr<state> weak = st;
+        sub.add([weak, p = e.get()]{
+            if (auto st = weak.lock()) {
+                st->remove(p);
+            }
+        });
+        return sub;
+    }
+
+    void send_next(const T &x) const {
+        read_guard g(*st);
+        for (auto &e : *st->current.load()) {
+            e->o.send_next(x);
+        }
+    }
+
+    // The last subscriber gets the value moved to it.
+    void send_next(T &&x) const {
+        read_guard g(*st);
+        const list &l = *st->current.load();
+        for (size_t i = 0, n = l.size(); i < n; ++i) {
+            if (i + 1 == n) {
+                l[i]->o.send_next(std::move(x));
+            } else {
+                l[i]->o.send_next(static_cast<const T &>(x));
+            }
+        }
+    }
+
+    void send_error(E e) const { st->terminate(event{WE{std::move(e)}}); }
+    void send_completed() const { st->terminate(event{}); }
+
+  private:
+    using event = notification<T, E>;
+    using WE = typename event::WE;
+
+    struct entry {
+        any_observer<T, E> o;
+        explicit entry(any_observer<T, E> &&o_) : o(std::move(o_)) {}
+    };
+    using list = std::vector<std::shared_ptr<entry>>;
+
     struct state {
-        std::vector<event> events;
-        std::vector<any_observer<T>> observers;
+        std::atomic<const list *> current;
+        // Senders currently reading a list.
+        std::atomic<size_t> readers{0};
+        std::atomic<bool> has_retired{false};
+
+        std::mutex m;
+        // Lists that have been replaced, but might still be being read.
+        std::vector<const list *> retired;
+        std::atomic<bool> terminated{false};
+        // Set once, before terminated.
+        Maybe<event> terminal;
+
+        state() : current(new list()) {}
+        ~state() {
+            delete current.load();
+            for (const list *l : retired) {
+                delete l;
+            }
+        }
 
-        // final when error or complete; next is not final
-        event_type final_event_type = event_type::next;
+        bool add(const std::shared_ptr<entry> &e) {
+            std::vector<const list *> garbage;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if (terminated.load()) {
+                    return false;
+                }
+                auto next = new list(*current.load());
+                next->push_back(e);
+                replace(next);
+                garbage = reclaim();
+            }
+            destroy(garbage);
+            return true;
+        }
 
-        void add_event(event &&e) {
-            assert(final_event_type == event_type::next);
-            final_event_type = e.type;
-            events.emplace_back(std::move(e));
-            auto &ev = events.back();
-            for (auto &o : observers) {
-                ev.send(o);
+        void remove(const entry *e) {
+            std::vector<const list *> garbage;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                const list &l = *current.load();
+                auto it = std::find_if(l.begin(), l.end(), [e](auto &p){ return p.get() == e; });
+                if (it == l.end()) {
+                    return;
+                }
+                auto next = new list();
+                next->reserve(l.size() - 1);
+                next->insert(next->end(), l.begin(), it);
+                next->insert(next->end(), it + 1, l.end());
+                replace(next);
+                garbage = reclaim();
+            }
+            destroy(garbage);
+        }
+
+        void terminate(event &&e) {
+            read_guard g(*this);
+            const list *old;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if (terminated.load()) {
+                    return;
+                }
+                terminal = Just(std::move(e));
+                terminated.store(true);
+                old = current.load();
+                replace(new list());
+            }
+            for (auto &p : *old) {
+                terminal.orNull()->send(p->o);
+            }
+        }
+
+        // Called with m held.
+        void replace(const list *next) {
+            retired.push_back(current.exchange(next));
+            has_retired.store(true);
+        }
+
+        // Takes the retired lists if no sender is reading any list. A sender
+        // that starts after this point loads the current list, which isn't
+        // retired. Called with m held.
+        std::vector<const list *> reclaim() {
+            std::vector<const list *> garbage;
+            if (readers.load() == 0) {
+                garbage.swap(retired);
+                has_retired.store(false);
+            }
+            return garbage;
+        }
+
+        // Frees lists outside the lock, since destroying a subscriber runs
+        // arbitrary code.
+        static void destroy(const std::vector<const list *> &garbage) {
+            for (const list *l : garbage) {
+                delete l;
+            }
+        }
+    };
+
+    // Marks a sender as reading the current list. The last one out frees
+    // lists retired in the meantime.
+    struct read_guard {
+        state &st;
+        explicit read_guard(state &st_) : st(st_) { st.readers.fetch_add(1); }
+        ~read_guard() {
+            if (st.readers.fetch_sub(1) == 1 && st.has_retired.load()) {
+                std::vector<const list *> garbage;
+                {
+                    std::unique_lock<std::mutex> lock(st.m, std::try_to_lock);
+                    if (lock.owns_lock()) {
+                        garbage = st.reclaim();
+                    }
+                }
+                state::destroy(garbage);
+            }
+        }
+    };
+
+    std::shared_ptr<state> st;
+};
+
+// Serializes access to a subject that isn't thread-safe. Disposing a
+// subscription to it takes the lock too. The lock is recursive, so that
+// subscribers can send to the subject.
+template <typename Subject>
+struct locked_subject {
+    using value_type = typename Subject::value_type;
+    using error_type = typename Subject::error_type;
+    using T = value_type;
+    using E = error_type;
+
+    explicit locked_subject(Subject subject_)
+        : subject(std::move(subject_)), m(std::make_shared<std::recursive_mutex>()) {}
+
+    subscription subscribe(any_observer<T, E> original) const {
+        subscription outer = original.get_subscription();
+        subscription inner;
+        outer.add([m = m, inner]{
+            std::lock_guard<std::recursive_mutex> lock(*m);
+            inner.dispose();
+        });
+        std::lock_guard<std::recursive_mutex> lock(*m);
+        subject.subscribe(inner_observer{std::move(original), inner});
+        return outer;
+    }
+
+    void send_next(const T &x) const { locked([&x](const Subject &s){ s.send_next(x); }); }
+    void send_next(T &&x) const { locked([&x](const Subject &s){ s.send_next(std::move(x)); }); }
+    void send_error(E e) const { locked([&e](const Subject &s){ s.send_error(std::move(e)); }); }
+    void send_completed() const { locked([](const Subject &s){ s.send_completed(); }); }
+
+  private:
+    // Gives the subject a subscription that's only disposed under the lock.
+    struct inner_observer {
+        using value_type = T;
+        using error_type = E;
+        any_observer<T, E> o;
+        subscription sub;
+
+        inline subscription get_subscription() const { return sub; }
+        inline bool is_disposed() const { return o.is_disposed(); }
+        inline void request(size_t n) const { o.request(n); }
+        inline void send_next(const T &x) const { o.send_next(x); }
+        inline void send_next(T &&x) const { o.send_next(std::move(x)); }
+        inline void send_error(E e) const { o.send_error(std::move(e)); }
+        inline void send_completed() const { o.send_completed(); }
+    };
+
+    template <typename F>
+    void locked(F &&f) const {
+        std::lock_guard<std::recursive_mutex> lock(*m);
+        f(subject);
+    }
+
+    Subject subject;
+    std::shared_ptr<std::recursive_mutex> m;
+};
+
+// An observable that shares one subscription to its source between all of
+// its subscribers, by sending the source's events through a subject.
+//
+// connect subscribes to the source, and returns the subscription to it.
+// Subscribers that subscribe before connecting see all of its events.
+template <typename T, typename E, typename Source, typename Subject>
+class connectable_observable
+    : public observable_methods<T, E, connectable_observable<T, E, Source, Subject>> {
+  public:
+    // keep_finished keeps the subject once the source has finished, instead
+    // of starting again for later subscribers.
+    connectable_observable(Source source, std::function<Subject()> make_subject, bool keep_finished)
+        : st(std::make_shared<state>(std::move(source), std::move(make_subject), keep_finished)) {}
+
+    subscription subscribe(any_observer<T, E> o) const {
+        Subject subject = st->current();
+        return subject.subscribe(std::move(o));
+    }
+
+    subscription connect() const {
+        subscription connection;
+        Subject subject = st->current();
+        {
+            std::lock_guard<std::mutex> lock(st->m);
+            if (subscription *c = st->connection.orNull()) {
+                return *c;
+            }
+            st->connection = Just(connection);
+        }
+        std::weak_ptr<state> weak = st;
+        st->source.subscribe(with_subscription(source_observer{subject, weak}, connection));
+        return connection;
+    }
+
+    // Connects when the first subscriber arrives, and disconnects when the
+    // last one leaves.
+    auto ref_count() const {
+        auto me = *this;
+        return make_operator<T, E>("ref_count", [me](auto s){
+            auto st = me.st;
+            subscription sub = s.get_subscription();
+            bool first;
+            {
+                std::lock_guard<std::mutex> lock(st->m);
+                first = st->refs++ == 0;
+            }
+            me.subscribe(std::move(s));
+            sub.add([st]{ st->release(); });
+            if (first) {
+                me.connect();
+            }
+        });
+    }
+
+  private:
+    struct state {
+        Source source;
+        std::function<Subject()> make_subject;
+        bool keep_finished;
+
+        std::mutex m;
+        Subject subject;
+        Maybe<subscription> connection;
+        size_t refs = 0;
+        bool finished = false;
+
+        state(Source source_, std::function<Subject()> make_subject_, bool keep_finished_)
+            : source(std::move(source_)), make_subject(std::move(make_subject_)),
+              keep_finished(keep_finished_), subject(make_subject()) {}
+
+        Subject current() {
+            std::lock_guard<std::mutex> lock(m);
+            return subject;
+        }
+
+        void release() {
+            Maybe<subscription> old;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if (--refs != 0 || (keep_finished && finished)) {
+                    return;
+                }
+                old = std::move(connection);
+                connection = Nothing<subscription>();
+                subject = make_subject();
+                finished = false;
+            }
+            if (subscription *c = old.orNull()) {
+                c->dispose();
+            }
+        }
+
+        void finish() {
+            std::lock_guard<std::mutex> lock(m);
+            finished = true;
+        }
+    };
+
+    struct source_observer {
+        using value_type = T;
+        using error_type = E;
+        Subject subject;
+        std::weak_ptr<state> st;
+
+        inline void send_next(const T &x) const { subject.send_next(x); }
+        inline void send_next(T &&x) const { subject.send_next(std::move(x)); }
+        inline void send_error(E e) const {
+            mark_finished();
+            subject.send_error(std::move(e));
+        }
+        inline void send_completed() const {
+            mark_finished();
+            subject.send_completed();
+        }
+
+        // Before the subject passes the event on, since its subscribers
+        // leave when they receive it.
+        void mark_finished() const {
+            if (auto p = st.lock()) {
+                p->finish();
             }
         }
     };
+
+    std::shared_ptr<state> st;
+};
+
+template <typename T, typename E, typename Derived>
+auto observable_methods<T, E, Derived>::share_replay(replay_limits limits) {
+    using Subject = locked_subject<replay_subject<T, E>>;
+    return connectable_observable<T, E, Derived, Subject>(*This(), [limits]{
+        return Subject(replay_subject<T, E>(limits));
+    }, true).ref_count();
+}
+
+template <typename T, typename E, typename Derived>
+auto observable_methods<T, E, Derived>::share_replay(size_t n) {
+    return share_replay(replay_limits().count(n));
+}
+
+// Fills a batch for each window, as buffer does, and sends it once it's
+// full.
+template <typename T, typename E, typename Observer>
+struct window_observer : forwarding_observer<T, E, Observer> {
+    struct state {
+        batch_pool<T> pool;
+        size_t n;
+        batch<T> current;
+        explicit state(size_t n_) : pool(n_), n(n_) {}
+    };
     std::shared_ptr<state> st;
+    subscription sub;
+    window_observer(Observer s_, size_t n, subscription sub_)
+        : forwarding_observer<T, E, Observer>(std::move(s_)),
+          st(make_state<state>(sub_, n)), sub(std::move(sub_)) {}
+
+    inline subscription get_subscription() const { return sub; }
+    inline bool is_disposed() const { return sub.is_disposed(); }
+    inline void request(size_t) const {}
+    inline void send_next(const T &x) const { next(x); }
+    inline void send_next(T &&x) const { next(std::move(x)); }
+
+    template <typename X>
+    inline void next(X &&x) const {
+        if (st->current.empty()) {
+            st->current = st->pool.make();
+        }
+        st->current.push_back(std::forward<X>(x));
+        if (st->current.size() == st->n) {
+            send_window();
+        }
+    }
+
+    inline void send_error(E e) const {
+        st->current = batch<T>();
+        this->s.send_error(std::move(e));
+    }
+
+    inline void send_completed() const {
+        if (!st->current.empty()) {
+            send_window();
+        }
+        this->s.send_completed();
+    }
+
+  private:
+    inline void send_window() const {
+        batch<T> values = std::move(st->current);
+        st->current = batch<T>();
+        this->s.send_next(batch_observable<T, E>(batch_replay<T>{std::move(values)}));
+    }
 };
 
+template <typename T, typename E, typename Derived>
+auto observable_methods<T, E, Derived>::window(size_t n) {
+    n = n ? n : 1;
+    return make_operator<batch_observable<T, E>, E>("window", [n, me = *This()](auto s){
+        subscription sub = s.get_subscription().child();
+        me.subscribe(window_observer<T, E, decltype(s)>{std::move(s), n, sub});
+    });
+}
+
 struct unit {};
 
 }
@@ -0,0 +1,697 @@
+#include "rx.h"
+#include "rx_combine.h"
+#include "rx_group_by.h"
+#include "rx_ring.h"
+#include "rx_schedulers.h"
+#include "rx_simd.h"
+#include "rx_timer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <link.h>
+#endif
+
+namespace rx = windberry::rx;
+
+static const int count = 10 * 1000 * 1000;
+
+// Keeps the compiler from folding a pipeline into a closed-form result.
+template <typename T>
+static inline void consume(const T &x) {
+    asm volatile("" : : "g"(x) : "memory");
+}
+
+static auto numbers(int n) {
+    return rx::make_observable<int>([n](auto s){
+        for (int i = 0; i < n; ++i) {
+            s.send_next(i);
+        }
+        s.send_completed();
+    });
+}
+
+template <typename E>
+static auto numbers_with_error(int n) {
+    return rx::make_observable<int, E>([n](auto s){
+        for (int i = 0; i < n; ++i) {
+            s.send_next(i);
+        }
+        s.send_completed();
+    });
+}
+
+static auto samples(int n) {
+    return rx::make_observable<float>([n](auto s){
+        for (int i = 0; i < n; ++i) {
+            s.send_next(float(i % 1000));
+        }
+        s.send_completed();
+    });
+}
+
+// The same values as samples, already in batches of 1024, so the batched
+// operators are measured without buffer's cost.
+static auto sample_batches(int n) {
+    rx::batch_pool<float> pool(1024);
+    std::vector<rx::batch<float>> batches;
+    for (int i = 0; i < n; i += 1024) {
+        rx::batch<float> b = pool.make();
+        for (int j = i; j < n && j < i + 1024; ++j) {
+            b.push_back(float(j % 1000));
+        }
+        batches.push_back(std::move(b));
+    }
+    return rx::make_observable<rx::batch<float>>([batches](auto s){
+        for (const auto &b : batches) {
+            s.send_next(b);
+        }
+        s.send_completed();
+    });
+}
+
+// Every allocation the process makes, so benches can report allocations
+// per element.
+static std::atomic<size_t> allocations{0};
+
+// Out of line, so GCC doesn't take free in an inlined delete for a
+// mismatched deallocation.
+__attribute__((noinline)) void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+
+static struct {
+    int runs = 3;
+    const char *filter = nullptr;
+    const char *json = nullptr;
+    const char *baseline = nullptr;
+    double tolerance = 0.1;
+} options;
+
+struct result {
+    std::string name;
+    double ns = 0;
+    double allocs = 0;
+    // Latency percentiles, for benches that record latencies, or -1.
+    double p50 = -1;
+    double p99 = -1;
+};
+
+static std::vector<result> results;
+
+// Latencies recorded by the bench running, in ns. Reserved for one per
+// element beforehand, so recording doesn't allocate.
+static std::vector<double> latencies;
+
+static void record_latency(std::chrono::steady_clock::duration d) {
+    latencies.push_back(std::chrono::duration<double, std::nano>(d).count());
+}
+
+static double percentile(double p) {
+    return latencies[size_t(p * (latencies.size() - 1))];
+}
+
+// Runs f(n) options.runs times and keeps the fastest run, where n is the
+// number of elements f sends.
+template <typename F>
+static void bench(const std::string &name, int n, F f) {
+    if (options.filter && name.find(options.filter) == std::string::npos) {
+        return;
+    }
+    result r;
+    r.name = name;
+    for (int run = 0; run < options.runs; ++run) {
+        latencies.clear();
+        latencies.reserve(n);
+        size_t allocated = allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        f(n);
+        auto end = std::chrono::steady_clock::now();
+        double allocs = double(allocations.load() - allocated) / n;
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / n;
+        r.allocs = run == 0 ? allocs : std::min(r.allocs, allocs);
+        if (run == 0 || ns < r.ns) {
+            r.ns = ns;
+            if (!latencies.empty()) {
+                std::sort(latencies.begin(), latencies.end());
+                r.p50 = percentile(0.5);
+                r.p99 = percentile(0.99);
+            }
+        }
+    }
+    printf("%-32s %8.2f ns/element %8.2f allocs/element", name.c_str(), r.ns, r.allocs);
+    if (r.p50 >= 0) {
+        printf("   p50 %.0f ns, p99 %.0f ns", r.p50, r.p99);
+    }
+    printf("\n");
+    results.push_back(r);
+}
+
+// The size of this program's machine code, which is mostly what rx.h
+// generates for the benches.
+static size_t code_size() {
+#ifdef __linux__
+    size_t size = 0;
+    dl_iterate_phdr([](dl_phdr_info *info, size_t, void *data){
+        for (int i = 0; i < info->dlpi_phnum; ++i) {
+            const auto &ph = info->dlpi_phdr[i];
+            if (ph.p_type == PT_LOAD && (ph.p_flags & PF_X)) {
+                *static_cast<size_t *>(data) += ph.p_memsz;
+            }
+        }
+        // The program itself comes first.
+        return 1;
+    }, &size);
+    return size;
+#else
+    return 0;
+#endif
+}
+
+// Bench names are written as they are, so they mustn't need escaping.
+static bool write_json(const char *path, size_t code) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    fprintf(f, "{\n  \"code_size\": %zu,\n  \"results\": [\n", code);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const result &r = results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"ns_per_element\": %.3f, \"allocs_per_element\": %.3f",
+                r.name.c_str(), r.ns, r.allocs);
+        if (r.p50 >= 0) {
+            fprintf(f, ", \"p50_ns\": %.0f, \"p99_ns\": %.0f", r.p50, r.p99);
+        }
+        fprintf(f, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+static bool number_field(const char *line, const char *key, double &x) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    const char *p = strstr(line, pattern);
+    if (!p) {
+        return false;
+    }
+    x = strtod(p + strlen(pattern), nullptr);
+    return true;
+}
+
+// Reads what write_json wrote, one result per line.
+static bool read_json(const char *path, std::vector<result> &baseline, size_t &code) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        double x;
+        if (number_field(line, "code_size", x)) {
+            code = size_t(x);
+        }
+        const char *name = strstr(line, "\"name\": \"");
+        if (!name) {
+            continue;
+        }
+        name += strlen("\"name\": \"");
+        result r;
+        r.name.assign(name, strchr(name, '"'));
+        number_field(line, "ns_per_element", r.ns);
+        number_field(line, "allocs_per_element", r.allocs);
+        number_field(line, "p50_ns", r.p50);
+        number_field(line, "p99_ns", r.p99);
+        baseline.push_back(r);
+    }
+    fclose(f);
+    return true;
+}
+
+// Prints how each result changed from the baseline's, and returns how many
+// got worse by more than options.tolerance. Times and code size are always
+// printed; allocations and latencies only when they changed by more than
+// that.
+static int compare(const char *path, size_t code) {
+    std::vector<result> baseline;
+    size_t base_code = 0;
+    if (!read_json(path, baseline, base_code)) {
+        return 1;
+    }
+    int regressions = 0;
+    // slack allows for a little noise, as in the shortest times, or
+    // allocations made by other threads.
+    auto check = [&](const std::string &name, const char *what, int digits, double base, double now,
+                     double slack, bool always){
+        bool worse = now > base * (1 + options.tolerance) + slack;
+        bool better = now < base * (1 - options.tolerance) - slack;
+        if (!always && !worse && !better) {
+            return;
+        }
+        printf("%-32s %-8s %12.*f -> %12.*f", name.c_str(), what, digits, base, digits, now);
+        if (base > 0) {
+            printf(" %+7.1f%%", (now - base) / base * 100);
+        }
+        printf("%s\n", worse ? "  REGRESSION" : "");
+        regressions += worse;
+    };
+    printf("\nCompared with %s (tolerance %.0f%%):\n", path, options.tolerance * 100);
+    check("code size", "bytes", 0, double(base_code), double(code), 0, true);
+    for (const result &r : results) {
+        auto b = std::find_if(baseline.begin(), baseline.end(), [&](const result &x){ return x.name == r.name; });
+        if (b == baseline.end()) {
+            printf("%-32s new\n", r.name.c_str());
+            continue;
+        }
+        check(r.name, "ns", 2, b->ns, r.ns, 0.05, true);
+        check(r.name, "allocs", 2, b->allocs, r.allocs, 0.01, false);
+        if (r.p50 >= 0 && b->p50 >= 0) {
+            check(r.name, "p50 ns", 0, b->p50, r.p50, 0, false);
+            check(r.name, "p99 ns", 0, b->p99, r.p99, 0, false);
+        }
+    }
+    printf("%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+    return regressions;
+}
+
+static int usage() {
+    fprintf(stderr, "usage: rx_bench [--runs n] [--filter text] [--json file] [--baseline file] [--tolerance fraction]\n");
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (i + 1 == argc) {
+            return usage();
+        }
+        const char *value = argv[++i];
+        if (!strcmp(arg, "--runs")) {
+            options.runs = std::max(1, atoi(value));
+        } else if (!strcmp(arg, "--filter")) {
+            options.filter = value;
+        } else if (!strcmp(arg, "--json")) {
+            options.json = value;
+        } else if (!strcmp(arg, "--baseline")) {
+            options.baseline = value;
+        } else if (!strcmp(arg, "--tolerance")) {
+            options.tolerance = atof(value);
+        } else {
+            return usage();
+        }
+    }
+
+    printf("%-32s %8zu bytes\n", "event (exception_ptr)", sizeof(rx::notification<int, std::exception_ptr>));
+    printf("%-32s %8zu bytes\n", "event (error_code)", sizeof(rx::notification<int, std::error_code>));
+    printf("%-32s %8zu bytes\n", "event (never)", sizeof(rx::notification<int, rx::never>));
+
+    bench("map (bind)", count, [](int n){
+        numbers(n).bind([](int x){
+            return rx::pure_observable(x * 2);
+        }).subscribe([](int x){ consume(x); });
+    });
+
+    bench("map (3 x bind)", count, [](int n){
+        numbers(n)
+        .bind([](int x){ return rx::pure_observable(x + 1); })
+        .bind([](int x){ return rx::pure_observable(x * 2); })
+        .bind([](int x){ return rx::pure_observable(x - 1); })
+        .subscribe([](int x){ consume(x); });
+    });
+
+    bench("map", count, [](int n){
+        numbers(n).map([](int x){
+            return x * 2;
+        }).subscribe([](int x){ consume(x); });
+    });
+
+    bench("map (flat_map)", count, [](int n){
+        numbers(n).flat_map([](int x){
+            return rx::pure_observable(x * 2);
+        }).subscribe([](int x){ consume(x); });
+    });
+
+    // The shape throttle_progress used to have.
+    bench("filter (bind + any)", count, [](int n){
+        numbers(n).bind([](int x){
+            if (x % 3 == 0) {
+                return rx::pure_observable(x).any();
+            }
+            return rx::empty_observable<int>().any();
+        }).subscribe([](int x){ consume(x); });
+    });
+
+    bench("filter", count, [](int n){
+        numbers(n).filter([](int x){
+            return x % 3 == 0;
+        }).subscribe([](int x){ consume(x); });
+    });
+
+    bench("map + any", count, [](int n){
+        numbers(n).map([](int x){
+            return x * 2;
+        }).any().subscribe([](int x){ consume(x); });
+    });
+
+    // The same pipelines with cheaper error types.
+    bench("map + any (never)", count, [](int n){
+        numbers_with_error<rx::never>(n).map([](int x){
+            return x * 2;
+        }).any().subscribe([](int x){ consume(x); });
+    });
+
+    bench("map + any (error_code)", count, [](int n){
+        numbers_with_error<std::error_code>(n).map([](int x){
+            return x * 2;
+        }).any().subscribe([](int x){ consume(x); });
+    });
+
+    bench("map (bind, never)", count, [](int n){
+        numbers_with_error<rx::never>(n).bind([](int x){
+            return rx::pure_observable<rx::never>(x * 2);
+        }).subscribe([](int x){ consume(x); });
+    });
+
+    // What catch_to costs values that pass through it, and what recovering
+    // from an error costs.
+    bench("catch_to", count, [](int n){
+        numbers(n).catch_to(rx::empty_observable<int>()).subscribe([](int x){ consume(x); });
+    });
+
+    bench("catch_to, recovering", count / 10, [](int n){
+        auto e = std::make_exception_ptr(std::runtime_error("bench"));
+        for (int i = 0; i < n; ++i) {
+            rx::error_observable<int>(e).catch_to(rx::pure_observable(i))
+            .subscribe([](int x){ consume(x); });
+        }
+    });
+
+    bench("map/filter/scan/skip/take", count, [](int n){
+        numbers(n)
+        .map([](int x){ return x + 1; })
+        .filter([](int x){ return x & 1; })
+        .scan(0L, [](long acc, int x){ return acc + x; })
+        .skip(1)
+        .take(n)
+        .subscribe([](long x){ consume(x); });
+    });
+
+    bench("5 operators, string values", count / 10, [](int n){
+        rx::make_observable<std::string>([n](auto s){
+            for (int i = 0; i < n; ++i) {
+                s.send_next(std::string(64, 'a' + i % 26));
+            }
+        })
+        .map([](std::string x){ x[0] = 'z'; return x; })
+        .filter([](const std::string &x){ return x[1] != 'q'; })
+        .skip(1)
+        .take(n)
+        .any()
+        .subscribe([](const std::string &x){ consume(x[0]); });
+    });
+
+    bench("buffer(256) + sum", count, [](int n){
+        numbers(n).buffer(256).subscribe([](const rx::batch<int> &b){
+            long sum = 0;
+            for (int x : b) {
+                sum += x;
+            }
+            consume(sum);
+        });
+    });
+
+    bench("buffer(256).flatten()", count, [](int n){
+        numbers(n).buffer(256).flatten().subscribe([](int x){ consume(x); });
+    });
+
+    // Each batched operator against the per-element chain it replaces.
+    auto batches = sample_batches(count);
+
+    bench("sum (map + scan)", count, [](int n){
+        samples(n).map([](float x){ return double(x); })
+        .scan(0.0, [](double acc, double x){ return acc + x; })
+        .subscribe([](double x){ consume(x); });
+    });
+
+    bench("sum (batches)", count, [&batches](int){
+        rx::sum(batches).subscribe([](double x){ consume(x); });
+    });
+
+    rx::limit_simd_level(rx::simd_level::scalar);
+    bench("sum (batches, scalar)", count, [&batches](int){
+        rx::sum(batches).subscribe([](double x){ consume(x); });
+    });
+    rx::limit_simd_level(rx::simd_level::avx512);
+
+    bench("max (map + scan)", count, [](int n){
+        samples(n).map([](float x){ return x; })
+        .scan(0.0f, [](float acc, float x){ return x > acc ? x : acc; })
+        .subscribe([](float x){ consume(x); });
+    });
+
+    bench("max (batches)", count, [&batches](int){
+        rx::max(batches).subscribe([](float x){ consume(x); });
+    });
+
+    bench("variance (map + scan)", count, [](int n){
+        struct welford { double count, mean, m2; };
+        samples(n).map([](float x){ return double(x); })
+        .scan(welford{0, 0, 0}, [](welford w, double x){
+            w.count += 1;
+            double d = x - w.mean;
+            w.mean += d / w.count;
+            w.m2 += d * (x - w.mean);
+            return w;
+        })
+        .subscribe([](welford w){ consume(w.m2 / w.count); });
+    });
+
+    bench("variance (batches)", count, [&batches](int){
+        rx::variance(batches).subscribe([](double x){ consume(x); });
+    });
+
+    bench("count_if (map + scan)", count, [](int n){
+        samples(n).map([](float x){ return x > 500.0f ? 1 : 0; })
+        .scan(size_t(0), [](size_t acc, int x){ return acc + x; })
+        .subscribe([](size_t x){ consume(x); });
+    });
+
+    bench("count_if (batches)", count, [&batches](int){
+        rx::count_if(batches, rx::simd_compare::greater, 500.0f)
+        .subscribe([](size_t x){ consume(x); });
+    });
+
+    bench("x * 3 (map)", count, [](int n){
+        samples(n).map([](float x){ return x * 3; }).subscribe([](float x){ consume(x); });
+    });
+
+    bench("x * 3 (map_batch)", count, [&batches](int){
+        rx::map_batch(batches, rx::simd_op::multiply, 3.0f)
+        .subscribe([](const rx::batch<float> &b){ consume(b[0]); });
+    });
+
+    // Short-lived pipelines, where setting up and tearing down each
+    // subscription's state is most of the work.
+    auto short_pipeline = [](rx::subscription sub){
+        rx::pure_observable(1)
+        .map([](int x){ return x + 1; })
+        .scan(0, [](int acc, int x){ return acc + x; })
+        .distinct_until_changed()
+        .take(1)
+        .any()
+        .subscribe(rx::with_subscription(rx::make_observer([](int x){ consume(x); }), sub));
+    };
+
+    bench("subscribe + dispose", count / 10, [&](int n){
+        for (int i = 0; i < n; ++i) {
+            short_pipeline(rx::subscription());
+        }
+    });
+
+    bench("subscribe + dispose (arena)", count / 10, [&](int n){
+        rx::block_pool blocks(rx::default_arena_block_size);
+        for (int i = 0; i < n; ++i) {
+            short_pipeline(rx::subscription::with_arena(&blocks));
+        }
+    });
+
+    // n is the number of values received, across all the subscribers.
+    for (int k : {1, 10, 1000}) {
+        std::string name = "replay_subject, " + std::to_string(k) + (k == 1 ? " subscriber" : " subscribers");
+        bench(name, count, [k](int n){
+            rx::replay_subject<int> subject(rx::replay_limits().count(64));
+            for (int j = 0; j < k; ++j) {
+                subject.subscribe(rx::make_observer([](int x){ consume(x); }));
+            }
+            for (int i = 0; i < n / k; ++i) {
+                subject.send_next(i);
+            }
+            subject.send_completed();
+        });
+    }
+
+    // Subscribers that each arrive late and are replayed 1024 values.
+    bench("replay_subject, late replay", count, [](int n){
+        rx::replay_subject<int> subject(rx::replay_limits().count(1024));
+        for (int i = 0; i < 1024; ++i) {
+            subject.send_next(i);
+        }
+        for (int i = 0; i < n / 1024; ++i) {
+            subject.subscribe(rx::make_observer([](int x){ consume(x); })).dispose();
+        }
+    });
+
+    bench("make_flowable, request(256)", count, [](int n){
+        rx::subscription sub(256);
+        int received = 0;
+        rx::make_flowable<int>(0, [n](int &i, auto &s){
+            if (i == n) {
+                s.send_completed();
+                return false;
+            }
+            s.send_next(i++);
+            return true;
+        }).subscribe(rx::with_subscription(rx::make_observer([&](int x){
+            consume(x);
+            if (++received == 256) {
+                received = 0;
+                sub.request(256);
+            }
+        }), sub));
+    });
+
+    bench("zip, 2 flowable sources", count, [](int n){
+        auto flowing = [n]{
+            return rx::make_flowable<int>(0, [n](int &i, auto &s){
+                if (i == n) {
+                    s.send_completed();
+                    return false;
+                }
+                s.send_next(i++);
+                return true;
+            });
+        };
+        rx::zip(flowing(), flowing()).subscribe([](std::tuple<int, int> x){
+            consume(std::get<0>(x) + std::get<1>(x));
+        });
+    });
+
+    bench("deliver_on(event_loop)", count / 10, [](int n){
+        rx::event_loop loop;
+        numbers(n).deliver_on(&loop).subscribe([](int x){ consume(x); });
+    });
+
+    bench("deliver_on(event_loop, 256)", count / 10, [](int n){
+        rx::event_loop loop;
+        numbers(n).deliver_on(&loop, 256).subscribe([](int x){ consume(x); });
+    });
+
+    bench("deliver_on(loop, 256), never", count / 10, [](int n){
+        rx::event_loop loop;
+        numbers_with_error<rx::never>(n).deliver_on(&loop, 256).subscribe([](int x){ consume(x); });
+    });
+
+    // One value at a time, so each is timed from being sent to arriving on
+    // the loop without waiting behind others.
+    bench("deliver_on(event_loop), latency", count / 100, [](int n){
+        using time_point = std::chrono::steady_clock::time_point;
+        rx::event_loop loop;
+        std::atomic<int> received{0};
+        rx::make_observable<time_point>([n, &received](auto s){
+            for (int i = 0; i < n; ++i) {
+                s.send_next(std::chrono::steady_clock::now());
+                while (received.load() <= i) {
+                    std::this_thread::yield();
+                }
+            }
+            s.send_completed();
+        }).deliver_on(&loop).subscribe([&received](time_point t){
+            record_latency(std::chrono::steady_clock::now() - t);
+            received.fetch_add(1);
+        });
+    });
+
+    bench("parallel_map(thread_pool, 64)", count / 10, [](int n){
+        rx::thread_pool pool;
+        std::atomic<bool> done{false};
+        numbers(n).parallel_map([](int x){
+            return x * 2;
+        }, &pool, 64).subscribe([](int x){
+            consume(x);
+        }, [](rx::default_error_type){}, [&done]{
+            done = true;
+        });
+        while (!done) {
+            std::this_thread::yield();
+        }
+    });
+
+    bench("group_by, 1000 keys", count, [](int n){
+        rx::group_by(numbers(n), [](int x){ return x % 1000; })
+        .subscribe([](rx::grouped_observable<int, int> g){
+            g.subscribe(rx::make_observer([](int x){ consume(x); }));
+        });
+    });
+
+    bench("group_by(thread_pool, 8)", count / 10, [](int n){
+        rx::thread_pool pool;
+        std::atomic<bool> done{false};
+        rx::group_by(numbers(n), [](int x){ return x % 1000; }, &pool, 8)
+        .subscribe([](rx::grouped_observable<int, int> g){
+            g.subscribe(rx::make_observer([](int x){ consume(x); }));
+        }, [](rx::default_error_type){}, [&done]{
+            done = true;
+        });
+        while (!done) {
+            std::this_thread::yield();
+        }
+    });
+
+    bench("timer_wheel::schedule_at", count / 10, [](int n){
+        rx::timer_wheel wheel;
+        auto later = wheel.now() + std::chrono::hours(1);
+        for (int i = 0; i < n; ++i) {
+            wheel.schedule_at(later + std::chrono::milliseconds(i % 100000), []{});
+        }
+    });
+
+    bench("observe_via_ring(1024)", count / 10, [](int n){
+        std::atomic<bool> done{false};
+        rx::observe_via_ring(numbers(n), 1024).subscribe([](int x){
+            consume(x);
+        }, [](rx::default_error_type){}, [&done]{
+            done = true;
+        });
+        while (!done) {
+            std::this_thread::yield();
+        }
+    });
+
+    size_t code = code_size();
+    printf("%-32s %8zu bytes\n", "code size", code);
+    if (options.json && !write_json(options.json, code)) {
+        return 1;
+    }
+    if (options.baseline && compare(options.baseline, code) > 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,464 @@
+#pragma once
+
+#include "rx.h"
+#include "rx_ring.h"
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace windberry {
+namespace rx {
+
+// Values a source of a join can be ahead of the slowest one by default.
+static constexpr size_t default_join_capacity = 64;
+
+constexpr bool all_of(std::initializer_list<bool> xs) {
+    for (bool x : xs) {
+        if (!x) {
+            return false;
+        }
+    }
+    return true;
+}
+
+constexpr bool any_of(std::initializer_list<bool> xs) {
+    for (bool x : xs) {
+        if (x) {
+            return true;
+        }
+    }
+    return false;
+}
+
+enum class join_mode : char {
+    zip,               // one value from every source per tuple
+    combine_latest,    // the latest value of every source, whenever one sends
+    with_latest_from,  // each value of the first source, with the latest of the others
+};
+
+// Values from one source of a join, waiting for whichever thread is sending
+// the joined values. A source sends from one thread at a time, so its queue
+// is a single-producer ring. The ring requests capacity values from a
+// flowable source, and requests more as they're taken out.
+//
+// A source that ignores demand can fill the ring, as a synchronous one does
+// before the next source has even subscribed. Its values then go to a
+// locked overflow queue, until the ring and the queue have both been
+// emptied.
+template <typename T>
+struct join_source {
+    spsc_ring<T> ring;
+    subscription up;
+    std::atomic<bool> done{false};
+    // Set by the source when it starts using overflow, and cleared by the
+    // sending thread once it has emptied it.
+    std::atomic<bool> spilled{false};
+    std::mutex m;
+    std::deque<T> overflow;
+    // Only touched by the thread sending the joined values.
+    Maybe<T> latest;
+    size_t consumed = 0;
+
+    join_source(size_t capacity) : ring(capacity), up(ring.capacity()) {}
+
+    // Returns false if the ring is full and spill is false.
+    template <typename X>
+    bool push(X &&x, bool spill) {
+        if (!spilled.load(std::memory_order_acquire) && ring.try_push(std::forward<X>(x))) {
+            return true;
+        }
+        if (!spill) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(m);
+        overflow.push_back(std::forward<X>(x));
+        spilled.store(true, std::memory_order_release);
+        return true;
+    }
+
+    // The next value, or null. Overflow only has values once the ring is
+    // full, so it's only looked at once the ring is empty.
+    T *front() {
+        if (T *x = ring.front()) {
+            return x;
+        }
+        if (!spilled.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(m);
+        return &overflow.front();
+    }
+
+    // The value front returned has been used.
+    void pop() {
+        if (!ring.empty()) {
+            ring.pop();
+            const size_t replenish = ring.capacity() / 2 ? ring.capacity() / 2 : 1;
+            if (++consumed == replenish) {
+                up.request(consumed);
+                consumed = 0;
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m);
+        overflow.pop_front();
+        if (overflow.empty()) {
+            spilled.store(false, std::memory_order_release);
+        }
+    }
+
+    // No more values will arrive. done is set after the last push.
+    bool exhausted() {
+        return done.load(std::memory_order_acquire) && ring.empty() &&
+               !spilled.load(std::memory_order_acquire);
+    }
+};
+
+// Sources push into their rings from any thread, and then whichever thread
+// finds no one else sending takes values out and sends them on, until it
+// finds nothing more to do.
+template <join_mode Mode, typename Observer, typename E, typename... Ts>
+struct join_state : producer {
+    using value_type = std::tuple<Ts...>;
+    using error_type = E;
+    static constexpr size_t n = sizeof...(Ts);
+
+    template <size_t I>
+    using T_at = typename std::tuple_element<I, value_type>::type;
+
+    Observer s;
+    subscription down;
+    std::tuple<join_source<Ts>...> sources;
+    // Whether a source that ignores demand fails the join once it's
+    // capacity values ahead, rather than overflowing its ring.
+    bool bounded;
+
+    // Threads that asked for a drain since the sending one started.
+    std::atomic<size_t> wip{0};
+    std::atomic<bool> claimed{false};
+    std::atomic<bool> failed{false};
+    Maybe<E> error;
+    // Only touched by the thread sending the joined values.
+    bool finished = false;
+    size_t have_latest = 0;
+
+    template <typename>
+    static size_t capacity_of(size_t capacity) { return capacity; }
+
+    join_state(Observer s_, size_t capacity, bool bounded_)
+        : s(std::move(s_)), down(s.get_subscription()), sources(capacity_of<Ts>(capacity)...),
+          bounded(bounded_) {}
+
+    template <size_t I>
+    auto &source() { return std::get<I>(sources); }
+
+    template <size_t I, typename X>
+    void push(X &&x) {
+        auto &src = source<I>();
+        if (failed.load(std::memory_order_relaxed) || src.up.is_disposed()) {
+            return;
+        }
+        if (!src.push(std::forward<X>(x), !bounded)) {
+            fail(ring_overflow_error<E>::make());
+            return;
+        }
+        drain();
+    }
+
+    template <size_t I>
+    void complete() {
+        source<I>().done.store(true, std::memory_order_release);
+        drain();
+    }
+
+    // The first error wins, and is sent before any queued values.
+    void fail(E e) {
+        if (!claimed.exchange(true)) {
+            error = Just(std::move(e));
+            failed.store(true, std::memory_order_release);
+        }
+        drain();
+    }
+
+    void cancel() { cancel(std::index_sequence_for<Ts...>{}); }
+
+    template <size_t... I>
+    void cancel(std::index_sequence<I...>) {
+        int dispose[] = {(source<I>().up.dispose(), 0)...};
+        (void)dispose;
+    }
+
+    // Called when the subscriber requests more values.
+    void resume() override { drain(); }
+
+    void drain() {
+        if (wip.fetch_add(1, std::memory_order_acq_rel) != 0) {
+            return;
+        }
+        size_t missed = 1;
+        for (;;) {
+            if (!finished) {
+                run(std::index_sequence_for<Ts...>{});
+            }
+            missed = wip.fetch_sub(missed, std::memory_order_acq_rel) - missed;
+            if (missed == 0) {
+                return;
+            }
+        }
+    }
+
+    // Whether sending has finished for good.
+    bool stopped() {
+        if (finished) {
+            return true;
+        }
+        if (s.is_disposed()) {
+            finish();
+            return true;
+        }
+        if (failed.load(std::memory_order_acquire)) {
+            finish();
+            s.send_error(std::move(*error.orNull()));
+            return true;
+        }
+        return false;
+    }
+
+    void finish() {
+        finished = true;
+        cancel();
+    }
+
+    void finish_completed() {
+        finish();
+        s.send_completed();
+    }
+
+    template <size_t... I>
+    void run(std::index_sequence<I...> is) {
+        switch (Mode) {
+            case join_mode::zip:              run_zip(is); break;
+            case join_mode::combine_latest:   run_combine_latest(is); break;
+            case join_mode::with_latest_from: run_with_latest_from(is); break;
+        }
+    }
+
+    // Values are moved out of the rings into the tuple.
+    template <size_t... I>
+    void run_zip(std::index_sequence<I...>) {
+        while (!stopped()) {
+            if (all_of({source<I>().front() != nullptr...})) {
+                if (down.requested() == 0) {
+                    return;
+                }
+                down.produced(1);
+                s.send_next(value_type(std::move(*source<I>().front())...));
+                int pop[] = {(source<I>().pop(), 0)...};
+                (void)pop;
+                continue;
+            }
+            // One of the rings is empty. If its source is done, no more
+            // tuples can be made.
+            if (any_of({source<I>().exhausted()...})) {
+                finish_completed();
+            }
+            return;
+        }
+    }
+
+    // Takes the next value from source I into its latest value. Returns
+    // false if there wasn't one, or if it would be sent without demand.
+    template <size_t I>
+    bool take_latest(bool send) {
+        auto &src = source<I>();
+        T_at<I> *x = src.front();
+        if (!x) {
+            return false;
+        }
+        bool had = src.latest.orNull() != nullptr;
+        if (send && down.requested() == 0 && have_latest + !had == n) {
+            return false;
+        }
+        src.latest = Just(std::move(*x));
+        src.pop();
+        if (!had) {
+            ++have_latest;
+        }
+        return true;
+    }
+
+    template <size_t... I>
+    void send_latest(std::index_sequence<I...>) {
+        down.produced(1);
+        s.send_next(value_type(*source<I>().latest.orNull()...));
+    }
+
+    template <size_t I, typename Indices>
+    bool combine_step(Indices is) {
+        if (stopped() || !take_latest<I>(true)) {
+            return false;
+        }
+        if (have_latest == n) {
+            send_latest(is);
+        }
+        return true;
+    }
+
+    // Sources take turns, one value at a time, so that one busy source
+    // doesn't hold up the others' values.
+    template <size_t... I>
+    void run_combine_latest(std::index_sequence<I...> is) {
+        while (!stopped()) {
+            bool took[] = {combine_step<I>(is)...};
+            if (finished) {
+                return;
+            }
+            if (!any_of({took[I]...})) {
+                // Done once every source is, or once a source that never
+                // sent anything is.
+                if (all_of({source<I>().exhausted()...}) ||
+                    any_of({source<I>().exhausted() && !source<I>().latest.orNull()...})) {
+                    finish_completed();
+                }
+                return;
+            }
+        }
+    }
+
+    template <size_t I, size_t... J>
+    void send_with_latest(T_at<I> &&x, std::index_sequence<J...>) {
+        down.produced(1);
+        s.send_next(value_type(std::move(x), *source<J + 1>().latest.orNull()...));
+    }
+
+    // The other sources' values only update their latest ones, so they're
+    // taken first. Values of the first source from before every other
+    // source has sent one are dropped.
+    template <size_t... I>
+    void run_with_latest_from(std::index_sequence<I...>) {
+        using others = std::make_index_sequence<n - 1>;
+        auto &first = source<0>();
+        while (!stopped()) {
+            for (;;) {
+                bool took[] = {(I != 0 && take_latest<I>(false))...};
+                if (!any_of({took[I]...})) {
+                    break;
+                }
+            }
+            T_at<0> *x = first.front();
+            if (!x) {
+                if (first.exhausted()) {
+                    finish_completed();
+                }
+                return;
+            }
+            if (have_latest == n - 1) {
+                if (down.requested() == 0) {
+                    return;
+                }
+                send_with_latest<0>(std::move(*x), others{});
+            }
+            first.pop();
+        }
+    }
+};
+
+template <size_t I, typename State>
+struct join_observer {
+    using value_type = typename std::tuple_element<I, typename State::value_type>::type;
+    using error_type = typename State::error_type;
+    std::shared_ptr<State> st;
+
+    inline subscription get_subscription() const { return st->template source<I>().up; }
+    inline bool is_disposed() const { return st->template source<I>().up.is_disposed(); }
+    inline void request(size_t n) const { st->template source<I>().up.request(n); }
+    inline void send_next(const value_type &x) const { st->template push<I>(x); }
+    inline void send_next(value_type &&x) const { st->template push<I>(std::move(x)); }
+    inline void send_error(error_type e) const { st->fail(std::move(e)); }
+    inline void send_completed() const { st->template complete<I>(); }
+};
+
+template <join_mode Mode, typename Observer, typename E, typename Sources, size_t... I>
+void subscribe_join(const Sources &os, size_t capacity, bool bounded, Observer s, std::index_sequence<I...>) {
+    using State = join_state<Mode, Observer, E, typename std::tuple_element<I, Sources>::type::value_type...>;
+    auto st = make_state<State>(s.get_subscription(), std::move(s), capacity, bounded);
+    std::weak_ptr<State> weak = st;
+    st->down.add([weak]{
+        if (auto st = weak.lock()) {
+            st->cancel();
+        }
+    });
+    if (st->down.requested() != subscription::unbounded) {
+        st->down.set_producer(st);
+    }
+    int subscribe[] = {(std::get<I>(os).subscribe(join_observer<I, State>{st}), 0)...};
+    (void)subscribe;
+}
+
+template <join_mode Mode, typename Observable, typename... Observables>
+auto make_join(size_t capacity, bool bounded, Observable first, Observables... rest) {
+    using E = typename Observable::error_type;
+    using T = std::tuple<typename Observable::value_type, typename Observables::value_type...>;
+    static_assert(all_of({std::is_same<E, typename Observables::error_type>::value...}),
+                  "Error types must match");
+    auto os = std::make_tuple(std::move(first), std::move(rest)...);
+    const char *name = Mode == join_mode::zip ? "zip"
+                     : Mode == join_mode::combine_latest ? "combine_latest"
+                     : "with_latest_from";
+    return make_operator<T, E>(name, [os, capacity, bounded](auto s){
+        using indices = std::make_index_sequence<1 + sizeof...(Observables)>;
+        subscribe_join<Mode, decltype(s), E>(os, capacity, bounded, std::move(s), indices{});
+    });
+}
+
+// Sends a tuple of the nth values of each observable. Completes once one of
+// them has completed and every value it sent has been used. Flowable
+// sources are asked for values so they stay at most default_join_capacity
+// ahead of the slowest one; values from sources that ignore demand are
+// queued however far ahead they get.
+template <typename Observable, typename... Observables, typename = typename Observable::value_type>
+auto zip(Observable first, Observables... rest) {
+    return make_join<join_mode::zip>(default_join_capacity, false, std::move(first), std::move(rest)...);
+}
+
+// Like zip, but a source that ignores demand and gets more than capacity
+// values ahead fails the result with ring_overflow_error<E>.
+template <typename... Observables>
+auto zip(size_t capacity, Observables... os) {
+    return make_join<join_mode::zip>(capacity, true, std::move(os)...);
+}
+
+// Sends a tuple of the latest values of each observable whenever one of them
+// sends, once they all have. Completes once they all have, or once one has
+// without sending anything.
+template <typename Observable, typename... Observables, typename = typename Observable::value_type>
+auto combine_latest(Observable first, Observables... rest) {
+    return make_join<join_mode::combine_latest>(default_join_capacity, false, std::move(first), std::move(rest)...);
+}
+
+template <typename... Observables>
+auto combine_latest(size_t capacity, Observables... os) {
+    return make_join<join_mode::combine_latest>(capacity, true, std::move(os)...);
+}
+
+// Sends a tuple of each value of source with the latest values of the
+// others. Values sent before all the others have sent one are dropped.
+// Completes when source does.
+template <typename Observable, typename... Observables, typename = typename Observable::value_type>
+auto with_latest_from(Observable source, Observables... others) {
+    return make_join<join_mode::with_latest_from>(default_join_capacity, false, std::move(source), std::move(others)...);
+}
+
+template <typename... Observables>
+auto with_latest_from(size_t capacity, Observables... os) {
+    return make_join<join_mode::with_latest_from>(capacity, true, std::move(os)...);
+}
+
+}
+}
@@ -0,0 +1,485 @@
+#pragma once
+
+#include "rx.h"
+
+// Coroutine sources and awaitable observables, for compilers with C++20
+// coroutines. Elsewhere this header defines RX_COROUTINES as 0 and nothing
+// else, so it can be included from code built as C++14.
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define RX_COROUTINES 1
+#endif
+#endif
+#ifndef RX_COROUTINES
+#define RX_COROUTINES 0
+#endif
+
+#if RX_COROUTINES
+
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+namespace windberry {
+namespace rx {
+
+// co_yield fail(e) in a coroutine source sends e as its error and ends it.
+template <typename E>
+struct failure {
+    E error;
+};
+
+template <typename E>
+inline failure<std::decay_t<E>> fail(E &&e) {
+    return {std::forward<E>(e)};
+}
+
+// Throws an awaited observable's error in the awaiting coroutine.
+template <typename E>
+struct error_thrower {
+    [[noreturn]] static void raise(E e) { throw std::move(e); }
+};
+
+template <>
+struct error_thrower<std::exception_ptr> {
+    [[noreturn]] static void raise(std::exception_ptr e) { std::rethrow_exception(e); }
+};
+
+template <>
+struct error_thrower<std::error_code> {
+    [[noreturn]] static void raise(std::error_code e) { throw std::system_error(e); }
+};
+
+// Awaitables that subscribe to something. When awaited in a coroutine
+// source, they subscribe with a child of its subscription, so disposing the
+// source stops the wait.
+struct linked_awaitable {
+    subscription sub;
+};
+
+// The return type of a coroutine that generates an observable's values,
+// for make_coroutine. co_yield sends a value, co_return completes, and
+// exceptions are sent as errors when E is std::exception_ptr.
+//
+// A coroutine that yields more values than its subscriber has requested is
+// suspended until it requests more, possibly resuming on the requesting
+// thread. One whose subscription is disposed is destroyed at its next
+// co_yield, or straight away if it's already waiting to yield.
+template <typename T, typename E = default_error_type>
+class coroutine_source {
+  public:
+    using value_type = T;
+    using error_type = E;
+
+    struct promise_type;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    // Resumes the coroutine when its subscriber has demand again. parked is
+    // set while it waits to yield; whoever clears it resumes or destroys it.
+    struct waker : producer {
+        handle_type h;
+        subscription sub;
+        std::atomic<bool> parked{false};
+
+        waker(handle_type h_, subscription sub_) : h(h_), sub(std::move(sub_)) {}
+
+        // Called with the coroutine suspended in a co_yield. Returns whether
+        // it should stay suspended.
+        bool park() {
+            parked.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return !(ready() && unpark());
+        }
+
+        void resume() override {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (parked.load() && ready() && unpark()) {
+                h.resume();
+            }
+        }
+
+      private:
+        inline bool ready() const { return sub.is_disposed() || sub.requested() != 0; }
+
+        // Claims the parked coroutine. Returns false if it was destroyed
+        // instead, because it was disposed.
+        bool unpark() {
+            if (!parked.exchange(false)) {
+                return false;
+            }
+            if (sub.is_disposed()) {
+                stop();
+                return false;
+            }
+            return true;
+        }
+
+      public:
+        // Destroys the suspended coroutine, which owns this.
+        void stop() {
+            std::shared_ptr<waker> self = h.promise().w;
+            sub.clear_producer(this);
+            h.destroy();
+        }
+    };
+
+    struct yield_awaiter {
+        promise_type *p;
+
+        inline bool await_ready() const noexcept {
+            return !p->sub.is_disposed() && p->sub.requested() != 0;
+        }
+        inline bool await_suspend(handle_type) const noexcept { return p->w->park(); }
+        inline void await_resume() const noexcept {}
+    };
+
+    struct final_awaiter {
+        inline bool await_ready() const noexcept { return false; }
+        inline void await_suspend(handle_type h) const noexcept { h.promise().w->stop(); }
+        inline void await_resume() const noexcept {}
+    };
+
+    struct promise_type {
+        Maybe<any_observer<T, E>> out;
+        subscription sub;
+        std::shared_ptr<waker> w;
+        // Keeps the function that made the coroutine, and so its captures,
+        // alive while it runs.
+        std::shared_ptr<void> maker;
+
+        coroutine_source get_return_object() { return coroutine_source(handle_type::from_promise(*this)); }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        final_awaiter final_suspend() const noexcept { return {}; }
+
+        yield_awaiter yield_value(const T &x) { return yield_value(T(x)); }
+        yield_awaiter yield_value(T &&x) {
+            out.orNull()->send_next(std::move(x));
+            sub.produced(1);
+            return {this};
+        }
+        yield_awaiter yield_value(failure<E> f) {
+            out.orNull()->send_error(std::move(f.error));
+            return {this};
+        }
+        void return_void() { out.orNull()->send_completed(); }
+
+        void unhandled_exception() {
+            Maybe<E> e = exception_error<E>::current();
+            if (!e.orNull()) {
+                throw;
+            }
+            out.orNull()->send_error(std::move(*e.orNull()));
+        }
+
+        template <typename A>
+        decltype(auto) await_transform(A &&a) {
+            if constexpr (std::is_base_of<linked_awaitable, std::decay_t<A>>::value) {
+                a.sub = sub.child();
+            }
+            return std::forward<A>(a);
+        }
+    };
+
+    coroutine_source(coroutine_source &&other) noexcept : h(std::exchange(other.h, nullptr)) {}
+    coroutine_source(const coroutine_source &) = delete;
+    ~coroutine_source() {
+        if (h) {
+            h.destroy();
+        }
+    }
+
+    // Runs the coroutine for s, as far as its demand allows.
+    template <typename Observer>
+    void start(Observer s, std::shared_ptr<void> maker = nullptr) {
+        handle_type started = std::exchange(h, nullptr);
+        promise_type &p = started.promise();
+        p.sub = s.get_subscription();
+        p.out = Just(any_observer<T, E>(std::move(s)));
+        p.maker = std::move(maker);
+        p.w = make_state<waker>(p.sub, started, p.sub);
+        if (p.sub.requested() == subscription::unbounded) {
+            started.resume();
+            return;
+        }
+        std::shared_ptr<waker> w = p.w;
+        w->sub.set_producer(w);
+        std::weak_ptr<waker> weak = w;
+        w->sub.add([weak]{
+            if (auto w = weak.lock()) {
+                w->resume();
+            }
+        });
+        w->parked.store(true);
+        w->resume();
+    }
+
+  private:
+    explicit coroutine_source(handle_type h_) : h(h_) {}
+
+    handle_type h;
+};
+
+// Makes an observable from a function that returns a coroutine_source,
+// starting a new coroutine for each subscription.
+//
+//     auto countdown = make_coroutine([n]() -> coroutine_source<int> {
+//         for (int i = n; i > 0; --i) {
+//             co_yield i;
+//         }
+//     });
+template <typename F>
+inline auto make_coroutine(F f) {
+    using S = std::decay_t<decltype(f())>;
+    using T = typename S::value_type;
+    using E = typename S::error_type;
+    return make_operator<T, E>("make_coroutine", [f](auto s){
+        auto maker = make_state<F>(s.get_subscription(), f);
+        (*maker)().start(std::move(s), maker);
+    });
+}
+
+// Resumes an awaiting coroutine on the thread that finished the wait, or
+// posts its resumption to a queue.
+struct resume_inline {
+    inline void operator()(std::coroutine_handle<> h) const { h.resume(); }
+};
+
+template <typename Q>
+struct resume_on {
+    decltype(schedule_on<Q>{}(std::declval<Q>())) post;
+
+    explicit resume_on(Q q) : post(schedule_on<Q>{}(q)) {}
+    inline void operator()(std::coroutine_handle<> h) const { post([h]{ h.resume(); }); }
+};
+
+template <typename Resume>
+struct is_resume_inline : std::is_same<Resume, resume_inline> {};
+
+// Subscribes to an observable when awaited, and resumes with its first or
+// last value, or Nothing if it completed without one or the wait was
+// disposed. Errors are thrown.
+template <typename Observable, bool Last, typename Resume>
+class value_awaiter : public linked_awaitable {
+    using T = typename Observable::value_type;
+    using E = typename Observable::error_type;
+
+    struct state {
+        Resume resume;
+        std::coroutine_handle<> h;
+        Maybe<T> value;
+        Maybe<E> error;
+        // 0 until the awaiter has suspended or the wait has finished.
+        std::atomic<int> phase{0};
+
+        explicit state(Resume r) : resume(std::move(r)) {}
+
+        void finish() {
+            if (phase.exchange(2) == 1) {
+                resume(h);
+            }
+        }
+    };
+
+    struct value_observer {
+        using value_type = T;
+        using error_type = E;
+        std::shared_ptr<state> st;
+        subscription sub;
+
+        inline void send_next(T x) const {
+            st->value = Just(std::move(x));
+            if (!Last) {
+                sub.dispose();
+            }
+        }
+        inline void send_error(E e) const { st->error = Just(std::move(e)); }
+        inline void send_completed() const {}
+    };
+
+  public:
+    value_awaiter(Observable o_, Resume r) : o(std::move(o_)), resume(std::move(r)) {}
+
+    inline bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        st = make_state<state>(sub, resume);
+        st->h = h;
+        // Disposing the subscription, after a value, an error, completion or
+        // from outside, finishes the wait.
+        sub.add([st = st]{ st->finish(); });
+        o.subscribe(with_subscription(value_observer{st, sub}, sub));
+        int expected = 0;
+        if (st->phase.compare_exchange_strong(expected, 1)) {
+            return true;
+        }
+        // Finished while subscribing.
+        if (is_resume_inline<Resume>::value) {
+            return false;
+        }
+        st->resume(h);
+        return true;
+    }
+
+    Maybe<T> await_resume() {
+        if (E *e = st->error.orNull()) {
+            error_thrower<E>::raise(std::move(*e));
+        }
+        return std::move(st->value);
+    }
+
+  private:
+    Observable o;
+    Resume resume;
+    std::shared_ptr<state> st;
+};
+
+// co_await next_value(o) subscribes to o and resumes with its first value.
+// With a queue, the coroutine is resumed on it, otherwise on the thread that
+// sent the value, or without suspending if it was sent while subscribing.
+template <typename Observable>
+inline auto next_value(Observable o) {
+    return value_awaiter<Observable, false, resume_inline>(std::move(o), resume_inline{});
+}
+
+template <typename Observable, typename Q>
+inline auto next_value(Observable o, Q q) {
+    return value_awaiter<Observable, false, resume_on<Q>>(std::move(o), resume_on<Q>(q));
+}
+
+// co_await last_value(o) subscribes to o and resumes with its last value once
+// it completes.
+template <typename Observable>
+inline auto last_value(Observable o) {
+    return value_awaiter<Observable, true, resume_inline>(std::move(o), resume_inline{});
+}
+
+template <typename Observable, typename Q>
+inline auto last_value(Observable o, Q q) {
+    return value_awaiter<Observable, true, resume_on<Q>>(std::move(o), resume_on<Q>(q));
+}
+
+// Reads an observable's values one at a time: each co_await r.next() resumes
+// with the next value, or Nothing once it has completed. Values are requested
+// one at a time, and sources that don't respect demand have theirs queued.
+// The subscription starts with the first next, and ends with the reader.
+template <typename Observable, typename Resume = resume_inline>
+class observable_reader {
+    using T = typename Observable::value_type;
+    using E = typename Observable::error_type;
+
+    struct state {
+        Resume resume;
+        std::mutex m;
+        std::deque<T> values;
+        Maybe<E> error;
+        bool done = false;
+        std::coroutine_handle<> waiting;
+
+        explicit state(Resume r) : resume(std::move(r)) {}
+
+        template <typename F>
+        void update(F f) {
+            std::coroutine_handle<> h;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                f();
+                h = std::exchange(waiting, nullptr);
+            }
+            if (h) {
+                resume(h);
+            }
+        }
+    };
+
+    struct reader_observer {
+        using value_type = T;
+        using error_type = E;
+        std::shared_ptr<state> st;
+
+        inline void send_next(T x) const { st->update([&]{ st->values.push_back(std::move(x)); }); }
+        inline void send_error(E e) const {
+            st->update([&]{
+                st->error = Just(std::move(e));
+                st->done = true;
+            });
+        }
+        inline void send_completed() const { st->update([&]{ st->done = true; }); }
+    };
+
+  public:
+    observable_reader(Observable o_, Resume r = Resume())
+        : o(std::move(o_)), sub(1), st(std::make_shared<state>(std::move(r))) {}
+    observable_reader(const observable_reader &) = delete;
+    ~observable_reader() { sub.dispose(); }
+
+    struct next_awaiter {
+        observable_reader *r;
+
+        bool await_ready() {
+            r->start();
+            std::lock_guard<std::mutex> lock(r->st->m);
+            return !r->st->values.empty() || r->st->done;
+        }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard<std::mutex> lock(r->st->m);
+            if (!r->st->values.empty() || r->st->done) {
+                return false;
+            }
+            r->st->waiting = h;
+            return true;
+        }
+        Maybe<T> await_resume() {
+            Maybe<T> x;
+            {
+                std::lock_guard<std::mutex> lock(r->st->m);
+                if (!r->st->values.empty()) {
+                    x = Just(std::move(r->st->values.front()));
+                    r->st->values.pop_front();
+                } else if (E *e = r->st->error.orNull()) {
+                    E error = std::move(*e);
+                    r->st->error = Nothing<E>();
+                    error_thrower<E>::raise(std::move(error));
+                }
+            }
+            if (x.isJust()) {
+                r->sub.request(1);
+            }
+            return x;
+        }
+    };
+
+    next_awaiter next() { return {this}; }
+
+  private:
+    void start() {
+        if (!started) {
+            started = true;
+            o.subscribe(with_subscription(reader_observer{st}, sub));
+        }
+    }
+
+    Observable o;
+    subscription sub;
+    std::shared_ptr<state> st;
+    bool started = false;
+};
+
+template <typename Observable>
+inline auto read(Observable o) {
+    return observable_reader<Observable>(std::move(o));
+}
+
+template <typename Observable, typename Q>
+inline auto read(Observable o, Q q) {
+    return observable_reader<Observable, resume_on<Q>>(std::move(o), resume_on<Q>(q));
+}
+
+}
+}
+
+#endif
@@ -46,7 +46,7 @@ struct throttle_observer : forwarding_observer<T, E, Observer> {
                       dispatch_queue_t q_,
                       dispatch_time_t i_,
                       dispatch_time_t l_)
-        : forwarding_observer<T, E, Observer>(s_), q(q_), interval(i_), leeway(l_) {}
+        : forwarding_observer<T, E, Observer>(std::move(s_)), q(q_), interval(i_), leeway(l_) {}
 
     void send_next(T x) const {
         if (*timerp) {
@@ -75,7 +75,7 @@ auto throttle(const Observable &o,
     using T = typename Observable::value_type;
     using E = typename Observable::error_type;
     return make_observable<T>([=](auto s){
-        o.subscribe(throttle_observer<T, E, decltype(s)>{s, q, interval, leeway});
+        o.subscribe(throttle_observer<T, E, decltype(s)>{std::move(s), q, interval, leeway});
     });
 }
 
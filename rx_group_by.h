@@ -0,0 +1,407 @@
+#pragma once
+
+#include "rx.h"
+#include "rx_ring.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace windberry {
+namespace rx {
+
+// One group of values with the same key. Values are only sent to those
+// subscribed at the time, so subscribe to it as it's sent.
+template <typename K, typename T, typename E = default_error_type>
+struct grouped_observable : publish_subject<T, E> {
+    K key;
+    explicit grouped_observable(K key_) : key(std::move(key_)) {}
+};
+
+// When group_by ends groups, to bound how many it keeps. An ended group
+// completes, and the next value with its key starts a new one.
+struct group_limits {
+    using duration = std::chrono::steady_clock::duration;
+
+    duration max_idle = duration::max();
+    size_t max_groups = size_t(-1);
+    // Values queued per shard before the source waits.
+    size_t queue_capacity = 1024;
+
+    // Ends groups that haven't had a value for d. They're only checked when
+    // a value arrives, for the same shard when sharded, so a group can stay
+    // open long past d while values stop coming.
+    group_limits &idle(duration d) { max_idle = d; return *this; }
+    // Ends the least recently used group to make room for a new one.
+    group_limits &groups(size_t n) { max_groups = n ? n : 1; return *this; }
+    group_limits &queue(size_t n) { queue_capacity = n; return *this; }
+};
+
+// The groups of one group_by subscription, or one shard of it, most
+// recently used first. Not thread-safe.
+template <typename K, typename T, typename E>
+class group_table {
+  public:
+    using group = grouped_observable<K, T, E>;
+    using clock = std::chrono::steady_clock;
+
+    explicit group_table(const group_limits &limits_)
+        : limits(limits_), timed(limits_.max_idle != group_limits::duration::max()) {}
+    group_table(const group_table &) = delete;
+
+    // Sends x to key's group, calling on_new with the group first if it's
+    // new.
+    template <typename X, typename F>
+    void send(const K &key, X &&x, F &&on_new) {
+        clock::time_point now = timed ? expire() : clock::time_point();
+        auto it = index.find(key);
+        if (it == index.end()) {
+            if (groups.size() >= limits.max_groups) {
+                end(std::prev(groups.end()), Nothing<E>());
+            }
+            groups.push_front(entry{group(key), now});
+            it = index.emplace(key, groups.begin()).first;
+            on_new(static_cast<const group &>(groups.front().g));
+        } else {
+            if (it->second != groups.begin()) {
+                groups.splice(groups.begin(), groups, it->second);
+            }
+            it->second->last = now;
+        }
+        it->second->g.send_next(std::forward<X>(x));
+    }
+
+    // Ends the groups that have been idle too long, and returns the time.
+    // send calls it, so idle groups only end when a value arrives.
+    clock::time_point expire() {
+        clock::time_point now = clock::now();
+        while (!groups.empty() && now - groups.back().last > limits.max_idle) {
+            end(std::prev(groups.end()), Nothing<E>());
+        }
+        return now;
+    }
+
+    // Sends the error, or completion, to every group.
+    void finish(const Maybe<E> &error) {
+        while (!groups.empty()) {
+            end(groups.begin(), error);
+        }
+    }
+
+    size_t size() const { return groups.size(); }
+
+  private:
+    struct entry {
+        group g;
+        clock::time_point last;
+    };
+    using list = std::list<entry>;
+
+    void end(typename list::iterator it, const Maybe<E> &error) {
+        group g = std::move(it->g);
+        index.erase(g.key);
+        groups.erase(it);
+        if (const E *e = error.orNull()) {
+            g.send_error(*e);
+        } else {
+            g.send_completed();
+        }
+    }
+
+    group_limits limits;
+    bool timed;
+    list groups;
+    std::unordered_map<K, typename list::iterator> index;
+};
+
+template <typename K, typename T, typename E, typename KeyFn, typename Observer>
+struct group_by_observer : forwarding_observer<T, E, Observer> {
+    struct state {
+        KeyFn key;
+        group_table<K, T, E> table;
+        state(KeyFn key_, const group_limits &limits) : key(std::move(key_)), table(limits) {}
+    };
+    std::shared_ptr<state> st;
+    subscription sub;
+    group_by_observer(Observer s_, KeyFn key, const group_limits &limits, subscription sub_)
+        : forwarding_observer<T, E, Observer>(std::move(s_)),
+          st(make_state<state>(sub_, std::move(key), limits)), sub(std::move(sub_)) {}
+
+    inline subscription get_subscription() const { return sub; }
+    inline bool is_disposed() const { return sub.is_disposed(); }
+    inline void request(size_t) const {}
+    inline void send_next(const T &x) const { next(x); }
+    inline void send_next(T &&x) const { next(std::move(x)); }
+
+    template <typename X>
+    inline void next(X &&x) const {
+        K k = st->key(static_cast<const T &>(x));
+        st->table.send(k, std::forward<X>(x), [this](const grouped_observable<K, T, E> &g){
+            this->s.send_next(g);
+        });
+    }
+
+    inline void send_error(E e) const {
+        st->table.finish(Just(e));
+        this->s.send_error(std::move(e));
+    }
+
+    inline void send_completed() const {
+        st->table.finish(Nothing<E>());
+        this->s.send_completed();
+    }
+};
+
+// Sends a grouped_observable for each key key_fn gives the values, and
+// sends each value to its key's group. Groups are sent values, and end,
+// on the source's thread.
+template <typename Observable, typename KeyFn>
+auto group_by(const Observable &o, KeyFn key_fn, group_limits limits = group_limits()) {
+    using T = typename Observable::value_type;
+    using E = typename Observable::error_type;
+    using K = std::decay_t<decltype(key_fn(std::declval<const T &>()))>;
+    return make_operator<grouped_observable<K, T, E>, E>("group_by", [o, key_fn, limits](auto s){
+        subscription sub = s.get_subscription().child();
+        o.subscribe(group_by_observer<K, T, E, KeyFn, decltype(s)>{std::move(s), key_fn, limits, sub});
+    });
+}
+
+// Mixes a key's hash so shards get an even share of keys whose hashes
+// aren't, like small integers.
+inline size_t shard_of(size_t hash, size_t shards) {
+    uint64_t h = uint64_t(hash) * 0x9e3779b97f4a7c15ull;
+    return size_t((h ^ (h >> 32)) % shards);
+}
+
+// The source sends each value to its key's shard through a ring. A shard's
+// drain, run on its serial scheduler, owns the shard's groups, so neither
+// side takes a lock per value; the source only schedules a drain when the
+// shard has gone idle.
+template <typename K, typename T, typename E, typename Observer, typename F>
+struct group_shards {
+    using group = grouped_observable<K, T, E>;
+    // Drained per turn before giving the scheduler's other work a go.
+    static constexpr size_t max_batch = 256;
+    // The source polls a full shard this many times before parking.
+    static constexpr int spin_limit = 64;
+
+    struct item {
+        K key;
+        T value;
+    };
+
+    struct shard {
+        spsc_ring<item> ring;
+        F f;
+        group_table<K, T, E> table;
+        // Whether a drain is scheduled or running. Left set once the shard
+        // has finished.
+        std::atomic<bool> scheduled{false};
+        // Set while the source is parked waiting for room in the ring.
+        std::atomic<bool> producer_parked{false};
+        std::mutex m;
+        std::condition_variable room;
+        shard(const group_limits &limits, F f_)
+            : ring(limits.queue_capacity), f(std::move(f_)), table(limits) {}
+    };
+
+    Observer s;
+    // The source's subscription.
+    subscription sub;
+    std::vector<std::shared_ptr<shard>> shards;
+    // Set once the source has ended, after its error.
+    std::atomic<bool> done{false};
+    Maybe<E> error;
+    std::atomic<size_t> running;
+    // Serializes what's sent to the subscriber from different shards: new
+    // groups, and the end.
+    std::mutex m;
+
+    group_shards(Observer s_, subscription sub_, size_t n)
+        : s(std::move(s_)), sub(std::move(sub_)), running(n) {}
+
+    template <typename X>
+    void push(K &&key, X &&x) {
+        shard &sh = *shards[shard_of(std::hash<K>()(key), shards.size())];
+        item i{std::move(key), std::forward<X>(x)};
+        int spins = 0;
+        while (!sh.ring.try_push(std::move(i))) {
+            if (sub.is_disposed()) {
+                return;
+            }
+            wake(sh);
+            if (++spins < spin_limit) {
+                std::this_thread::yield();
+            } else {
+                spins = 0;
+                wait_for_room(sh);
+            }
+        }
+        wake(sh);
+    }
+
+    // Parks the source until the shard's ring has room, or the source is
+    // disposed. The shard's drain is scheduled by now.
+    void wait_for_room(shard &sh) {
+        std::unique_lock<std::mutex> lock(sh.m);
+        sh.producer_parked.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        sh.room.wait(lock, [this, &sh]{ return !sh.ring.full() || sub.is_disposed(); });
+        sh.producer_parked.store(false, std::memory_order_relaxed);
+    }
+
+    // Called by a drain once it has made room, and on disposal. A drain
+    // calls it every half ring and at the end of each turn, which is enough
+    // for a source that parked with the ring full.
+    void wake_producer(shard &sh) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sh.producer_parked.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(sh.m);
+            sh.room.notify_one();
+        }
+    }
+
+    void end(Maybe<E> &&e) {
+        error = std::move(e);
+        done.store(true);
+        for (auto &sh : shards) {
+            wake(*sh);
+        }
+    }
+
+    void wake(shard &sh) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!sh.scheduled.load(std::memory_order_relaxed) && !sh.scheduled.exchange(true)) {
+            schedule(sh);
+        }
+    }
+
+    void schedule(shard &sh) {
+        sh.f([st = owner.lock(), p = &sh]{ st->drain(*p); });
+    }
+
+    void drain(shard &sh) {
+        auto on_new = [this](const group &g){
+            std::lock_guard<std::mutex> lock(m);
+            s.send_next(g);
+        };
+        const size_t half = sh.ring.capacity() / 2;
+        for (size_t n = 0; n < max_batch; ++n) {
+            if (sh.ring.pop_with([&](item &&i){
+                    if (!sub.is_disposed()) {
+                        sh.table.send(i.key, std::move(i.value), on_new);
+                    }
+                })) {
+                if (half != 0 && (n + 1) % half == 0) {
+                    wake_producer(sh);
+                }
+                continue;
+            }
+            // Values pushed before done was set are in the ring by now.
+            if (done.load()) {
+                if (sh.ring.empty()) {
+                    finish(sh);
+                    return;
+                }
+                continue;
+            }
+            wake_producer(sh);
+            sh.scheduled.store(false);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if ((sh.ring.empty() && !done.load(std::memory_order_relaxed)) || sh.scheduled.exchange(true)) {
+                return;
+            }
+        }
+        wake_producer(sh);
+        schedule(sh);
+    }
+
+    void finish(shard &sh) {
+        if (sub.is_disposed()) {
+            return;
+        }
+        sh.table.finish(error);
+        if (running.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(m);
+            if (const E *e = error.orNull()) {
+                s.send_error(*e);
+            } else {
+                s.send_completed();
+            }
+        }
+    }
+
+    // Drains keep this alive while they're scheduled.
+    std::weak_ptr<group_shards> owner;
+};
+
+template <typename K, typename T, typename E, typename KeyFn, typename State>
+struct group_shard_observer {
+    using value_type = T;
+    using error_type = E;
+    std::shared_ptr<State> st;
+    KeyFn key;
+
+    inline subscription get_subscription() const { return st->sub; }
+    inline bool is_disposed() const { return st->sub.is_disposed(); }
+    inline void request(size_t) const {}
+    inline void send_next(const T &x) const { st->push(key(x), x); }
+    inline void send_next(T &&x) const {
+        K k = key(static_cast<const T &>(x));
+        st->push(std::move(k), std::move(x));
+    }
+    inline void send_error(E e) const { st->end(Just(std::move(e))); }
+    inline void send_completed() const { st->end(Nothing<E>()); }
+};
+
+// Like group_by, but spreads keys across a number of shards, each with its
+// own serial scheduler on q, like deliver_on's. A key's values are sent to
+// its group in order on its shard, while different shards run in parallel.
+// New groups and the end are sent to the subscriber one at a time, from the
+// shards' threads.
+//
+// The source waits when a shard has limits.queue_capacity values queued,
+// parking after a short spin, so it shouldn't run on q if q has only one
+// thread.
+template <typename Observable, typename KeyFn, typename Q>
+auto group_by(const Observable &o, KeyFn key_fn, Q q, size_t shards,
+              group_limits limits = group_limits()) {
+    using T = typename Observable::value_type;
+    using E = typename Observable::error_type;
+    using K = std::decay_t<decltype(key_fn(std::declval<const T &>()))>;
+    shards = shards ? shards : 1;
+    return make_operator<grouped_observable<K, T, E>, E>("group_by", [o, key_fn, q, shards, limits](auto s){
+        auto f = schedule_on<Q>{}(q);
+        using F = decltype(serial_scheduler(f));
+        using State = group_shards<K, T, E, decltype(s), F>;
+        subscription sub = s.get_subscription().child();
+        auto st = make_state<State>(sub, std::move(s), sub, shards);
+        st->owner = st;
+        st->shards.reserve(shards);
+        for (size_t i = 0; i < shards; ++i) {
+            st->shards.push_back(make_state<typename State::shard>(sub, limits, serial_scheduler(f)));
+        }
+        // A source parked on a full shard stops waiting for room.
+        std::weak_ptr<State> weak = st;
+        sub.add([weak]{
+            if (auto st = weak.lock()) {
+                for (auto &sh : st->shards) {
+                    st->wake_producer(*sh);
+                }
+            }
+        });
+        o.subscribe(group_shard_observer<K, T, E, KeyFn, State>{st, key_fn});
+    });
+}
+
+}
+}
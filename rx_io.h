@@ -0,0 +1,587 @@
+#pragma once
+
+#include "rx.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+namespace windberry {
+namespace rx {
+
+#if __cplusplus >= 201703L
+using string_view = std::string_view;
+#else
+// Characters owned by someone else, until C++17's std::string_view.
+class string_view {
+  public:
+    static constexpr size_t npos = size_t(-1);
+
+    constexpr string_view() noexcept : p(nullptr), n(0) {}
+    constexpr string_view(const char *p_, size_t n_) noexcept : p(p_), n(n_) {}
+    string_view(const char *s) : p(s), n(std::strlen(s)) {}
+    string_view(const std::string &s) noexcept : p(s.data()), n(s.size()) {}
+
+    inline const char *data() const noexcept { return p; }
+    inline size_t size() const noexcept { return n; }
+    inline bool empty() const noexcept { return n == 0; }
+    inline const char *begin() const noexcept { return p; }
+    inline const char *end() const noexcept { return p + n; }
+    inline char operator[](size_t i) const { return p[i]; }
+
+    string_view substr(size_t pos, size_t count = npos) const {
+        return string_view(p + pos, count < n - pos ? count : n - pos);
+    }
+    explicit operator std::string() const { return std::string(p, n); }
+
+    friend bool operator==(string_view a, string_view b) {
+        return a.n == b.n && (a.n == 0 || std::memcmp(a.p, b.p, a.n) == 0);
+    }
+    friend bool operator!=(string_view a, string_view b) { return !(a == b); }
+
+  private:
+    const char *p;
+    size_t n;
+};
+#endif
+
+inline std::exception_ptr io_error(const std::string &what, int error = errno) {
+    return std::make_exception_ptr(std::system_error(error, std::generic_category(), what));
+}
+
+// How a stream of bytes divides into records.
+struct framing {
+    enum class kind { lines, fixed, length_prefixed };
+    kind k;
+    size_t n;
+
+    // Records ending in '\n', which isn't included. Text after the last
+    // newline is a record too.
+    static framing lines() { return {kind::lines, 0}; }
+    // Records of n bytes each.
+    static framing fixed(size_t n) { return {kind::fixed, n ? n : 1}; }
+    // Records preceded by their length, as a 4-byte big-endian integer.
+    static framing length_prefixed() { return {kind::length_prefixed, 4}; }
+
+    // Finds the record at the start of n bytes at p. Returns how many bytes
+    // it takes with its delimiter or prefix, and sets r to it, or returns 0
+    // if it isn't all there.
+    size_t next(const char *p, size_t size, string_view &r) const {
+        switch (k) {
+        case kind::lines:
+            if (const void *nl = std::memchr(p, '\n', size)) {
+                size_t len = static_cast<const char *>(nl) - p;
+                r = string_view(p, len);
+                return len + 1;
+            }
+            return 0;
+        case kind::fixed:
+            if (size < n) {
+                return 0;
+            }
+            r = string_view(p, n);
+            return n;
+        case kind::length_prefixed:
+            if (size < n || size - n < prefix(p)) {
+                return 0;
+            }
+            r = string_view(p + n, prefix(p));
+            return n + r.size();
+        }
+        return 0;
+    }
+
+    // How many bytes the record starting with size bytes at p takes in all,
+    // or 0 if that depends on bytes yet to come.
+    size_t wanted(const char *p, size_t size) const {
+        switch (k) {
+        case kind::lines:
+            return 0;
+        case kind::fixed:
+            return n;
+        case kind::length_prefixed:
+            return size < n ? n : n + prefix(p);
+        }
+        return 0;
+    }
+
+    // Whether bytes left at the end of the stream are a record: only for
+    // lines. Anything else is a truncated record.
+    inline bool takes_rest() const { return k == kind::lines; }
+
+  private:
+    static size_t prefix(const char *p) {
+        const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+        return size_t(u[0]) << 24 | size_t(u[1]) << 16 | size_t(u[2]) << 8 | size_t(u[3]);
+    }
+};
+
+// Splits chunks of a stream into records. Records within a chunk point into
+// it; only records that span chunks are copied, into a buffer reused for
+// each of them.
+class record_splitter {
+  public:
+    explicit record_splitter(framing f_) : f(f_) {}
+
+    // Sends each record completed by chunk, until s is disposed.
+    template <typename Observer>
+    void feed(string_view chunk, const Observer &s) {
+        const char *p = chunk.data();
+        size_t n = chunk.size();
+        while (!carry.empty() && n != 0) {
+            size_t take = n;
+            if (size_t want = f.wanted(carry.data(), carry.size())) {
+                take = std::min(n, want - carry.size());
+            } else if (const void *nl = std::memchr(p, '\n', n)) {
+                take = static_cast<const char *>(nl) - p + 1;
+            }
+            carry.append(p, take);
+            p += take;
+            n -= take;
+            string_view r;
+            if (f.next(carry.data(), carry.size(), r) != 0) {
+                s.send_next(r);
+                carry.clear();
+            }
+        }
+        string_view r;
+        for (size_t used; !s.is_disposed() && (used = f.next(p, n, r)) != 0; p += used, n -= used) {
+            s.send_next(r);
+        }
+        carry.append(p, n);
+    }
+
+    // Sends what's left at the end of the stream, and its completion, or an
+    // error if it's a truncated record.
+    template <typename Observer>
+    void finish(const Observer &s) {
+        if (!carry.empty()) {
+            if (!f.takes_rest()) {
+                s.send_error(io_error("truncated record", EILSEQ));
+                return;
+            }
+            s.send_next(string_view(carry));
+            carry.clear();
+        }
+        s.send_completed();
+    }
+
+  private:
+    framing f;
+    std::string carry;
+};
+
+// Closes a file descriptor when the last handle to it goes.
+struct file_descriptor {
+    int fd;
+    explicit file_descriptor(int fd_) : fd(fd_) {}
+    file_descriptor(const file_descriptor &) = delete;
+    ~file_descriptor() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+struct file_mapping {
+    const char *data = nullptr;
+    size_t size = 0;
+    file_mapping() = default;
+    file_mapping(const file_mapping &) = delete;
+    ~file_mapping() {
+        if (data) {
+            ::munmap(const_cast<char *>(data), size);
+        }
+    }
+};
+
+struct mapped_file_reader {
+    std::string path;
+    framing f;
+    std::shared_ptr<file_mapping> m;
+    size_t offset = 0;
+
+    template <typename Observer>
+    bool open(const Observer &s) {
+        file_descriptor file(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat st;
+        if (file.fd < 0 || ::fstat(file.fd, &st) != 0) {
+            s.send_error(io_error(path));
+            return false;
+        }
+        subscription sub = s.get_subscription();
+        m = make_state<file_mapping>(sub);
+        if (st.st_size > 0) {
+            void *p = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, file.fd, 0);
+            if (p == MAP_FAILED) {
+                s.send_error(io_error(path));
+                return false;
+            }
+            ::madvise(p, size_t(st.st_size), MADV_SEQUENTIAL);
+            m->data = static_cast<const char *>(p);
+            m->size = size_t(st.st_size);
+        }
+        // Records point into the mapping, so it lasts as long as the
+        // subscription.
+        sub.add([m = m]{});
+        return true;
+    }
+
+    template <typename Observer>
+    bool emit(const Observer &s) {
+        if (!m && !open(s)) {
+            return false;
+        }
+        size_t left = m->size - offset;
+        if (left == 0) {
+            s.send_completed();
+            return false;
+        }
+        string_view r;
+        size_t used = f.next(m->data + offset, left, r);
+        if (used == 0) {
+            if (!f.takes_rest()) {
+                s.send_error(io_error(path + ": truncated record", EILSEQ));
+                return false;
+            }
+            r = string_view(m->data + offset, left);
+            used = left;
+        }
+        offset += used;
+        s.send_next(r);
+        return true;
+    }
+};
+
+// Maps the file at path into memory for each subscription, and sends its
+// records as views into the mapping, without copying them. They stay valid
+// until the subscription ends: when it's disposed, or after the subscriber
+// has been sent completion or an error. Sends records as they're requested.
+inline auto mapped_file(std::string path, framing f = framing::lines()) {
+    return make_flowable<string_view>(mapped_file_reader{std::move(path), f, nullptr},
+                                      [](mapped_file_reader &r, auto &s){ return r.emit(s); });
+}
+
+struct chunk_reader {
+    std::string path;
+    size_t chunk_size;
+    std::shared_ptr<file_descriptor> file;
+    std::shared_ptr<std::vector<char>> buffer;
+
+    template <typename Observer>
+    bool emit(const Observer &s) {
+        if (!file) {
+            subscription sub = s.get_subscription();
+            file = make_state<file_descriptor>(sub, ::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+            if (file->fd < 0) {
+                s.send_error(io_error(path));
+                return false;
+            }
+#ifdef POSIX_FADV_SEQUENTIAL
+            ::posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            buffer = make_state<std::vector<char>>(sub, chunk_size);
+        }
+        ssize_t n;
+        do {
+            n = ::read(file->fd, buffer->data(), buffer->size());
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            s.send_error(io_error(path));
+            return false;
+        }
+        if (n == 0) {
+            s.send_completed();
+            return false;
+        }
+        s.send_next(string_view(buffer->data(), size_t(n)));
+        return true;
+    }
+};
+
+// Reads the file at path in chunks of up to chunk_size bytes, for files too
+// big to map. Each chunk is a view into a buffer that's reused for the next
+// one, so it's only valid until send_next returns. Reads chunks as they're
+// requested.
+inline auto read_chunks(std::string path, size_t chunk_size = 64 * 1024) {
+    return make_flowable<string_view>(chunk_reader{std::move(path), chunk_size ? chunk_size : 1,
+                                                   nullptr, nullptr},
+                                      [](chunk_reader &r, auto &s){ return r.emit(s); });
+}
+
+template <typename E, typename Observer>
+struct split_records_observer : forwarding_observer<string_view, E, Observer> {
+    std::shared_ptr<record_splitter> st;
+    subscription sub;
+    split_records_observer(Observer s_, framing f, subscription sub_)
+        : forwarding_observer<string_view, E, Observer>(std::move(s_)),
+          st(make_state<record_splitter>(sub_, f)), sub(std::move(sub_)) {}
+
+    inline subscription get_subscription() const { return sub; }
+    inline bool is_disposed() const { return sub.is_disposed(); }
+    inline void request(size_t) const {}
+    inline void send_next(string_view chunk) const { st->feed(chunk, this->s); }
+    inline void send_completed() const { st->finish(this->s); }
+};
+
+// Splits an observable of chunks, like read_chunks or read_fd send, into
+// records. Records are only valid until send_next returns.
+template <typename Observable>
+auto split_records(const Observable &o, framing f) {
+    using E = typename Observable::error_type;
+    return make_operator<string_view, E>("split_records", [o, f](auto s){
+        subscription sub = s.get_subscription().child();
+        o.subscribe(split_records_observer<E, decltype(s)>{std::move(s), f, sub});
+    });
+}
+
+#ifdef __linux__
+// Runs callbacks on a thread of its own when file descriptors are ready to
+// read, using epoll.
+class io_loop {
+  public:
+    io_loop() : epoll(::epoll_create1(EPOLL_CLOEXEC)), wake(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+        if (epoll.fd < 0 || wake.fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "io_loop");
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = 0;
+        ::epoll_ctl(epoll.fd, EPOLL_CTL_ADD, wake.fd, &ev);
+        thread = std::thread([this]{ run(); });
+    }
+
+    ~io_loop() {
+        stopping = true;
+        uint64_t one = 1;
+        ssize_t written = ::write(wake.fd, &one, sizeof(one));
+        (void)written;
+        thread.join();
+    }
+
+    io_loop(const io_loop &) = delete;
+
+    using watch_id = uint64_t;
+
+    // Calls on_ready with the watch's id on the loop's thread whenever fd is
+    // ready to read, or has hung up, until it's removed. That can be before
+    // add returns. Returns 0 if fd can't be watched.
+    watch_id add(int fd, std::function<void(watch_id)> on_ready) {
+        std::lock_guard<std::mutex> lock(m);
+        watch_id id = ++last_id;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.u64 = id;
+        if (::epoll_ctl(epoll.fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            return 0;
+        }
+        watches[id] = std::make_shared<watch>(watch{fd, std::move(on_ready)});
+        return id;
+    }
+
+    // Stops or resumes calling a watch's on_ready. epoll reports hang-ups
+    // and errors whatever events it's asked for, so a paused fd is taken
+    // out of the epoll set altogether.
+    void pause(watch_id id, bool paused) {
+        std::lock_guard<std::mutex> lock(m);
+        auto it = watches.find(id);
+        if (it == watches.end() || it->second->paused == paused) {
+            return;
+        }
+        watch &w = *it->second;
+        w.paused = paused;
+        if (paused) {
+            ::epoll_ctl(epoll.fd, EPOLL_CTL_DEL, w.fd, nullptr);
+        } else {
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.u64 = id;
+            ::epoll_ctl(epoll.fd, EPOLL_CTL_ADD, w.fd, &ev);
+        }
+    }
+
+    // Stops watching. on_ready may still be running on the loop's thread,
+    // but isn't called again.
+    void remove(watch_id id) {
+        std::shared_ptr<watch> w;
+        std::lock_guard<std::mutex> lock(m);
+        auto it = watches.find(id);
+        if (it != watches.end()) {
+            w = std::move(it->second);
+            watches.erase(it);
+            if (!w->paused) {
+                ::epoll_ctl(epoll.fd, EPOLL_CTL_DEL, w->fd, nullptr);
+            }
+        }
+    }
+
+  private:
+    struct watch {
+        int fd;
+        std::function<void(watch_id)> on_ready;
+        bool paused = false;
+    };
+
+    void run() {
+        epoll_event events[64];
+        while (!stopping) {
+            int n = ::epoll_wait(epoll.fd, events, 64, -1);
+            for (int i = 0; i < n; ++i) {
+                if (events[i].data.u64 == 0) {
+                    continue;
+                }
+                std::shared_ptr<watch> w;
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    auto it = watches.find(events[i].data.u64);
+                    if (it == watches.end()) {
+                        continue;
+                    }
+                    w = it->second;
+                }
+                w->on_ready(events[i].data.u64);
+            }
+        }
+    }
+
+    file_descriptor epoll;
+    file_descriptor wake;
+    std::mutex m;
+    std::unordered_map<watch_id, std::shared_ptr<watch>> watches;
+    watch_id last_id = 0;
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+};
+
+template <typename Observer>
+struct fd_reader : producer {
+    Observer s;
+    subscription sub;
+    io_loop *loop;
+    int fd;
+    std::vector<char> buffer;
+    // Only written on the loop's thread, by ready. resume only reads it once
+    // it has seen paused, which ready sets after writing it.
+    io_loop::watch_id id = 0;
+    std::atomic<bool> paused{false};
+    bool done = false;
+
+    fd_reader(Observer s_, io_loop *loop_, int fd_, size_t buffer_size)
+        : s(std::move(s_)), sub(s.get_subscription()), loop(loop_), fd(fd_), buffer(buffer_size) {}
+
+    // The loop holds the reader until it's removed, when the subscription
+    // is disposed or the stream ends.
+    void start(const std::shared_ptr<fd_reader> &self) {
+        int flags = ::fcntl(fd, F_GETFL);
+        if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+            s.send_error(io_error("read_fd"));
+            return;
+        }
+        if (sub.requested() != subscription::unbounded) {
+            sub.set_producer(self);
+        }
+        // The loop can call ready before add returns, if fd is already
+        // readable, so ready takes the id from the loop.
+        io_loop::watch_id watch = loop->add(fd, [self](io_loop::watch_id w){ self->ready(w); });
+        if (watch == 0) {
+            sub.clear_producer(this);
+            s.send_error(io_error("read_fd"));
+            return;
+        }
+        sub.add([loop = loop, watch]{ loop->remove(watch); });
+    }
+
+    // On the loop's thread. Reads until the descriptor would block, or the
+    // subscriber has no more demand.
+    void ready(io_loop::watch_id w) {
+        id = w;
+        while (!done && !s.is_disposed()) {
+            if (sub.requested() == 0) {
+                loop->pause(id, true);
+                paused = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                // Demand that arrived meanwhile didn't see the pause.
+                if (sub.requested() == 0 || !paused.exchange(false)) {
+                    return;
+                }
+                loop->pause(id, false);
+            }
+            ssize_t n = ::read(fd, buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (n <= 0) {
+                finish(n == 0 ? nullptr : io_error("read_fd"));
+                return;
+            }
+            s.send_next(string_view(buffer.data(), size_t(n)));
+            sub.produced(1);
+        }
+    }
+
+    void resume() override {
+        if (paused.exchange(false)) {
+            loop->pause(id, false);
+        }
+    }
+
+  private:
+    void finish(std::exception_ptr e) {
+        done = true;
+        sub.clear_producer(this);
+        loop->remove(id);
+        if (e) {
+            s.send_error(e);
+        } else {
+            s.send_completed();
+        }
+    }
+};
+
+// Sends what's read from fd, such as a pipe or socket, in chunks of up to
+// buffer_size bytes, as it arrives, and completes at the end of the stream.
+// Reads happen on loop's thread. fd is made non-blocking, and isn't closed.
+//
+// Each chunk is a view into a buffer that's reused for the next one, so it's
+// only valid until send_next returns. The buffer belongs to the
+// subscription. Subscribers that request values are sent a chunk per value,
+// and fd isn't read while they have no demand.
+inline auto read_fd(int fd, io_loop *loop, size_t buffer_size = 64 * 1024) {
+    assert(loop);
+    return make_operator<string_view, default_error_type>("read_fd", [fd, loop, buffer_size](auto s){
+        using R = fd_reader<decltype(s)>;
+        subscription sub = s.get_subscription();
+        auto r = make_state<R>(sub, std::move(s), loop, fd, buffer_size ? buffer_size : 1);
+        r->start(r);
+    });
+}
+#endif
+
+}
+}
@@ -0,0 +1,495 @@
+#pragma once
+
+#include "rx.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+namespace windberry {
+namespace rx {
+
+inline size_t round_up_to_power_of_two(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+// A bounded lock-free queue for one producer thread and one consumer thread.
+// Capacity is rounded up to a power of two.
+template <typename T>
+class spsc_ring {
+  public:
+    explicit spsc_ring(size_t capacity)
+        : mask(round_up_to_power_of_two(capacity ? capacity : 1) - 1),
+          slots(new slot[mask + 1]) {}
+    spsc_ring(const spsc_ring &) = delete;
+    spsc_ring &operator=(const spsc_ring &) = delete;
+
+    ~spsc_ring() {
+        while (pop_with([](T &&){})) {}
+    }
+
+    // Leaves x untouched if the ring is full.
+    template <typename U>
+    bool try_push(U &&x) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - cached_tail > mask) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h - cached_tail > mask) {
+                return false;
+            }
+        }
+        new (slots[h & mask].storage) T(std::forward<U>(x));
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Calls f with the oldest value, if there is one.
+    template <typename F>
+    bool pop_with(F &&f) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == cached_head) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (t == cached_head) {
+                return false;
+            }
+        }
+        T *x = reinterpret_cast<T *>(slots[t & mask].storage);
+        f(std::move(*x));
+        x->~T();
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // The oldest value, or null if there isn't one. The consumer can look at
+    // the oldest values of several rings before popping any of them.
+    T *front() {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == cached_head) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (t == cached_head) {
+                return nullptr;
+            }
+        }
+        return reinterpret_cast<T *>(slots[t & mask].storage);
+    }
+
+    // Removes the value returned by front.
+    void pop() {
+        size_t t = tail.load(std::memory_order_relaxed);
+        reinterpret_cast<T *>(slots[t & mask].storage)->~T();
+        tail.store(t + 1, std::memory_order_release);
+    }
+
+    bool empty() const {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+    }
+
+    bool full() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire) > mask;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+  private:
+    struct slot {
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    const size_t mask;
+    std::unique_ptr<slot[]> slots;
+
+    cache_line_pad pad0;
+    // Written by the producer.
+    std::atomic<size_t> head{0};
+    size_t cached_tail = 0;
+    cache_line_pad pad1;
+    // Written by the consumer.
+    std::atomic<size_t> tail{0};
+    size_t cached_head = 0;
+    cache_line_pad pad2;
+};
+
+// A bounded lock-free queue for any number of producer and consumer threads,
+// using a sequence number per slot. Capacity is rounded up to a power of two.
+template <typename T>
+class mpmc_ring {
+  public:
+    explicit mpmc_ring(size_t capacity)
+        : mask(round_up_to_power_of_two(capacity ? capacity : 1) - 1),
+          cells(new cell[mask + 1]) {
+        for (size_t i = 0; i <= mask; ++i) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    mpmc_ring(const mpmc_ring &) = delete;
+    mpmc_ring &operator=(const mpmc_ring &) = delete;
+
+    ~mpmc_ring() {
+        while (pop_with([](T &&){})) {}
+    }
+
+    // Leaves x untouched if the ring is full.
+    template <typename U>
+    bool try_push(U &&x) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;) {
+            c = &cells[pos & mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            auto dif = static_cast<ptrdiff_t>(seq - pos);
+            if (dif == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        new (c->storage) T(std::forward<U>(x));
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Calls f with the oldest value, if there is one.
+    template <typename F>
+    bool pop_with(F &&f) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;) {
+            c = &cells[pos & mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            auto dif = static_cast<ptrdiff_t>(seq - (pos + 1));
+            if (dif == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        T *x = reinterpret_cast<T *>(c->storage);
+        f(std::move(*x));
+        x->~T();
+        c->seq.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        size_t pos = dequeue_pos.load(std::memory_order_acquire);
+        size_t seq = cells[pos & mask].seq.load(std::memory_order_acquire);
+        return static_cast<ptrdiff_t>(seq - (pos + 1)) < 0;
+    }
+
+    bool full() const {
+        size_t pos = enqueue_pos.load(std::memory_order_acquire);
+        size_t seq = cells[pos & mask].seq.load(std::memory_order_acquire);
+        return static_cast<ptrdiff_t>(seq - pos) < 0;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+  private:
+    struct cell {
+        std::atomic<size_t> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    const size_t mask;
+    std::unique_ptr<cell[]> cells;
+
+    cache_line_pad pad0;
+    std::atomic<size_t> enqueue_pos{0};
+    cache_line_pad pad1;
+    std::atomic<size_t> dequeue_pos{0};
+    cache_line_pad pad2;
+};
+
+// What a ring does with a value when it's full.
+enum class overflow_policy : char {
+    block,        // wait for the consumer to make room
+    drop_newest,  // drop the value being sent
+    drop_oldest,  // drop the oldest queued value to make room
+    error,        // stop, and send an error after the queued values
+};
+
+struct ring_overflow : std::overflow_error {
+    ring_overflow() : std::overflow_error("rx ring buffer overflow") {}
+};
+
+// The error sent by overflow_policy::error. Specialize for other error types.
+template <typename E>
+struct ring_overflow_error {
+    static E make() { return E(); }
+};
+
+template <>
+struct ring_overflow_error<std::exception_ptr> {
+    static std::exception_ptr make() { return std::make_exception_ptr(ring_overflow{}); }
+};
+
+template <>
+struct ring_overflow_error<std::error_code> {
+    static std::error_code make() { return std::make_error_code(std::errc::no_buffer_space); }
+};
+
+// Infallible observables have no error to send, so they mustn't use
+// overflow_policy::error.
+template <>
+struct ring_overflow_error<never> {
+    [[noreturn]] static never make() { std::terminate(); }
+};
+
+struct single_producer {};
+struct multi_producer {};
+
+// The ring requests capacity values from a flowable source, and requests
+// more as the consumer frees up space, so a flowable source never overflows
+// it. The consumer only sends values the subscriber has requested.
+template <typename T, typename E, typename Ring, typename Observer>
+struct ring_state : producer {
+    // The consumer, and a producer waiting for room, poll this many times
+    // before parking.
+    static constexpr int spin_limit = 64;
+
+    Ring ring;
+    Observer s;
+    overflow_policy policy;
+    // The source's demand, and the subscriber's.
+    subscription up;
+    subscription down;
+    // Values delivered since the source's demand was last topped up.
+    size_t consumed = 0;
+
+    std::atomic<bool> terminated{false};
+    std::atomic<bool> done{false};
+    Maybe<E> error;
+
+    // Off the ring's lines, which the producer and consumer write.
+    cache_line_pad pad;
+    std::atomic<bool> parked{false};
+    // Producers parked in wait_for_room. More than one can be, with
+    // multi_producer.
+    std::atomic<int> producers_parked{0};
+    std::mutex m;
+    std::condition_variable cv;
+    // Signalled when a parked producer may have room.
+    std::condition_variable room;
+
+    // Runs run. It holds a reference to the state until run returns, so
+    // the state is only destroyed on another thread once it's finishing.
+    std::thread consumer;
+
+    ring_state(size_t capacity, Observer s_, overflow_policy policy_)
+        : ring(capacity), s(std::move(s_)), policy(policy_),
+          up(ring.capacity()), down(s.get_subscription()) {}
+
+    ~ring_state() {
+        if (consumer.get_id() == std::this_thread::get_id()) {
+            consumer.detach();
+        } else if (consumer.joinable()) {
+            consumer.join();
+        }
+    }
+
+    template <typename X>
+    void push(X &&x) {
+        if (terminated.load(std::memory_order_relaxed) || up.is_disposed()) {
+            return;
+        }
+        int spins = 0;
+        while (!ring.try_push(std::forward<X>(x))) {
+            switch (policy) {
+                case overflow_policy::block:
+                    if (up.is_disposed()) {
+                        return;
+                    }
+                    wake();
+                    if (++spins < spin_limit) {
+                        std::this_thread::yield();
+                    } else {
+                        spins = 0;
+                        wait_for_room();
+                    }
+                    break;
+                case overflow_policy::drop_newest:
+                    return;
+                case overflow_policy::drop_oldest:
+                    ring.pop_with([](T &&){});
+                    break;
+                case overflow_policy::error:
+                    terminate(Just(ring_overflow_error<E>::make()));
+                    up.dispose();
+                    return;
+            }
+        }
+        wake();
+    }
+
+    void terminate(Maybe<E> &&e) {
+        if (terminated.exchange(true)) {
+            return;
+        }
+        error = std::move(e);
+        done.store(true, std::memory_order_release);
+        wake();
+    }
+
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(m);
+            cv.notify_one();
+        }
+    }
+
+    // Parks the producer until the ring has room, or the source is
+    // disposed.
+    void wait_for_room() {
+        std::unique_lock<std::mutex> lock(m);
+        producers_parked.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        room.wait(lock, [this]{ return !ring.full() || up.is_disposed(); });
+        producers_parked.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Called by the consumer once it has made room, and on disposal. The
+    // consumer only calls it every half ring, or before parking, which is
+    // enough for a producer that parked with the ring full.
+    void wake_producer() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (producers_parked.load(std::memory_order_relaxed) != 0) {
+            std::lock_guard<std::mutex> lock(m);
+            room.notify_all();
+        }
+    }
+
+    // Called when the subscriber requests more values.
+    void resume() override { wake(); }
+
+    bool ready() const {
+        if (ring.empty()) {
+            return done.load() || s.is_disposed();
+        }
+        return down.requested() != 0 || s.is_disposed();
+    }
+
+    void run() {
+        const size_t replenish = ring.capacity() / 2 ? ring.capacity() / 2 : 1;
+        auto deliver = [this](T &&x){
+            down.produced(1);
+            s.send_next(std::move(x));
+        };
+        int idle = 0;
+        for (;;) {
+            if (s.is_disposed()) {
+                return;
+            }
+            if (down.requested() != 0 && ring.pop_with(deliver)) {
+                // Only once the slot is free, since the request can run the
+                // source on this thread.
+                if (++consumed == replenish) {
+                    up.request(consumed);
+                    consumed = 0;
+                    wake_producer();
+                }
+                idle = 0;
+                continue;
+            }
+            // No more values are pushed once done is set.
+            if (done.load(std::memory_order_acquire) && ring.empty()) {
+                if (E *e = error.orNull()) {
+                    s.send_error(std::move(*e));
+                } else {
+                    s.send_completed();
+                }
+                return;
+            }
+            if (++idle < spin_limit) {
+                std::this_thread::yield();
+                continue;
+            }
+            idle = 0;
+            wake_producer();
+            std::unique_lock<std::mutex> lock(m);
+            parked.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            cv.wait(lock, [this]{ return ready(); });
+            parked.store(false, std::memory_order_relaxed);
+        }
+    }
+};
+
+template <typename T, typename E, typename State>
+struct ring_producer_observer {
+    using value_type = T;
+    using error_type = E;
+    std::shared_ptr<State> st;
+
+    inline subscription get_subscription() const { return st->up; }
+    inline bool is_disposed() const { return st->up.is_disposed(); }
+    inline void request(size_t n) const { st->up.request(n); }
+    inline void send_next(const T &x) const { st->push(x); }
+    inline void send_next(T &&x) const { st->push(std::move(x)); }
+    inline void send_error(E e) const { st->terminate(Just(std::move(e))); }
+    inline void send_completed() const { st->terminate(Nothing<E>()); }
+};
+
+template <typename T, typename E, typename Ring, typename Observable, typename Observer>
+void subscribe_via_ring(const Observable &o, size_t capacity, overflow_policy policy, Observer s) {
+    using State = ring_state<T, E, Ring, Observer>;
+    auto st = make_state<State>(s.get_subscription(), capacity, std::move(s), policy);
+    std::weak_ptr<State> weak = st;
+    st->down.add([weak]{
+        if (auto st = weak.lock()) {
+            st->up.dispose();
+            // A parked consumer sees it's disposed and returns, and a
+            // parked producer stops waiting for room.
+            st->wake();
+            st->wake_producer();
+        }
+    });
+    if (st->down.requested() != subscription::unbounded) {
+        st->down.set_producer(st);
+    }
+    st->consumer = std::thread([st]{ st->run(); });
+    o.subscribe(ring_producer_observer<T, E, State>{st});
+}
+
+// Hands events from the observable's generator to a dedicated consumer thread
+// through a bounded lock-free ring, which runs the subscriber's callbacks.
+// Sending a value doesn't allocate or take a lock unless the consumer is parked.
+//
+// Producers is single_producer if the generator sends from one thread at a
+// time, or multi_producer if it sends from several threads concurrently.
+// drop_oldest always uses the multi-producer ring, since the producer also
+// has to take values out of it.
+template <typename Producers = single_producer, typename Observable>
+auto observe_via_ring(const Observable &o,
+                      size_t capacity,
+                      overflow_policy policy = overflow_policy::block) {
+    using T = typename Observable::value_type;
+    using E = typename Observable::error_type;
+    constexpr bool multi = std::is_same<Producers, multi_producer>::value;
+    return make_operator<T, E>("observe_via_ring", [o, capacity, policy](auto s){
+        if (multi || policy == overflow_policy::drop_oldest) {
+            subscribe_via_ring<T, E, mpmc_ring<T>>(o, capacity, policy, std::move(s));
+        } else {
+            subscribe_via_ring<T, E, spsc_ring<T>>(o, capacity, policy, std::move(s));
+        }
+    });
+}
+
+}
+}
@@ -0,0 +1,305 @@
+#pragma once
+
+#include "rx.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace windberry {
+namespace rx {
+
+using task = std::function<void()>;
+
+// Runs functions immediately on the calling thread.
+struct immediate_scheduler {};
+
+template <>
+struct schedule_on<immediate_scheduler> {
+    inline auto operator()(immediate_scheduler) {
+        return [](auto &&f){ f(); };
+    }
+};
+
+// Runs functions in order on a thread of its own. Functions posted before
+// destruction still run; the destructor waits for them.
+class event_loop {
+  public:
+    event_loop() : thread([this]{ run(); }) {}
+    event_loop(const event_loop &) = delete;
+    event_loop &operator=(const event_loop &) = delete;
+
+    ~event_loop() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+
+    void post(task f) {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            tasks.push_back(std::move(f));
+            RX_TRACE_QUEUE_DEPTH(tasks.size());
+        }
+        cv.notify_one();
+    }
+
+    bool is_current() const { return std::this_thread::get_id() == thread.get_id(); }
+
+  private:
+    void run() {
+        std::unique_lock<std::mutex> lock(m);
+        for (;;) {
+            cv.wait(lock, [this]{ return !tasks.empty() || stopping; });
+            if (tasks.empty()) {
+                return;
+            }
+            // Take everything queued so far in one go.
+            std::deque<task> batch;
+            batch.swap(tasks);
+            lock.unlock();
+            for (auto &f : batch) {
+                f();
+            }
+            lock.lock();
+        }
+    }
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<task> tasks;
+    bool stopping = false;
+    std::thread thread;
+};
+
+// A fixed set of worker threads, each with its own deque. Workers run their
+// own tasks newest-first and steal the oldest tasks of other workers when
+// they run out. Tasks posted from a worker go to that worker's deque.
+class thread_pool {
+  public:
+    explicit thread_pool(size_t n = std::thread::hardware_concurrency()) {
+        n = n ? n : 1;
+        for (size_t i = 0; i < n; ++i) {
+            workers.emplace_back(new worker);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            threads.emplace_back([this, i]{ run(i); });
+        }
+    }
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    // Waits for all posted tasks, including ones they post, to finish.
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(idle_m);
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    void post(task f) {
+        size_t i = current_worker();
+        if (i == no_worker) {
+            i = next.fetch_add(1, std::memory_order_relaxed) % workers.size();
+        }
+        {
+            std::lock_guard<std::mutex> lock(workers[i]->m);
+            workers[i]->tasks.push_back(std::move(f));
+        }
+        size_t depth = pending.fetch_add(1) + 1;
+        RX_TRACE_QUEUE_DEPTH(depth);
+        (void)depth;
+        if (sleeping.load() > 0) {
+            { std::lock_guard<std::mutex> lock(idle_m); }
+            idle_cv.notify_one();
+        }
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // Whether the calling thread is one of this pool's workers.
+    bool is_current() const { return current_worker() != no_worker; }
+
+  private:
+    static constexpr size_t no_worker = size_t(-1);
+
+    // Padded so workers' locks don't share cache lines.
+    struct worker {
+        cache_line_pad before;
+        std::mutex m;
+        std::deque<task> tasks;
+        cache_line_pad after;
+    };
+
+    struct current {
+        const thread_pool *pool = nullptr;
+        size_t index = no_worker;
+    };
+
+    static current &this_thread() {
+        static thread_local current c;
+        return c;
+    }
+
+    size_t current_worker() const {
+        auto &c = this_thread();
+        return c.pool == this ? c.index : no_worker;
+    }
+
+    bool pop_local(size_t i, task &f) {
+        auto &w = *workers[i];
+        std::lock_guard<std::mutex> lock(w.m);
+        if (w.tasks.empty()) {
+            return false;
+        }
+        f = std::move(w.tasks.back());
+        w.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t i, task &f) {
+        for (size_t k = 1; k < workers.size(); ++k) {
+            auto &w = *workers[(i + k) % workers.size()];
+            std::unique_lock<std::mutex> lock(w.m, std::try_to_lock);
+            if (!lock.owns_lock() || w.tasks.empty()) {
+                continue;
+            }
+            f = std::move(w.tasks.front());
+            w.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void run(size_t i) {
+        this_thread() = current{this, i};
+        task f;
+        for (;;) {
+            if (pop_local(i, f) || steal(i, f)) {
+                pending.fetch_sub(1);
+                f();
+                f = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_m);
+            sleeping.fetch_add(1);
+            idle_cv.wait(lock, [this]{ return pending.load() > 0 || stopping; });
+            sleeping.fetch_sub(1);
+            if (stopping && pending.load() == 0) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> sleeping{0};
+    std::mutex idle_m;
+    std::condition_variable idle_cv;
+    bool stopping = false;
+};
+
+// Runs functions one at a time, in order, on a thread pool. Separate serial
+// queues on the same pool run in parallel. Copies refer to the same queue.
+class serial_queue {
+  public:
+    explicit serial_queue(thread_pool &pool) : st(std::make_shared<state>(pool)) {}
+
+    void post(task f) const {
+        {
+            std::lock_guard<std::mutex> lock(st->m);
+            st->tasks.push_back(std::move(f));
+            RX_TRACE_QUEUE_DEPTH(st->tasks.size());
+            if (st->running) {
+                return;
+            }
+            st->running = true;
+        }
+        st->pool.post([st = st]{ drain(st); });
+    }
+
+  private:
+    // Tasks run per turn on the pool before giving other queues a go.
+    static constexpr size_t max_batch = 64;
+
+    struct state {
+        thread_pool &pool;
+        std::mutex m;
+        std::deque<task> tasks;
+        bool running = false;
+        explicit state(thread_pool &pool_) : pool(pool_) {}
+    };
+
+    static void drain(const std::shared_ptr<state> &st) {
+        for (size_t n = 0; n < max_batch; ++n) {
+            task f;
+            {
+                std::lock_guard<std::mutex> lock(st->m);
+                if (st->tasks.empty()) {
+                    st->running = false;
+                    return;
+                }
+                f = std::move(st->tasks.front());
+                st->tasks.pop_front();
+            }
+            f();
+        }
+        st->pool.post([st]{ drain(st); });
+    }
+
+    std::shared_ptr<state> st;
+};
+
+template <>
+struct schedule_on<event_loop *> {
+    inline auto operator()(event_loop *q) {
+        assert(q);
+        return [q](auto f){ q->post(std::move(f)); };
+    }
+};
+
+template <>
+struct schedule_on<serial_queue> {
+    inline auto operator()(serial_queue q) {
+        return [q](auto f){ q.post(std::move(f)); };
+    }
+};
+
+struct pool_scheduler {
+    thread_pool *pool;
+
+    template <typename F>
+    inline void operator()(F f) const { pool->post(std::move(f)); }
+};
+
+template <>
+struct schedule_on<thread_pool *> {
+    inline auto operator()(thread_pool *q) {
+        assert(q);
+        return pool_scheduler{q};
+    }
+};
+
+// Gives each subscription delivered on a thread pool its own serial queue, so
+// its events stay in order while other subscriptions run on other workers.
+inline auto serial_scheduler(const pool_scheduler &p) {
+    return schedule_on<serial_queue>{}(serial_queue(*p.pool));
+}
+
+}
+}
@@ -0,0 +1,663 @@
+#pragma once
+
+#include "rx.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include <string.h>
+
+// Vector code is written with the GCC/Clang vector extensions, and compiled
+// for each instruction set by target attributes, so the rest of a program
+// needn't be built with -mavx2 to use it. Other compilers and architectures
+// get the scalar loops.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define RX_SIMD_X86 1
+#define RX_SIMD_INLINE inline __attribute__((always_inline))
+#define RX_SIMD_TARGET(isa) __attribute__((target(isa), flatten))
+#else
+#define RX_SIMD_X86 0
+#endif
+
+namespace windberry {
+namespace rx {
+
+enum class simd_level : char { scalar, sse2, avx2, avx512 };
+
+// The widest instruction set the CPU and OS support, found once.
+inline simd_level supported_simd_level() {
+    static const simd_level level = []{
+#if RX_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return simd_level::avx512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return simd_level::avx2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return simd_level::sse2;
+        }
+#endif
+        return simd_level::scalar;
+    }();
+    return level;
+}
+
+inline std::atomic<simd_level> &simd_level_limit() {
+    static std::atomic<simd_level> limit{simd_level::avx512};
+    return limit;
+}
+
+// Keeps the kernels below from using anything wider than level, e.g. to
+// compare them against the scalar loops.
+inline void limit_simd_level(simd_level level) {
+    simd_level_limit().store(level, std::memory_order_relaxed);
+}
+
+inline simd_level current_simd_level() {
+    simd_level limit = simd_level_limit().load(std::memory_order_relaxed);
+    simd_level supported = supported_simd_level();
+    return limit < supported ? limit : supported;
+}
+
+enum class simd_compare : char { less, less_equal, greater, greater_equal, equal, not_equal };
+enum class simd_op : char { add, subtract, multiply, divide, min, max };
+
+// Sums of 32-bit integers are kept in 64 bits, and sums of floats are
+// returned as doubles.
+template <typename T>
+using simd_sum_type = std::conditional_t<std::is_integral<T>::value, int64_t, double>;
+
+// The count, mean and sum of squared differences from the mean of some
+// values. Moments of separate runs of values can be merged.
+struct simd_moments {
+    size_t count = 0;
+    double mean = 0;
+    double m2 = 0;
+
+    double variance() const { return count ? m2 / count : 0; }
+
+    void merge(const simd_moments &o) {
+        if (o.count == 0) {
+            return;
+        }
+        size_t n = count + o.count;
+        double d = o.mean - mean;
+        mean += d * o.count / n;
+        m2 += o.m2 + d * d * count / n * o.count;
+        count = n;
+    }
+};
+
+template <size_t Bytes> struct simd_bytes {};
+
+#if RX_SIMD_X86
+template <typename T, size_t Bytes>
+struct simd_vector {
+    typedef T type __attribute__((vector_size(Bytes)));
+};
+
+// Passing wide vectors by value to functions built without the instruction
+// set changes their ABI, so vectors are only passed by reference, to
+// functions always inlined into ones built with it.
+
+// Loads W values from p into v, converting them to v's lane type.
+template <size_t W, typename V, typename T>
+RX_SIMD_INLINE void simd_load(V &v, const T *p) {
+    typename simd_vector<T, W * sizeof(T)>::type raw;
+    memcpy(&raw, p, sizeof(raw));
+    v = __builtin_convertvector(raw, V);
+}
+#else
+#define RX_SIMD_INLINE inline
+#endif
+
+// For scalars, or element-wise for vectors. Vector comparisons set each
+// lane of r to -1 or 0.
+template <simd_compare C, typename X, typename R>
+RX_SIMD_INLINE void simd_apply_compare(R &r, const X &a, const X &b) {
+    switch (C) {
+        case simd_compare::less:          r = a < b; break;
+        case simd_compare::less_equal:    r = a <= b; break;
+        case simd_compare::greater:       r = a > b; break;
+        case simd_compare::greater_equal: r = a >= b; break;
+        case simd_compare::equal:         r = a == b; break;
+        case simd_compare::not_equal:     r = a != b; break;
+    }
+}
+
+// Sets a to op(a, b).
+template <simd_op Op, typename X>
+RX_SIMD_INLINE void simd_apply_op(X &a, const X &b) {
+    switch (Op) {
+        case simd_op::add:      a = a + b; break;
+        case simd_op::subtract: a = a - b; break;
+        case simd_op::multiply: a = a * b; break;
+        case simd_op::divide:   a = a / b; break;
+        case simd_op::min:      a = b < a ? b : a; break;
+        case simd_op::max:      a = a < b ? b : a; break;
+    }
+}
+
+// Each kernel has a scalar run for simd_bytes<0>, and a vector run that
+// handles whole vectors of Bytes and leaves the rest to the scalar loop.
+template <typename T>
+struct simd_sum_kernel {
+    using result_type = simd_sum_type<T>;
+    // 32-bit integers and floats are widened in the vectors too, so they
+    // add up with the scalar loop's precision.
+    using lane_type = result_type;
+    const T *p;
+    size_t n;
+
+    result_type run(simd_bytes<0>, size_t i = 0) const {
+        result_type r = 0;
+        for (; i < n; ++i) {
+            r += p[i];
+        }
+        return r;
+    }
+
+#if RX_SIMD_X86
+    // Four sums at once, to hide the latency of the adds.
+    template <size_t Bytes>
+    result_type run(simd_bytes<Bytes>) const {
+        constexpr size_t W = Bytes / sizeof(T);
+        using V = typename simd_vector<lane_type, W * sizeof(lane_type)>::type;
+        V acc[4] = {}, v;
+        size_t i = 0;
+        for (; i + 4 * W <= n; i += 4 * W) {
+            for (size_t k = 0; k < 4; ++k) {
+                simd_load<W>(v, p + i + k * W);
+                acc[k] += v;
+            }
+        }
+        for (; i + W <= n; i += W) {
+            simd_load<W>(v, p + i);
+            acc[0] += v;
+        }
+        acc[0] += acc[1] + acc[2] + acc[3];
+        result_type r = run(simd_bytes<0>(), i);
+        for (size_t k = 0; k < W; ++k) {
+            r += acc[0][k];
+        }
+        return r;
+    }
+#endif
+};
+
+template <typename T, bool Max>
+struct simd_extreme_kernel {
+    using result_type = T;
+    const T *p;
+    size_t n;
+
+    T run(simd_bytes<0>, size_t i = 0, T r = T()) const {
+        if (i == 0) {
+            r = p[i++];
+        }
+        for (; i < n; ++i) {
+            pick(r, p[i]);
+        }
+        return r;
+    }
+
+    template <typename X>
+    static RX_SIMD_INLINE void pick(X &a, const X &b) {
+        simd_apply_op<Max ? simd_op::max : simd_op::min>(a, b);
+    }
+
+#if RX_SIMD_X86
+    template <size_t Bytes>
+    T run(simd_bytes<Bytes>) const {
+        constexpr size_t W = Bytes / sizeof(T);
+        if (n < W) {
+            return run(simd_bytes<0>());
+        }
+        typename simd_vector<T, Bytes>::type acc, v;
+        simd_load<W>(acc, p);
+        size_t i = W;
+        for (; i + W <= n; i += W) {
+            simd_load<W>(v, p + i);
+            pick(acc, v);
+        }
+        T r = acc[0];
+        for (size_t k = 1; k < W; ++k) {
+            pick(r, T(acc[k]));
+        }
+        return run(simd_bytes<0>(), i, r);
+    }
+#endif
+};
+
+// Two passes, summing the values and then the squared differences from
+// their mean, which loses less precision than summing squares.
+template <typename T>
+struct simd_moments_kernel {
+    using result_type = simd_moments;
+    const T *p;
+    size_t n;
+
+    double squares(size_t i, double mean) const {
+        double r = 0;
+        for (; i < n; ++i) {
+            double d = p[i] - mean;
+            r += d * d;
+        }
+        return r;
+    }
+
+    template <size_t Bytes>
+    simd_moments run(simd_bytes<Bytes> b) const {
+        simd_moments m;
+        if (n == 0) {
+            return m;
+        }
+        m.count = n;
+        m.mean = double(simd_sum_kernel<T>{p, n}.run(b)) / n;
+        m.m2 = run_squares(b, m.mean);
+        return m;
+    }
+
+    double run_squares(simd_bytes<0>, double mean) const {
+        return squares(0, mean);
+    }
+
+#if RX_SIMD_X86
+    template <size_t Bytes>
+    double run_squares(simd_bytes<Bytes>, double mean) const {
+        constexpr size_t W = Bytes / sizeof(T);
+        using D = typename simd_vector<double, W * sizeof(double)>::type;
+        D acc[2] = {}, d;
+        D means = D{} + mean;
+        size_t i = 0;
+        for (; i + 2 * W <= n; i += 2 * W) {
+            for (size_t k = 0; k < 2; ++k) {
+                simd_load<W>(d, p + i + k * W);
+                d -= means;
+                acc[k] += d * d;
+            }
+        }
+        for (; i + W <= n; i += W) {
+            simd_load<W>(d, p + i);
+            d -= means;
+            acc[0] += d * d;
+        }
+        acc[0] += acc[1];
+        double r = squares(i, mean);
+        for (size_t k = 0; k < W; ++k) {
+            r += acc[0][k];
+        }
+        return r;
+    }
+#endif
+};
+
+template <typename T, simd_compare C>
+struct simd_count_kernel {
+    using result_type = size_t;
+    const T *p;
+    size_t n;
+    T x;
+
+    size_t run(simd_bytes<0>, size_t i = 0) const {
+        size_t r = 0;
+        for (; i < n; ++i) {
+            bool match = false;
+            simd_apply_compare<C>(match, p[i], x);
+            r += match;
+        }
+        return r;
+    }
+
+#if RX_SIMD_X86
+    // Comparisons give -1 in each matching lane, which is subtracted from
+    // a count per lane. The counts are added up every so often, before
+    // they can overflow.
+    template <size_t Bytes>
+    size_t run(simd_bytes<Bytes>) const {
+        constexpr size_t W = Bytes / sizeof(T);
+        using V = typename simd_vector<T, Bytes>::type;
+        const size_t block = W * (size_t(1) << 24);
+        V xs = V{} + x, v;
+        size_t r = 0;
+        size_t i = 0;
+        while (i + W <= n) {
+            decltype(xs < xs) counts = {}, match;
+            size_t end = n - i > block ? i + block : n;
+            for (; i + W <= end; i += W) {
+                simd_load<W>(v, p + i);
+                simd_apply_compare<C>(match, v, xs);
+                counts -= match;
+            }
+            for (size_t k = 0; k < W; ++k) {
+                r += counts[k];
+            }
+        }
+        return r + run(simd_bytes<0>(), i);
+    }
+#endif
+};
+
+template <typename T, simd_op Op>
+struct simd_apply_kernel {
+    using result_type = void;
+    const T *p;
+    T *out;
+    size_t n;
+    T x;
+
+    void run(simd_bytes<0>, size_t i = 0) const {
+        for (; i < n; ++i) {
+            T y = p[i];
+            simd_apply_op<Op>(y, x);
+            out[i] = y;
+        }
+    }
+
+#if RX_SIMD_X86
+    template <size_t Bytes>
+    void run(simd_bytes<Bytes>) const {
+        constexpr size_t W = Bytes / sizeof(T);
+        using V = typename simd_vector<T, Bytes>::type;
+        V xs = V{} + x, v;
+        size_t i = 0;
+        for (; i + W <= n; i += W) {
+            simd_load<W>(v, p + i);
+            simd_apply_op<Op>(v, xs);
+            memcpy(out + i, &v, sizeof(v));
+        }
+        run(simd_bytes<0>(), i);
+    }
+#endif
+};
+
+#if RX_SIMD_X86
+template <typename Kernel>
+RX_SIMD_TARGET("sse2") typename Kernel::result_type simd_run_sse2(const Kernel &k) {
+    return k.run(simd_bytes<16>());
+}
+
+template <typename Kernel>
+RX_SIMD_TARGET("avx2") typename Kernel::result_type simd_run_avx2(const Kernel &k) {
+    return k.run(simd_bytes<32>());
+}
+
+template <typename Kernel>
+RX_SIMD_TARGET("avx512f") typename Kernel::result_type simd_run_avx512(const Kernel &k) {
+    return k.run(simd_bytes<64>());
+}
+#endif
+
+// Runs a kernel with the widest instruction set in use.
+template <typename Kernel>
+typename Kernel::result_type simd_run(const Kernel &k) {
+    switch (current_simd_level()) {
+#if RX_SIMD_X86
+        case simd_level::avx512: return simd_run_avx512(k);
+        case simd_level::avx2:   return simd_run_avx2(k);
+        case simd_level::sse2:   return simd_run_sse2(k);
+#endif
+        default:                 return k.run(simd_bytes<0>());
+    }
+}
+
+template <typename T>
+constexpr bool is_simd_type() {
+    return std::is_same<T, float>::value || std::is_same<T, double>::value ||
+           std::is_same<T, int32_t>::value || std::is_same<T, int64_t>::value;
+}
+
+// The kernels work on float, double, int32_t and int64_t. Floating-point
+// sums are added up in a different order from a plain loop, so they can
+// differ from its result in the last bits.
+
+template <typename T>
+simd_sum_type<T> simd_sum(const T *p, size_t n) {
+    static_assert(is_simd_type<T>(), "simd_sum takes float, double, int32_t or int64_t values");
+    return simd_run(simd_sum_kernel<T>{p, n});
+}
+
+// n must be at least 1.
+template <typename T>
+T simd_min(const T *p, size_t n) {
+    static_assert(is_simd_type<T>(), "simd_min takes float, double, int32_t or int64_t values");
+    assert(n > 0);
+    return simd_run(simd_extreme_kernel<T, false>{p, n});
+}
+
+template <typename T>
+T simd_max(const T *p, size_t n) {
+    static_assert(is_simd_type<T>(), "simd_max takes float, double, int32_t or int64_t values");
+    assert(n > 0);
+    return simd_run(simd_extreme_kernel<T, true>{p, n});
+}
+
+template <typename T>
+simd_moments simd_moments_of(const T *p, size_t n) {
+    static_assert(is_simd_type<T>(), "simd_moments_of takes float, double, int32_t or int64_t values");
+    return simd_run(simd_moments_kernel<T>{p, n});
+}
+
+// How many of the values compare to x as c says, e.g. greater for p[i] > x.
+template <typename T>
+size_t simd_count(const T *p, size_t n, simd_compare c, T x) {
+    static_assert(is_simd_type<T>(), "simd_count takes float, double, int32_t or int64_t values");
+    switch (c) {
+        case simd_compare::less:          return simd_run(simd_count_kernel<T, simd_compare::less>{p, n, x});
+        case simd_compare::less_equal:    return simd_run(simd_count_kernel<T, simd_compare::less_equal>{p, n, x});
+        case simd_compare::greater:       return simd_run(simd_count_kernel<T, simd_compare::greater>{p, n, x});
+        case simd_compare::greater_equal: return simd_run(simd_count_kernel<T, simd_compare::greater_equal>{p, n, x});
+        case simd_compare::equal:         return simd_run(simd_count_kernel<T, simd_compare::equal>{p, n, x});
+        case simd_compare::not_equal:     return simd_run(simd_count_kernel<T, simd_compare::not_equal>{p, n, x});
+    }
+    return 0;
+}
+
+// Sets out[i] to op(p[i], x), e.g. p[i] * x. out may be p.
+template <typename T>
+void simd_apply(const T *p, T *out, size_t n, simd_op op, T x) {
+    static_assert(is_simd_type<T>(), "simd_apply takes float, double, int32_t or int64_t values");
+    switch (op) {
+        case simd_op::add:      return simd_run(simd_apply_kernel<T, simd_op::add>{p, out, n, x});
+        case simd_op::subtract: return simd_run(simd_apply_kernel<T, simd_op::subtract>{p, out, n, x});
+        case simd_op::multiply: return simd_run(simd_apply_kernel<T, simd_op::multiply>{p, out, n, x});
+        case simd_op::divide:   return simd_run(simd_apply_kernel<T, simd_op::divide>{p, out, n, x});
+        case simd_op::min:      return simd_run(simd_apply_kernel<T, simd_op::min>{p, out, n, x});
+        case simd_op::max:      return simd_run(simd_apply_kernel<T, simd_op::max>{p, out, n, x});
+    }
+}
+
+// The operators below take observables of batches, or of anything else
+// with contiguous data() and size(), such as vectors.
+template <typename Batch>
+using batch_value_t = std::decay_t<decltype(*std::declval<const Batch &>().data())>;
+
+// Reductions send their result when the source completes. Like buffer,
+// they give the source an unbounded subscription that's disposed along with
+// the subscriber's.
+template <typename T, typename E, typename Observer, typename Reducer>
+struct batch_reduce_observer : forwarding_observer<T, E, Observer> {
+    std::shared_ptr<Reducer> r;
+    subscription sub;
+    batch_reduce_observer(Observer s_, std::shared_ptr<Reducer> r_, subscription sub_)
+        : forwarding_observer<T, E, Observer>(std::move(s_)), r(std::move(r_)), sub(std::move(sub_)) {}
+
+    inline subscription get_subscription() const { return sub; }
+    inline bool is_disposed() const { return sub.is_disposed(); }
+    inline void request(size_t) const {}
+    inline void send_next(const T &xs) const { r->add(xs.data(), xs.size()); }
+    inline void send_completed() const {
+        r->finish(this->s);
+        this->s.send_completed();
+    }
+};
+
+template <typename Reducer, typename Observable>
+auto reduce_batches(const char *name, const Observable &o, Reducer r) {
+    using T = typename Observable::value_type;
+    using E = typename Observable::error_type;
+    return make_operator<typename Reducer::result_type, E>(name, [o, r](auto s){
+        subscription sub = s.get_subscription().child();
+        o.subscribe(batch_reduce_observer<T, E, decltype(s), Reducer>{
+            std::move(s), make_state<Reducer>(sub, r), sub});
+    });
+}
+
+template <typename T>
+struct sum_reducer {
+    using result_type = simd_sum_type<T>;
+    result_type total = 0;
+
+    void add(const T *p, size_t n) { total += simd_sum(p, n); }
+    template <typename Observer>
+    void finish(const Observer &s) const { s.send_next(total); }
+};
+
+template <typename T, bool Max>
+struct extreme_reducer {
+    using result_type = T;
+    T value = T();
+    bool any = false;
+
+    void add(const T *p, size_t n) {
+        if (n == 0) {
+            return;
+        }
+        T x = Max ? simd_max(p, n) : simd_min(p, n);
+        if (any) {
+            simd_extreme_kernel<T, Max>::pick(value, x);
+        } else {
+            value = x;
+            any = true;
+        }
+    }
+    template <typename Observer>
+    void finish(const Observer &s) const {
+        if (any) {
+            s.send_next(value);
+        }
+    }
+};
+
+template <typename T, bool Variance>
+struct moments_reducer {
+    using result_type = double;
+    simd_moments m;
+
+    void add(const T *p, size_t n) { m.merge(simd_moments_of(p, n)); }
+    template <typename Observer>
+    void finish(const Observer &s) const {
+        if (m.count) {
+            s.send_next(Variance ? m.variance() : m.mean);
+        }
+    }
+};
+
+template <typename T>
+struct count_reducer {
+    using result_type = size_t;
+    simd_compare c;
+    T x;
+    size_t total = 0;
+
+    void add(const T *p, size_t n) { total += simd_count(p, n, c, x); }
+    template <typename Observer>
+    void finish(const Observer &s) const { s.send_next(total); }
+};
+
+// Sends the sum of all the values when the source completes, or 0 if there
+// were none.
+template <typename Observable>
+auto sum(const Observable &o) {
+    return reduce_batches("sum", o, sum_reducer<batch_value_t<typename Observable::value_type>>());
+}
+
+// Send the smallest or largest value when the source completes, if there
+// were any.
+template <typename Observable>
+auto min(const Observable &o) {
+    return reduce_batches("min", o, extreme_reducer<batch_value_t<typename Observable::value_type>, false>());
+}
+
+template <typename Observable>
+auto max(const Observable &o) {
+    return reduce_batches("max", o, extreme_reducer<batch_value_t<typename Observable::value_type>, true>());
+}
+
+// Send the mean or population variance of the values as a double when the
+// source completes, if there were any.
+template <typename Observable>
+auto mean(const Observable &o) {
+    return reduce_batches("mean", o, moments_reducer<batch_value_t<typename Observable::value_type>, false>());
+}
+
+template <typename Observable>
+auto variance(const Observable &o) {
+    return reduce_batches("variance", o, moments_reducer<batch_value_t<typename Observable::value_type>, true>());
+}
+
+// Sends how many values compared to x as c says when the source completes.
+template <typename Observable>
+auto count_if(const Observable &o, simd_compare c, batch_value_t<typename Observable::value_type> x) {
+    using T = batch_value_t<typename Observable::value_type>;
+    return reduce_batches("count_if", o, count_reducer<T>{c, x});
+}
+
+// Sends a batch of results for each batch, filling it with f(data, out, n).
+// The batches come from a pool for each subscription.
+template <typename T, typename E, typename Observer, typename U, typename F>
+struct map_batch_observer : forwarding_observer<T, E, Observer> {
+    batch_pool<U> pool;
+    F f;
+    map_batch_observer(Observer s_, batch_pool<U> pool_, F f_)
+        : forwarding_observer<T, E, Observer>(std::move(s_)), pool(std::move(pool_)), f(std::move(f_)) {}
+
+    inline void send_next(const T &xs) const {
+        batch<U> out = pool.make();
+        out.resize(xs.size());
+        f(xs.data(), out.mutable_data(), xs.size());
+        this->s.send_next(std::move(out));
+    }
+    inline void send_next(T &&xs) const { send_next(static_cast<const T &>(xs)); }
+};
+
+template <typename U, typename Observable, typename F>
+auto make_map_batch(const Observable &o, F f) {
+    using T = typename Observable::value_type;
+    using E = typename Observable::error_type;
+    return make_operator<batch<U>, E>("map_batch", [o, f](auto s){
+        o.subscribe(map_batch_observer<T, E, decltype(s), U, F>{std::move(s), batch_pool<U>(0), f});
+    });
+}
+
+// Sends a batch of op(x_i, x) for each batch, e.g. each value times x with
+// simd_op::multiply.
+template <typename Observable>
+auto map_batch(const Observable &o, simd_op op, batch_value_t<typename Observable::value_type> x) {
+    using T = batch_value_t<typename Observable::value_type>;
+    return make_map_batch<T>(o, [op, x](const T *p, T *out, size_t n){
+        simd_apply(p, out, n, op, x);
+    });
+}
+
+// Sends a batch of f(x_i) for each batch. f is called for each value, so
+// it's only vectorized as far as the compiler manages to.
+template <typename Observable, typename F>
+auto map_batch(const Observable &o, F f) {
+    using T = batch_value_t<typename Observable::value_type>;
+    using U = std::decay_t<decltype(f(std::declval<const T &>()))>;
+    return make_map_batch<U>(o, [f](const T *p, U *out, size_t n){
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = f(p[i]);
+        }
+    });
+}
+
+}
+}
@@ -1,16 +1,126 @@
 #include "rx.h"
+#include "rx_combine.h"
+#include "rx_coro.h"
+#include "rx_group_by.h"
+#include "rx_io.h"
+#include "rx_ring.h"
+#include "rx_schedulers.h"
+#include "rx_simd.h"
+#include "rx_throttle_progress.h"
+#include "rx_timer.h"
+#include "rx_virtual_time.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <set>
+#include <stdexcept>
+#include <thread>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <string>
+#include <sys/socket.h>
 
 namespace rx = windberry::rx;
 
+static int failures = 0;
+
 static void assert_eq(int a, int b) {
     fprintf(stderr, "%d %s %d\n", a, a == b ? "==" : "!=", b);
+    failures += a != b;
 }
 
 static void assert_true(bool p, const char *desc) {
     fprintf(stderr, "%s: %s\n", desc, p ? "true" : "false");
+    failures += !p;
+}
+
+static std::atomic<size_t> allocation_count{0};
+
+// Out of line, so GCC doesn't take free in an inlined delete for a
+// mismatched deallocation.
+__attribute__((noinline)) void *operator new(size_t size) {
+    ++allocation_count;
+    if (void *p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+// Waits up to a second for p to become true.
+template <typename P>
+static bool wait_for(P p) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (!p()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+// The threads this process has running, from /proc.
+static int thread_count() {
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return -1;
+    }
+    char line[256];
+    int n = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "Threads: %d", &n) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+static auto count_to(int n) {
+    return rx::make_observable<int>([n](auto s){
+        for (int i = 1; i <= n && !s.is_disposed(); ++i) {
+            s.send_next(i);
+        }
+        s.send_completed();
+    });
+}
+
+// Counts up until disposed, recording how many values it sent.
+static auto count_forever(std::atomic<int> &sent) {
+    return rx::make_observable<int>([&sent](auto s){
+        while (!s.is_disposed()) {
+            s.send_next(++sent);
+        }
+    });
+}
+
+// Counts from 1 to n, one value per request.
+static auto flow_to(int n, std::atomic<int> &sent) {
+    return rx::make_flowable<int>(1, [n, &sent](int &i, auto &s){
+        if (i > n) {
+            s.send_completed();
+            return false;
+        }
+        ++sent;
+        s.send_next(i++);
+        return true;
+    });
 }
 
 static void testMap(void) {
@@ -89,9 +199,2370 @@ static void testCatchTo(void) {
     assert_true(ok, "testCatchTo");
 }
 
+static void testFilterScan(void) {
+    int sum = 0;
+    int count = 0;
+
+    count_to(10)
+    .filter([](int x){
+        return x % 2 == 0;
+    })
+    .scan(0, [](int acc, int x){
+        return acc + x;
+    })
+    .subscribe([&](int x){
+        sum = x;
+        ++count;
+    });
+
+    assert_eq(count, 5);
+    assert_eq(sum, 2 + 4 + 6 + 8 + 10);
+}
+
+static void testTakeSkip(void) {
+    int first = 0;
+    int last = 0;
+    int completed_count = 0;
+
+    auto o = count_to(10).skip(2).take(3);
+    for (int i = 0; i < 2; ++i) {
+        first = 0;
+        o.subscribe([&](int x){
+            if (!first) first = x;
+            last = x;
+        }, [](rx::default_error_type){}, [&]{
+            ++completed_count;
+        });
+        assert_eq(first, 3);
+        assert_eq(last, 5);
+    }
+    assert_eq(completed_count, 2);
+
+    bool got_value = false;
+    completed_count = 0;
+    count_to(3).take(0).subscribe([&](int){
+        got_value = true;
+    }, [](rx::default_error_type){}, [&]{
+        ++completed_count;
+    });
+    assert_true(!got_value, "testTakeSkip take(0)");
+    assert_eq(completed_count, 1);
+}
+
+static void testDistinctUntilChanged(void) {
+    int count = 0;
+    int sum = 0;
+
+    rx::make_observable<int>([](auto s){
+        for (int x : {1, 1, 2, 2, 2, 3, 1, 1}) {
+            s.send_next(x);
+        }
+        s.send_completed();
+    })
+    .distinct_until_changed()
+    .subscribe([&](int x){
+        ++count;
+        sum += x;
+    });
+
+    assert_eq(count, 4);
+    assert_eq(sum, 1 + 2 + 3 + 1);
+}
+
+static void testThrottleProgress(void) {
+    float now = 0;
+    int count = 0;
+
+    rx::throttle_progress([&now]{ return now; }, rx::make_observable<float>([&now](auto s){
+        for (int i = 1; i <= 100; ++i) {
+            now += 0.004f;
+            s.send_next(i / 100.0f);
+        }
+    })).subscribe([&count](float){
+        ++count;
+    });
+
+    assert_eq(count, 33);
+}
+
+// Counts the blocks it hands out that haven't come back.
+struct counting_blocks : rx::block_allocator {
+    rx::block_pool pool{rx::default_arena_block_size};
+    std::atomic<int> live{0};
+    void *allocate(size_t size) override {
+        ++live;
+        return pool.allocate(size);
+    }
+    void deallocate(void *p, size_t size) override {
+        --live;
+        pool.deallocate(p, size);
+    }
+};
+
+static void testArena(void) {
+    counting_blocks blocks;
+    rx::replay_subject<int> subject;
+    for (int i = 1; i <= 3; ++i) {
+        subject.send_next(i);
+    }
+    int sum = 0;
+    // Erased, stateful, and with observers too big to store inline.
+    auto pipeline = [&]{
+        std::array<char, 64> padding{};
+        subject.map([](int x){ return x * 2; })
+        .scan(0, [](int acc, int x){ return acc + x; })
+        .distinct_until_changed()
+        .take(3)
+        .any()
+        .subscribe(rx::with_subscription(rx::make_observer([&sum, padding](int x){
+            sum += x + padding[0];
+        }), rx::subscription::with_arena(&blocks)));
+    };
+
+    pipeline();
+    assert_eq(sum, 2 + 6 + 12);
+    assert_eq(blocks.live, 0);
+
+    // Once the pool has a block to reuse, the chain's state doesn't allocate.
+    size_t before = allocation_count;
+    for (int i = 0; i < 100; ++i) {
+        pipeline();
+    }
+#ifndef RX_TRACE
+    assert_eq(allocation_count - before, 0);
+#else
+    // Stage names make the erased generator too big to store inline.
+    assert_eq(allocation_count - before, 100);
+#endif
+    assert_eq(blocks.live, 0);
+
+    // State outlives the subscription's handle while something holds it,
+    // and the blocks go back together afterwards.
+    rx::publish_subject<int> live_subject;
+    std::vector<int> got;
+    {
+        auto sub = live_subject.skip(1).bind([](int x){ return rx::pure_observable(x); })
+            .subscribe(rx::with_subscription(rx::make_observer([&got](int x){ got.push_back(x); }),
+                                             rx::subscription::with_arena(&blocks)));
+        assert_true(blocks.live > 0, "testArena blocks in use");
+        live_subject.send_next(1);
+        live_subject.send_next(2);
+        sub.dispose();
+    }
+    live_subject.send_next(3);
+    assert_true(got == std::vector<int>({2}), "testArena values");
+    assert_eq(blocks.live, 0);
+
+    // State bigger than a block gets a block of its own.
+    {
+        auto sub = rx::subscription::with_arena(&blocks, 128);
+        auto big = rx::make_state<std::array<char, 4096>>(sub);
+        auto small = rx::make_state<int>(sub, 7);
+        assert_eq(*small, 7);
+        assert_true(blocks.live >= 2, "testArena big state");
+    }
+    assert_eq(blocks.live, 0);
+}
+
+static void testAnyObservable(void) {
+    int sum = 0;
+    auto o = count_to(4).map([](int x){ return x * 2; }).any();
+
+    // The subscription's state is the only allocation.
+    size_t before = allocation_count;
+    o.subscribe([&sum](int x){ sum += x; });
+    assert_eq(allocation_count - before, 1);
+    assert_eq(sum, 2 + 4 + 6 + 8);
+
+    // Copies of an erased observable keep their generator inline too.
+    before = allocation_count;
+    auto o2 = o;
+    assert_eq(allocation_count - before, 0);
+
+    // Observers too large for the inline buffer fall back to the heap.
+    char big[128] = {1};
+    sum = 0;
+    before = allocation_count;
+    o2.subscribe([&sum, big](int x){ sum += x * big[0]; });
+    assert_eq(allocation_count - before, 2);
+    assert_eq(sum, 2 + 4 + 6 + 8);
+
+    // Subscribers are shared when an operator needs to copy them.
+    sum = 0;
+    count_to(3)
+    .bind([](int x){ return count_to(x); })
+    .deliver_with([](auto f){ f(); })
+    .subscribe_with([](auto f){ f(); })
+    .any()
+    .subscribe([&sum](int x){ sum += x; });
+    assert_eq(sum, 1 + (1 + 2) + (1 + 2 + 3));
+}
+
+struct copy_counter {
+    static int copies;
+    int value;
+
+    explicit copy_counter(int x) : value(x) {}
+    copy_counter(copy_counter &&) = default;
+    copy_counter &operator=(copy_counter &&) = default;
+    copy_counter(const copy_counter &other) : value(other.value) { ++copies; }
+    copy_counter &operator=(const copy_counter &other) {
+        value = other.value;
+        ++copies;
+        return *this;
+    }
+    bool operator==(const copy_counter &other) const { return value == other.value; }
+};
+
+int copy_counter::copies = 0;
+
+static void testMoveOnlyPropagation(void) {
+    int sum = 0;
+    auto source = rx::make_observable<copy_counter>([](auto s){
+        for (int i = 1; i <= 4; ++i) {
+            s.send_next(copy_counter{i});
+        }
+        s.send_completed();
+    });
+
+    copy_counter::copies = 0;
+    source
+    .map([](copy_counter x){ x.value *= 2; return x; })
+    .filter([](const copy_counter &x){ return x.value != 4; })
+    .skip(1)
+    .take(2)
+    .bind([](copy_counter x){ return rx::pure_observable(std::move(x)); })
+    .deliver_with([](auto f){ f(); })
+    .any()
+    .subscribe([&sum](copy_counter x){ sum += x.value; });
+    assert_eq(sum, 6 + 8);
+    // pure_observable has to copy, since it can be subscribed more than once.
+    assert_eq(copy_counter::copies, 2);
+
+    // Fan-out points keep one copy and hand out references.
+    copy_counter::copies = 0;
+    sum = 0;
+    rx::replay_subject<copy_counter> subject;
+    subject.send_next(copy_counter{1});
+    for (int i = 0; i < 3; ++i) {
+        subject.subscribe(rx::make_observer([&sum](const copy_counter &x){
+            sum += x.value;
+        }));
+    }
+    subject.send_next(copy_counter{2});
+    assert_eq(sum, 3 * (1 + 2));
+    assert_eq(copy_counter::copies, 0);
+
+    // distinct_until_changed keeps a copy of the last value to compare with.
+    copy_counter::copies = 0;
+    source.distinct_until_changed().subscribe([](copy_counter){});
+    assert_eq(copy_counter::copies, 4);
+}
+
+static void testImmediateScheduler(void) {
+    int sum = 0;
+    count_to(3)
+    .subscribe_on(rx::immediate_scheduler{})
+    .deliver_on(rx::immediate_scheduler{})
+    .subscribe([&sum](int x){ sum += x; });
+    assert_eq(sum, 6);
+}
+
+static void testEventLoop(void) {
+    std::atomic<int> last{0};
+    std::atomic<bool> in_order{true};
+    std::atomic<bool> on_loop{true};
+    std::atomic<bool> done{false};
+    {
+        rx::event_loop loop;
+        count_to(1000)
+        .deliver_on(&loop)
+        .subscribe([&](int x){
+            in_order = in_order && x == last + 1;
+            on_loop = on_loop && loop.is_current();
+            last = x;
+        }, [](rx::default_error_type){}, [&]{
+            done = true;
+        });
+    }
+    assert_true(done, "testEventLoop completed");
+    assert_true(in_order, "testEventLoop in order");
+    assert_true(on_loop, "testEventLoop on loop thread");
+    assert_eq(last, 1000);
+}
+
+static void testThreadPool(void) {
+    rx::thread_pool pool(4);
+
+    // Each subscription gets its own serial queue, so its values arrive in
+    // order even though the pool runs them on several threads.
+    const int subscriptions = 8;
+    std::atomic<int> completed{0};
+    std::atomic<bool> in_order{true};
+    std::atomic<bool> on_pool{true};
+    std::vector<std::unique_ptr<std::atomic<int>>> lasts;
+    for (int i = 0; i < subscriptions; ++i) {
+        lasts.emplace_back(new std::atomic<int>(0));
+    }
+    for (int i = 0; i < subscriptions; ++i) {
+        auto &last = *lasts[i];
+        count_to(2000)
+        .subscribe_on(&pool)
+        .deliver_on(&pool)
+        .subscribe([&](int x){
+            in_order = in_order && x == last + 1;
+            on_pool = on_pool && pool.is_current();
+            last = x;
+        }, [](rx::default_error_type){}, [&]{
+            ++completed;
+        });
+    }
+    assert_true(wait_for([&]{ return completed == subscriptions; }), "testThreadPool completed");
+    assert_true(in_order, "testThreadPool in order");
+    assert_true(on_pool, "testThreadPool on pool");
+
+    // Tasks posted from one worker get stolen by the others.
+    std::atomic<int> ran{0};
+    std::mutex threads_m;
+    std::vector<std::thread::id> threads;
+    pool.post([&]{
+        for (int i = 0; i < 1000; ++i) {
+            pool.post([&]{
+                {
+                    std::lock_guard<std::mutex> lock(threads_m);
+                    if (std::find(threads.begin(), threads.end(), std::this_thread::get_id()) == threads.end()) {
+                        threads.push_back(std::this_thread::get_id());
+                    }
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(10));
+                ++ran;
+            });
+        }
+    });
+    assert_true(wait_for([&]{ return ran == 1000; }), "testThreadPool ran posted tasks");
+    std::lock_guard<std::mutex> lock(threads_m);
+    assert_true(threads.size() > 1, "testThreadPool stole tasks");
+}
+
+static void testBatchedDelivery(void) {
+    // A queue run by hand, so the number of scheduled drains can be checked.
+    std::vector<std::function<void()>> queue;
+    auto manual = [&queue](auto f){ queue.push_back(f); };
+
+    std::vector<int> got;
+    bool completed = false;
+    count_to(10)
+    .deliver_with(manual, 4)
+    .subscribe([&](int x){
+        got.push_back(x);
+    }, [](rx::default_error_type){}, [&]{
+        completed = true;
+        got.push_back(-1);
+    });
+    assert_eq(queue.size(), 1);
+    int drains = 0;
+    while (!queue.empty()) {
+        auto f = queue.front();
+        queue.erase(queue.begin());
+        f();
+        ++drains;
+    }
+    // Ten values and the completion, four at a time.
+    assert_eq(drains, 3);
+    assert_true(completed, "testBatchedDelivery completed");
+    assert_eq(got.size(), 11);
+    bool in_order = true;
+    for (int i = 0; i < 10; ++i) {
+        in_order = in_order && got[i] == i + 1;
+    }
+    assert_true(in_order && got.back() == -1, "testBatchedDelivery in order");
+
+    // Errors are delivered after the values sent before them.
+    got.clear();
+    bool errored = false;
+    rx::make_observable<int, const char *>([](auto s){
+        s.send_next(1);
+        s.send_next(2);
+        s.send_error("boom");
+    })
+    .deliver_with(manual, 64)
+    .subscribe([&](int x){
+        got.push_back(x);
+    }, [&](const char *){
+        errored = got.size() == 2;
+    });
+    while (!queue.empty()) {
+        auto f = queue.front();
+        queue.erase(queue.begin());
+        f();
+    }
+    assert_true(errored, "testBatchedDelivery error after values");
+
+    std::atomic<int> last{0};
+    std::atomic<bool> loop_in_order{true};
+    {
+        rx::event_loop loop;
+        count_to(10000)
+        .deliver_on(&loop, 128)
+        .subscribe([&](int x){
+            loop_in_order = loop_in_order && x == last + 1;
+            last = x;
+        });
+    }
+    assert_eq(last, 10000);
+    assert_true(loop_in_order, "testBatchedDelivery event loop in order");
+}
+
+struct ring_result {
+    std::atomic<int> count{0};
+    std::atomic<int> last{0};
+    std::atomic<bool> in_order{true};
+    std::atomic<bool> completed{false};
+    std::atomic<bool> errored{false};
+    std::atomic<bool> done{false};
+
+    template <typename Observable>
+    void subscribe(const Observable &o, bool slow = false) {
+        o.subscribe([this, slow](int x){
+            in_order = in_order && x > last;
+            last = x;
+            ++count;
+            if (slow) {
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+            }
+        }, [this](rx::default_error_type){
+            errored = true;
+            done = true;
+        }, [this]{
+            completed = true;
+            done = true;
+        });
+        wait_for([this]{ return done.load(); });
+    }
+};
+
+static void testRing(void) {
+    const int n = 100000;
+    {
+        ring_result r;
+        r.subscribe(rx::observe_via_ring(count_to(n), 8));
+        assert_true(r.completed, "testRing block completed");
+        assert_eq(r.count, n);
+        assert_true(r.in_order, "testRing block in order");
+    }
+    // A producer blocked on a slow consumer parks, rather than spinning, on
+    // the thread that subscribed. Spinning would take about all the time.
+    {
+        ring_result r;
+        timespec cpu0, cpu1;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+        auto start = std::chrono::steady_clock::now();
+        rx::observe_via_ring(count_to(500), 4).subscribe([&r](int x){
+            r.last = x;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        });
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+        double cpu = double(cpu1.tv_sec - cpu0.tv_sec) + double(cpu1.tv_nsec - cpu0.tv_nsec) / 1e9;
+        assert_true(cpu < wall / 2, "testRing blocked producer parks");
+        assert_true(wait_for([&r]{ return r.last == 500; }), "testRing blocked producer delivered");
+    }
+    {
+        ring_result r;
+        r.subscribe(rx::observe_via_ring(count_to(2000), 4, rx::overflow_policy::drop_newest), true);
+        assert_true(r.completed, "testRing drop_newest completed");
+        assert_true(r.count < 2000, "testRing drop_newest dropped");
+        assert_true(r.in_order, "testRing drop_newest in order");
+    }
+    {
+        ring_result r;
+        r.subscribe(rx::observe_via_ring(count_to(2000), 4, rx::overflow_policy::drop_oldest), true);
+        assert_true(r.completed, "testRing drop_oldest completed");
+        assert_true(r.count < 2000, "testRing drop_oldest dropped");
+        assert_true(r.in_order, "testRing drop_oldest in order");
+        assert_eq(r.last, 2000);
+    }
+    {
+        ring_result r;
+        r.subscribe(rx::observe_via_ring(count_to(2000), 4, rx::overflow_policy::error), true);
+        assert_true(r.errored, "testRing error policy errored");
+        assert_true(r.count <= 2000 && r.in_order, "testRing error policy in order");
+    }
+    {
+        const int producers = 4;
+        std::atomic<int> sum{0};
+        std::atomic<bool> completed{false};
+        rx::observe_via_ring<rx::multi_producer>(rx::make_observable<int>([](auto s){
+            std::vector<std::thread> threads;
+            for (int p = 0; p < producers; ++p) {
+                threads.emplace_back([s]{
+                    for (int i = 1; i <= 10000; ++i) {
+                        s.send_next(1);
+                    }
+                });
+            }
+            for (auto &t : threads) {
+                t.join();
+            }
+            s.send_completed();
+        }), 16).subscribe([&sum](int x){
+            sum += x;
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        });
+        assert_true(wait_for([&]{ return completed.load(); }), "testRing multi_producer completed");
+        assert_eq(sum, producers * 10000);
+    }
+    // Disposing wakes a consumer parked on an idle source, and its thread
+    // exits.
+    {
+        int before = thread_count();
+        rx::publish_subject<int> subject;
+        for (int i = 0; i < 20; ++i) {
+            rx::subscription sub;
+            rx::observe_via_ring(subject, 8).subscribe(rx::with_subscription(rx::make_observer([](int){}), sub));
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            sub.dispose();
+        }
+        assert_true(wait_for([&]{ return thread_count() == before; }), "testRing dispose ends consumers");
+    }
+}
+
+static void testCancellation(void) {
+    std::atomic<int> sent{0};
+    int sum = 0;
+    bool completed = false;
+
+    // take stops the generator once it has enough values.
+    count_forever(sent).take(5).subscribe([&sum](int x){
+        sum += x;
+    }, [](rx::default_error_type){}, [&completed]{
+        completed = true;
+    });
+    assert_eq(sent, 5);
+    assert_eq(sum, 1 + 2 + 3 + 4 + 5);
+    assert_true(completed, "testCancellation take completed");
+
+    sent = 0;
+    sum = 0;
+    completed = false;
+    count_forever(sent).take_while([](int x){ return x < 4; }).subscribe([&sum](int x){
+        sum += x;
+    }, [](rx::default_error_type){}, [&completed]{
+        completed = true;
+    });
+    assert_eq(sent, 4);
+    assert_eq(sum, 1 + 2 + 3);
+    assert_true(completed, "testCancellation take_while completed");
+
+    // Disposing from another thread stops a generator running on an event loop.
+    sent = 0;
+    {
+        rx::event_loop loop;
+        std::atomic<int> received{0};
+        auto sub = count_forever(sent).subscribe_on(&loop).subscribe([&received](int){
+            ++received;
+        });
+        assert_true(wait_for([&]{ return received > 100; }), "testCancellation running");
+        sub.dispose();
+        assert_true(sub.is_disposed(), "testCancellation disposed");
+        // A value already being sent may still arrive.
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        int after = received;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        assert_eq(received, after);
+    }
+
+    // Teardowns run once, and immediately if already disposed.
+    rx::subscription sub;
+    int teardowns = 0;
+    sub.add([&teardowns]{ ++teardowns; });
+    sub.dispose();
+    sub.dispose();
+    sub.add([&teardowns]{ ++teardowns; });
+    assert_eq(teardowns, 2);
+}
+
+static void testTakeUntil(void) {
+    rx::replay_subject<int> source;
+    rx::replay_subject<rx::unit> stop;
+    int sum = 0;
+    int completed_count = 0;
+
+    source.take_until(stop).subscribe([&sum](int x){
+        sum += x;
+    }, [](rx::default_error_type){}, [&completed_count]{
+        ++completed_count;
+    });
+    source.send_next(1);
+    source.send_next(2);
+    stop.send_next(rx::unit{});
+    source.send_next(4);
+    stop.send_next(rx::unit{});
+    assert_eq(sum, 3);
+    assert_eq(completed_count, 1);
+
+    // The notifier is unsubscribed from when the source completes.
+    std::atomic<int> sent{0};
+    completed_count = 0;
+    count_to(3).take_until(count_forever(sent).subscribe_on(rx::immediate_scheduler{}).take(0))
+    .subscribe([](int){}, [](rx::default_error_type){}, [&completed_count]{
+        ++completed_count;
+    });
+    assert_eq(completed_count, 1);
+
+    // A subscriber can trigger the notifier itself.
+    sum = 0;
+    completed_count = 0;
+    count_to(10).take_until(stop).subscribe([&sum](int x){
+        sum += x;
+    });
+    assert_eq(sum, 0);
+
+    rx::replay_subject<rx::unit> stop2;
+    count_forever(sent).take_until(stop2).subscribe([&sum, &stop2](int x){
+        sum += x;
+        if (sum > 10) {
+            stop2.send_next(rx::unit{});
+        }
+    }, [](rx::default_error_type){}, [&completed_count]{
+        ++completed_count;
+    });
+    assert_eq(completed_count, 1);
+}
+
+static void testReplaySubjectDispose(void) {
+    rx::replay_subject<int> subject;
+    int sums[3] = {0, 0, 0};
+    rx::subscription subs[3];
+    for (int i = 0; i < 3; ++i) {
+        subs[i] = subject.subscribe(rx::make_observer([&sums, i](int x){
+            sums[i] += x;
+        }));
+    }
+    subject.send_next(1);
+    subs[1].dispose();
+    subject.send_next(2);
+    subs[0].dispose();
+    subject.send_next(4);
+    assert_eq(sums[0], 1 + 2);
+    assert_eq(sums[1], 1);
+    assert_eq(sums[2], 1 + 2 + 4);
+
+    // Disposing from inside a callback while replaying. Passing the
+    // subscription in makes it available before subscribe returns.
+    int late = 0;
+    rx::subscription self;
+    subject.subscribe(rx::with_subscription(rx::make_observer([&late, &self](int x){
+        late += x;
+        if (x == 2) {
+            self.dispose();
+        }
+    }), self));
+    subject.send_next(8);
+    assert_eq(late, 1 + 2);
+    assert_eq(sums[2], 1 + 2 + 4 + 8);
+}
+
+static void testBackpressure(void) {
+    std::atomic<int> sent{0};
+    int sum = 0;
+    int received = 0;
+    bool completed = false;
+
+    // Unbounded subscribers get everything straight away.
+    flow_to(5, sent).subscribe([&sum](int x){
+        sum += x;
+    }, [](rx::default_error_type){}, [&completed]{
+        completed = true;
+    });
+    assert_eq(sum, 15);
+    assert_true(completed, "testBackpressure unbounded completed");
+
+    // Bounded subscribers get what they've requested.
+    sent = 0;
+    sum = 0;
+    completed = false;
+    rx::subscription sub(2);
+    flow_to(10, sent).subscribe(rx::with_subscription(rx::make_observer([&sum](int x){
+        sum += x;
+    }, [](rx::default_error_type){}, [&completed]{
+        completed = true;
+    }), sub));
+    assert_eq(sent, 2);
+    assert_eq(sum, 1 + 2);
+    sub.request(3);
+    assert_eq(sent, 5);
+    assert_eq(sum, 15);
+    sub.request(100);
+    assert_eq(sum, 55);
+    assert_true(completed, "testBackpressure bounded completed");
+
+    // Values dropped by filter are requested again.
+    sent = 0;
+    received = 0;
+    rx::subscription filtered(3);
+    flow_to(100, sent).filter([](int x){ return x % 4 == 0; })
+    .subscribe(rx::with_subscription(rx::make_observer([&received](int){
+        ++received;
+    }), filtered));
+    assert_eq(received, 3);
+    assert_eq(sent, 12);
+    // Releases the generator waiting for more requests.
+    filtered.dispose();
+
+    // Requesting from inside the subscriber doesn't recurse.
+    sum = 0;
+    rx::subscription one(1);
+    flow_to(100000, sent).subscribe(rx::with_subscription(rx::make_observer([&sum, &one](int){
+        ++sum;
+        one.request(1);
+    }), one));
+    assert_eq(sum, 100000);
+
+    // Values in flight to an event loop are limited by the subscriber's demand.
+    {
+        rx::event_loop loop;
+        sent = 0;
+        std::atomic<int> delivered{0};
+        std::atomic<int> max_in_flight{0};
+        rx::subscription batch(16);
+        flow_to(10000, sent).deliver_on(&loop, 4)
+        .subscribe(rx::with_subscription(rx::make_observer([&](int){
+            int in_flight = sent - delivered;
+            if (in_flight > max_in_flight) {
+                max_in_flight = in_flight;
+            }
+            ++delivered;
+            batch.request(1);
+        }), batch));
+        assert_true(wait_for([&]{ return delivered == 10000; }), "testBackpressure deliver_on delivered");
+        assert_true(max_in_flight <= 16, "testBackpressure deliver_on bounded");
+    }
+
+    // A flowable source never overflows a ring.
+    {
+        std::atomic<int> ring_sum{0};
+        std::atomic<bool> errored{false};
+        std::atomic<bool> done{false};
+        sent = 0;
+        rx::observe_via_ring(flow_to(10000, sent), 8, rx::overflow_policy::error)
+        .subscribe([&ring_sum](int x){
+            ring_sum += x;
+        }, [&errored](rx::default_error_type){
+            errored = true;
+        }, [&done]{
+            done = true;
+        });
+        assert_true(wait_for([&]{ return done || errored; }), "testBackpressure ring finished");
+        assert_true(!errored, "testBackpressure ring didn't overflow");
+        assert_eq(ring_sum, 10000 * 10001 / 2);
+    }
+
+    // The ring's consumer only sends values the subscriber requested.
+    {
+        std::atomic<int> ring_received{0};
+        rx::subscription ring_sub(10);
+        sent = 0;
+        rx::observe_via_ring(flow_to(1000, sent), 64)
+        .subscribe(rx::with_subscription(rx::make_observer([&ring_received](int){
+            ++ring_received;
+        }), ring_sub));
+        assert_true(wait_for([&]{ return ring_received == 10; }), "testBackpressure ring requested");
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        assert_eq(ring_received, 10);
+        assert_true(sent <= 10 + 64, "testBackpressure ring source bounded");
+        ring_sub.request(990);
+        assert_true(wait_for([&]{ return ring_received == 1000; }), "testBackpressure ring rest");
+    }
+}
+
+// Subscribes to a subject, collecting the values it replays.
+template <typename Subject>
+static std::vector<int> replayed(const Subject &subject, bool *completed = nullptr) {
+    std::vector<int> xs;
+    subject.subscribe(rx::make_observer([&xs](int x){
+        xs.push_back(x);
+    }, [](rx::default_error_type){}, [completed]{
+        if (completed) *completed = true;
+    })).dispose();
+    return xs;
+}
+
+static void testReplayLimits(void) {
+    rx::replay_subject<int> by_count(rx::replay_limits().count(3));
+    int live = 0;
+    by_count.subscribe(rx::make_observer([&live](int){ ++live; }));
+    for (int i = 1; i <= 5; ++i) {
+        by_count.send_next(i);
+    }
+    assert_eq(live, 5);
+    assert_true(replayed(by_count) == std::vector<int>({3, 4, 5}), "testReplayLimits count");
+
+    rx::replay_subject<int> by_bytes(rx::replay_limits().bytes(2 * sizeof(int)));
+    for (int i = 1; i <= 5; ++i) {
+        by_bytes.send_next(i);
+    }
+    assert_true(replayed(by_bytes) == std::vector<int>({4, 5}), "testReplayLimits bytes");
+
+    rx::replay_subject<int> nothing(rx::replay_limits().count(0));
+    nothing.send_next(1);
+    assert_true(replayed(nothing).empty(), "testReplayLimits count(0)");
+
+    rx::replay_subject<int> by_age(rx::replay_limits().age(std::chrono::milliseconds(20)));
+    by_age.send_next(1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    by_age.send_next(2);
+    assert_true(replayed(by_age) == std::vector<int>({2}), "testReplayLimits age");
+
+    // The terminal event is kept regardless of the limits, after the values.
+    bool completed = false;
+    by_count.send_completed();
+    assert_true(replayed(by_count, &completed) == std::vector<int>({3, 4, 5}), "testReplayLimits values before completion");
+    assert_true(completed, "testReplayLimits completion");
+
+    // Growing the ring keeps the values in order.
+    rx::replay_subject<int> unbounded;
+    for (int i = 0; i < 100; ++i) {
+        unbounded.send_next(i);
+    }
+    auto xs = replayed(unbounded);
+    assert_eq(xs.size(), 100);
+    assert_true(std::is_sorted(xs.begin(), xs.end()), "testReplayLimits unbounded in order");
+
+    // Values wrap around the end of the ring.
+    rx::replay_subject<int> wrapped(rx::replay_limits().count(6));
+    for (int i = 1; i <= 20; ++i) {
+        wrapped.send_next(i);
+    }
+    assert_true(replayed(wrapped) == std::vector<int>({15, 16, 17, 18, 19, 20}), "testReplayLimits wrapped");
+}
+
+static void testPublishSubject(void) {
+    rx::publish_subject<int> subject;
+    int sums[3] = {0, 0, 0};
+    rx::subscription subs[3];
+
+    subject.send_next(100);
+    for (int i = 0; i < 3; ++i) {
+        subs[i] = subject.subscribe(rx::make_observer([&sums, i](int x){
+            sums[i] += x;
+        }));
+    }
+    // Sending to subscribers doesn't allocate.
+    size_t before = allocation_count;
+    subject.send_next(1);
+    assert_eq(allocation_count - before, 0);
+    subs[1].dispose();
+    subject.send_next(2);
+    assert_eq(sums[0], 1 + 2);
+    assert_eq(sums[1], 1);
+    assert_eq(sums[2], 1 + 2);
+
+    // Rvalues go to the last subscriber without a copy.
+    copy_counter::copies = 0;
+    rx::publish_subject<copy_counter> counters;
+    counters.subscribe(rx::make_observer([](const copy_counter &){}));
+    counters.subscribe(rx::make_observer([](copy_counter){}));
+    counters.send_next(copy_counter{1});
+    assert_eq(copy_counter::copies, 0);
+
+    int completed_count = 0;
+    subject.subscribe(rx::make_observer([](int){}, [](rx::default_error_type){}, [&completed_count]{
+        ++completed_count;
+    }));
+    subject.send_completed();
+    subject.send_next(4);
+    subject.subscribe(rx::make_observer([](int){}, [](rx::default_error_type){}, [&completed_count]{
+        ++completed_count;
+    }));
+    assert_eq(completed_count, 2);
+    assert_eq(sums[0], 1 + 2);
+}
+
+// make test also runs this built with -fsanitize=thread, as rx_tsan_test,
+// to check the lock-free read path.
+static void testPublishSubjectStress(void) {
+    const int senders = 4;
+    const int per_sender = 20000;
+    rx::publish_subject<int> subject;
+    std::atomic<long> total{0};
+    std::atomic<bool> stop{false};
+
+    subject.subscribe(rx::make_observer([&total](int x){ total += x; }));
+
+    // Subscribers come and go while values are being sent.
+    // A value already being sent may arrive after disposal, so the counter
+    // has to outlive each subscription.
+    std::atomic<int> seen{0};
+    std::thread churn([&]{
+        while (!stop) {
+            auto sub = subject.subscribe(rx::make_observer([&seen](int){ ++seen; }));
+            std::this_thread::yield();
+            sub.dispose();
+        }
+    });
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < senders; ++t) {
+        threads.emplace_back([&subject]{
+            for (int i = 1; i <= per_sender; ++i) {
+                subject.send_next(i);
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    stop = true;
+    churn.join();
+    subject.send_completed();
+
+    assert_true(total == long(senders) * per_sender * (per_sender + 1) / 2,
+                "testPublishSubjectStress received everything");
+}
+
+static void testShare(void) {
+    int runs = 0;
+    auto counted = rx::make_observable<int>([&runs](auto s){
+        ++runs;
+        for (int i = 1; i <= 3; ++i) {
+            s.send_next(i);
+        }
+        s.send_completed();
+    });
+
+    // publish runs the generator once for everyone subscribed before connect.
+    int sums[2] = {0, 0};
+    auto published = counted.publish();
+    for (int i = 0; i < 2; ++i) {
+        published.subscribe(rx::make_observer([&sums, i](int x){ sums[i] += x; }));
+    }
+    assert_eq(runs, 0);
+    published.connect();
+    published.connect();
+    assert_eq(runs, 1);
+    assert_eq(sums[0], 6);
+    assert_eq(sums[1], 6);
+
+    // share connects on the first subscriber and disconnects after the last.
+    rx::publish_subject<int> upstream;
+    int upstream_runs = 0;
+    int teardowns = 0;
+    auto shared = rx::make_observable<int>([&, upstream](auto s){
+        ++upstream_runs;
+        s.get_subscription().add([&teardowns]{ ++teardowns; });
+        upstream.subscribe(std::move(s));
+    }).share();
+    int a = 0, b = 0;
+    auto sub_a = shared.subscribe([&a](int x){ a += x; });
+    auto sub_b = shared.subscribe([&b](int x){ b += x; });
+    upstream.send_next(5);
+    assert_eq(upstream_runs, 1);
+    assert_eq(a, 5);
+    assert_eq(b, 5);
+    sub_a.dispose();
+    upstream.send_next(1);
+    assert_eq(teardowns, 0);
+    sub_b.dispose();
+    assert_eq(teardowns, 1);
+    assert_eq(b, 6);
+    shared.subscribe([](int){}).dispose();
+    assert_eq(upstream_runs, 2);
+
+    // share_replay keeps the finished source's last values for later subscribers.
+    runs = 0;
+    auto cached = counted.share_replay(2);
+    int first = 0;
+    cached.subscribe([&first](int x){ first += x; });
+    std::vector<int> late;
+    bool completed = false;
+    cached.subscribe([&late](int x){
+        late.push_back(x);
+    }, [](rx::default_error_type){}, [&completed]{
+        completed = true;
+    });
+    assert_eq(runs, 1);
+    assert_eq(first, 6);
+    assert_true(late == std::vector<int>({2, 3}), "testShare share_replay replayed");
+    assert_true(completed, "testShare share_replay completed");
+
+    // Subscribing from another thread while the source sends on an event loop.
+    {
+        rx::event_loop loop;
+        std::atomic<int> total{0};
+        std::atomic<int> done{0};
+        auto numbers = count_to(1000).subscribe_on(&loop).share_replay(10);
+        for (int i = 0; i < 4; ++i) {
+            numbers.subscribe([&total](int x){
+                total += x;
+            }, [](rx::default_error_type){}, [&done]{
+                ++done;
+            });
+        }
+        assert_true(wait_for([&]{ return done == 4; }), "testShare threads completed");
+    }
+}
+
+static void testParallelMap(void) {
+    rx::thread_pool pool(4);
+
+    // Results come out in the order of the values, however long each takes.
+    {
+        std::vector<int> out;
+        std::atomic<bool> completed{false};
+        std::atomic<int> in_flight{0};
+        std::atomic<int> most_in_flight{0};
+        count_to(200).parallel_map([&](int x){
+            int n = ++in_flight;
+            int m = most_in_flight;
+            while (n > m && !most_in_flight.compare_exchange_weak(m, n)) {}
+            if (x % 7 == 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+            --in_flight;
+            return x * 2;
+        }, &pool, 3).subscribe([&out](int x){
+            out.push_back(x);
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        });
+        assert_true(wait_for([&]{ return completed.load(); }), "testParallelMap completed");
+        bool in_order = out.size() == 200;
+        for (size_t i = 0; in_order && i < out.size(); ++i) {
+            in_order = out[i] == int(i + 1) * 2;
+        }
+        assert_true(in_order, "testParallelMap in order");
+        assert_true(most_in_flight <= 3, "testParallelMap max_in_flight");
+    }
+
+    // Unordered results arrive as they finish.
+    {
+        std::atomic<long> total{0};
+        std::atomic<int> received{0};
+        std::atomic<bool> completed{false};
+        count_to(1000).parallel_map_unordered([](int x){
+            return long(x);
+        }, &pool, 8).subscribe([&](long x){
+            total += x;
+            ++received;
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        });
+        assert_true(wait_for([&]{ return completed.load(); }), "testParallelMap unordered completed");
+        assert_eq(received.load(), 1000);
+        assert_eq(total.load(), 1000L * 1001 / 2);
+    }
+
+    // The first error is sent, and values not yet started are skipped.
+    {
+        std::atomic<int> ran{0};
+        std::atomic<int> errors{0};
+        std::atomic<bool> completed{false};
+        count_to(10000).parallel_map([&ran](int x){
+            ++ran;
+            if (x == 5) {
+                throw std::runtime_error("five");
+            }
+            return x;
+        }, &pool, 2).subscribe([](int x){
+            assert_true(x < 5, "testParallelMap no values after error");
+        }, [&errors](rx::default_error_type){
+            ++errors;
+        }, [&completed]{
+            completed = true;
+        });
+        assert_true(wait_for([&]{ return errors == 1; }), "testParallelMap error");
+        assert_true(ran < 100, "testParallelMap cancelled after error");
+        assert_true(!completed, "testParallelMap not completed after error");
+    }
+
+    // Runs inline on the immediate scheduler.
+    {
+        std::vector<int> out;
+        count_to(5).parallel_map([](int x){ return x + 1; },
+                                 rx::immediate_scheduler{}, 2)
+        .subscribe([&out](int x){ out.push_back(x); });
+        assert_true(out == std::vector<int>({2, 3, 4, 5, 6}), "testParallelMap immediate");
+    }
+}
+
+static void testFlatMap(void) {
+    // Completes only once the source and all the inner observables have.
+    {
+        rx::publish_subject<int> a, b;
+        std::vector<int> out;
+        bool completed = false;
+        rx::merge(a, b).subscribe([&out](int x){
+            out.push_back(x);
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        });
+        a.send_next(1);
+        b.send_next(2);
+        a.send_next(3);
+        a.send_completed();
+        assert_true(!completed, "testFlatMap merge waits for every source");
+        b.send_completed();
+        assert_true(completed, "testFlatMap merge completed");
+        assert_true(out == std::vector<int>({1, 2, 3}), "testFlatMap merge values");
+    }
+
+    // concat subscribes to each observable once the one before it completes.
+    {
+        rx::publish_subject<int> a, b;
+        std::vector<int> out;
+        bool completed = false;
+        rx::concat(a, b, rx::pure_observable(9)).subscribe([&out](int x){
+            out.push_back(x);
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        });
+        b.send_next(0);
+        a.send_next(1);
+        a.send_completed();
+        b.send_next(2);
+        b.send_completed();
+        assert_true(completed, "testFlatMap concat completed");
+        assert_true(out == std::vector<int>({1, 2, 9}), "testFlatMap concat values");
+    }
+
+    // At most max_concurrent inner observables run at once.
+    {
+        std::vector<rx::publish_subject<int>> inners(5);
+        int subscribed = 0;
+        int sum = 0;
+        bool completed = false;
+        count_to(5).flat_map([&](int i){
+            ++subscribed;
+            return inners[i - 1];
+        }, 2).subscribe([&sum](int x){
+            sum += x;
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        });
+        assert_eq(subscribed, 2);
+        inners[0].send_next(10);
+        inners[0].send_completed();
+        assert_eq(subscribed, 3);
+        for (int i = 1; i < 5; ++i) {
+            inners[i].send_next(i);
+            inners[i].send_completed();
+        }
+        assert_eq(subscribed, 5);
+        assert_eq(sum, 10 + 1 + 2 + 3 + 4);
+        assert_true(completed, "testFlatMap max_concurrent completed");
+    }
+
+    // An inner error disposes the source and the other inner observables.
+    {
+        rx::publish_subject<int> outer, other;
+        rx::publish_subject<int> failing;
+        int errors = 0;
+        bool other_disposed = false;
+        auto watched = rx::make_observable<int>([other, &other_disposed](auto s){
+            s.get_subscription().add([&other_disposed]{ other_disposed = true; });
+            other.subscribe(std::move(s));
+        });
+        outer.flat_map([&](int i){
+            return i == 0 ? watched.any() : failing.any();
+        }).subscribe([](int){}, [&errors](rx::default_error_type){
+            ++errors;
+        });
+        outer.send_next(0);
+        outer.send_next(1);
+        failing.send_error(std::make_exception_ptr(std::runtime_error("inner")));
+        assert_eq(errors, 1);
+        assert_true(other_disposed, "testFlatMap error disposes inners");
+        other.send_error(std::make_exception_ptr(std::runtime_error("late")));
+        assert_eq(errors, 1);
+    }
+
+    // Inner observables sending from several threads at once are sent on one
+    // at a time.
+    {
+        rx::thread_pool pool(4);
+        std::atomic<int> busy{0};
+        std::atomic<bool> overlapped{false};
+        std::atomic<bool> completed{false};
+        long total = 0;
+        count_to(50).flat_map([&pool](int){
+            return count_to(200).subscribe_on(&pool);
+        }, 8).subscribe([&](int x){
+            if (++busy != 1) {
+                overlapped = true;
+            }
+            total += x;
+            --busy;
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        });
+        assert_true(wait_for([&]{ return completed.load(); }), "testFlatMap threads completed");
+        assert_true(!overlapped, "testFlatMap threads serialized");
+        assert_true(total == 50L * 200 * 201 / 2, "testFlatMap threads received everything");
+    }
+}
+
+static void testCombine(void) {
+    using pair = std::tuple<int, std::string>;
+
+    // zip pairs up values by position, and waits for the slower source.
+    {
+        rx::publish_subject<int> a;
+        rx::publish_subject<std::string> b;
+        std::vector<pair> out;
+        bool completed = false;
+        rx::zip(a, b).subscribe([&out](pair x){
+            out.push_back(std::move(x));
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        });
+        a.send_next(1);
+        a.send_next(2);
+        a.send_next(3);
+        assert_eq(out.size(), size_t(0));
+        b.send_next("x");
+        b.send_next("y");
+        a.send_completed();
+        assert_true(!completed, "testCombine zip waits for queued values");
+        b.send_next("z");
+        assert_true(completed, "testCombine zip completed");
+        assert_true(out == std::vector<pair>({pair(1, "x"), pair(2, "y"), pair(3, "z")}),
+                    "testCombine zip values");
+    }
+
+    // A source that gets more than capacity values ahead fails the zip.
+    {
+        rx::publish_subject<int> a, b;
+        int errors = 0;
+        rx::zip(4, a, b).subscribe([](std::tuple<int, int>){}, [&errors](rx::default_error_type){
+            ++errors;
+        });
+        for (int i = 0; i < 5; ++i) {
+            a.send_next(i);
+        }
+        assert_eq(errors, 1);
+    }
+
+    // Without a capacity, synchronous sources that ignore demand are
+    // queued, however far ahead of the others they get.
+    {
+        std::vector<std::tuple<int, int>> out;
+        int errors = 0;
+        bool completed = false;
+        rx::zip(count_to(100), count_to(100)).subscribe([&out](std::tuple<int, int> x){
+            out.push_back(x);
+        }, [&errors](rx::default_error_type){
+            ++errors;
+        }, [&completed]{
+            completed = true;
+        });
+        assert_eq(errors, 0);
+        assert_true(completed, "testCombine zip synchronous sources completed");
+        bool matched = out.size() == 100;
+        for (size_t i = 0; matched && i < out.size(); ++i) {
+            matched = out[i] == std::make_tuple(int(i) + 1, int(i) + 1);
+        }
+        assert_true(matched, "testCombine zip synchronous sources values");
+    }
+
+    // combine_latest sends whenever either source does, once both have.
+    {
+        rx::publish_subject<int> a;
+        rx::publish_subject<std::string> b;
+        std::vector<pair> out;
+        bool completed = false;
+        rx::combine_latest(a, b).subscribe([&out](pair x){
+            out.push_back(std::move(x));
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        });
+        a.send_next(1);
+        a.send_next(2);
+        b.send_next("x");
+        a.send_next(3);
+        b.send_next("y");
+        a.send_completed();
+        assert_true(!completed, "testCombine combine_latest waits for every source");
+        b.send_completed();
+        assert_true(completed, "testCombine combine_latest completed");
+        assert_true(out == std::vector<pair>({pair(2, "x"), pair(3, "x"), pair(3, "y")}),
+                    "testCombine combine_latest values");
+    }
+
+    // with_latest_from only sends when the first source does.
+    {
+        rx::publish_subject<int> a;
+        rx::publish_subject<std::string> b;
+        std::vector<pair> out;
+        bool completed = false;
+        rx::with_latest_from(a, b).subscribe([&out](pair x){
+            out.push_back(std::move(x));
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        });
+        a.send_next(1);
+        b.send_next("x");
+        b.send_next("y");
+        a.send_next(2);
+        a.send_next(3);
+        b.send_completed();
+        b.send_next("z");
+        a.send_next(4);
+        a.send_completed();
+        assert_true(completed, "testCombine with_latest_from completed");
+        assert_true(out == std::vector<pair>({pair(2, "y"), pair(3, "y"), pair(4, "y")}),
+                    "testCombine with_latest_from values");
+    }
+
+    // Flowable sources on different threads are asked for values as the
+    // zip uses them, so they never overflow it.
+    {
+        rx::event_loop loop_a, loop_b;
+        std::atomic<int> sent_a{0}, sent_b{0};
+        std::atomic<bool> completed{false};
+        std::atomic<int> received{0};
+        std::atomic<bool> matched{true};
+        rx::zip(8, flow_to(20000, sent_a).subscribe_on(&loop_a),
+                   flow_to(20000, sent_b).subscribe_on(&loop_b).map([](int x){ return long(x); }))
+        .subscribe([&](std::tuple<int, long> x){
+            if (std::get<0>(x) != std::get<1>(x) || std::get<0>(x) != received + 1) {
+                matched = false;
+            }
+            ++received;
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        });
+        assert_true(wait_for([&]{ return completed.load(); }), "testCombine threads completed");
+        assert_eq(received.load(), 20000);
+        assert_true(matched, "testCombine threads matched");
+    }
+}
+
+static void testTimers(void) {
+    using std::chrono::milliseconds;
+    using clock = rx::timer_wheel::clock;
+
+    // Timers fire in order of their deadlines, and never early.
+    {
+        rx::timer_wheel wheel(std::chrono::microseconds(1));
+        std::mutex m;
+        std::vector<int> fired;
+        std::atomic<bool> early{false};
+        auto start = wheel.now();
+        // With a 1 us tick the first three levels span 256 us, 65.5 ms and
+        // 16.8 s, so 10 to 30 ms go in the second level and 400 ms in the
+        // third, and each is moved down a level at a time before it fires.
+        for (int ms : {30, 10, 400, 20}) {
+            auto due = start + milliseconds(ms);
+            wheel.schedule_at(due, [&, ms, due]{
+                if (clock::now() < due) {
+                    early = true;
+                }
+                std::lock_guard<std::mutex> lock(m);
+                fired.push_back(ms);
+            });
+        }
+        assert_true(wait_for([&]{
+            std::lock_guard<std::mutex> lock(m);
+            return fired.size() == 4;
+        }), "testTimers fired");
+        assert_true(fired == std::vector<int>({10, 20, 30, 400}), "testTimers order");
+        assert_true(!early, "testTimers not early");
+    }
+
+    // The operators, on virtual time.
+    rx::virtual_scheduler vs;
+    auto at = [&vs](int ms, std::function<void()> f){
+        vs.schedule_at(clock::time_point() + milliseconds(ms), std::move(f));
+    };
+    using timed = std::vector<std::pair<clock::duration, int>>;
+    auto ms = [](int n) -> clock::duration { return milliseconds(n); };
+
+    // debounce sends a value once the source has been quiet for a while.
+    {
+        rx::publish_subject<int> subject;
+        rx::event_recorder<int> rec(vs);
+        rx::debounce(subject, milliseconds(20), &vs).subscribe(rec);
+        at(0, [=]{ subject.send_next(1); });
+        at(10, [=]{ subject.send_next(2); });
+        at(25, [=]{ subject.send_next(3); });
+        at(100, [=]{ subject.send_next(4); });
+        at(110, [=]{ subject.send_completed(); });
+        vs.advance_by(milliseconds(200));
+        assert_true(rec.values() == timed({{ms(45), 3}, {ms(110), 4}}), "testTimers debounce");
+        assert_true(rec.completed(), "testTimers debounce completed");
+    }
+
+    // throttle_first drops values until the window is over.
+    {
+        rx::publish_subject<int> subject;
+        rx::event_recorder<int> rec(vs);
+        rx::throttle_first(subject, milliseconds(20), &vs).subscribe(rec);
+        for (int i = 0; i < 5; ++i) {
+            at(200 + i * 10, [=]{ subject.send_next(i); });
+        }
+        vs.advance_by(milliseconds(100));
+        assert_true(rec.values() == timed({{ms(200), 0}, {ms(220), 2}, {ms(240), 4}}),
+                    "testTimers throttle_first");
+    }
+
+    // throttle_last sends the last value of windows started by a value;
+    // sample sends the latest value on a fixed period.
+    {
+        rx::publish_subject<int> subject;
+        rx::event_recorder<int> last(vs), sampled(vs);
+        at(300, [&]{
+            rx::throttle_last(subject, milliseconds(20), &vs).subscribe(last);
+            rx::sample(subject, milliseconds(20), &vs).subscribe(sampled);
+        });
+        at(305, [=]{ subject.send_next(1); });
+        at(315, [=]{ subject.send_next(2); });
+        at(330, [=]{ subject.send_next(3); });
+        vs.advance_by(milliseconds(100));
+        assert_true(last.values() == timed({{ms(325), 2}, {ms(350), 3}}), "testTimers throttle_last");
+        assert_true(sampled.values() == timed({{ms(320), 2}, {ms(340), 3}}), "testTimers sample");
+        subject.send_completed();
+    }
+
+    // timeout fails a source that goes quiet.
+    {
+        rx::publish_subject<int> subject;
+        rx::event_recorder<int> rec(vs);
+        rx::subscription sub;
+        at(400, [&]{
+            sub = rx::timeout(subject, milliseconds(20), &vs).subscribe(rec);
+        });
+        at(410, [=]{ subject.send_next(1); });
+        vs.advance_by(milliseconds(100));
+        assert_true(rec.errored(), "testTimers timeout");
+        assert_true(*rec.finished_at().orNull() == ms(430), "testTimers timeout time");
+        assert_true(sub.is_disposed(), "testTimers timeout disposed");
+    }
+
+    // delay shifts values and the completion, in order.
+    {
+        rx::event_recorder<int> rec(vs);
+        at(500, [&]{
+            rx::delay(count_to(3), milliseconds(20), &vs).subscribe(rec);
+        });
+        vs.advance_by(milliseconds(100));
+        assert_true(rec.values() == timed({{ms(520), 1}, {ms(520), 2}, {ms(520), 3}}),
+                    "testTimers delay");
+        assert_true(rec.completed(), "testTimers delay completed");
+    }
+
+    // buffer_with_time sends what arrived in each window, and what's left
+    // when the source completes.
+    {
+        rx::publish_subject<int> subject;
+        std::vector<std::vector<int>> out;
+        at(600, [&]{
+            rx::buffer_with_time(subject, milliseconds(20), &vs).subscribe([&out](std::vector<int> x){
+                out.push_back(std::move(x));
+            });
+        });
+        at(605, [=]{ subject.send_next(1); });
+        at(610, [=]{ subject.send_next(2); });
+        at(650, [=]{ subject.send_next(3); });
+        at(655, [=]{ subject.send_completed(); });
+        vs.advance_by(milliseconds(100));
+        assert_true(out == std::vector<std::vector<int>>({{1, 2}, {3}}), "testTimers buffer_with_time");
+    }
+}
+
+static void testVirtualTime(void) {
+    using std::chrono::milliseconds;
+    rx::virtual_scheduler vs;
+
+    // Nothing runs until the clock is advanced.
+    rx::event_recorder<int> rec(vs);
+    count_to(3).subscribe_on(&vs).deliver_on(&vs).subscribe(rec);
+    assert_eq(rec.events().size(), size_t(0));
+    vs.run_pending();
+    assert_eq(rec.values().size(), size_t(3));
+    assert_true(rec.completed(), "testVirtualTime completed");
+
+    // Functions run in order of time, then of scheduling.
+    std::vector<int> order;
+    vs.schedule_after(milliseconds(20), [&order]{ order.push_back(3); });
+    vs.schedule_after(milliseconds(10), [&order]{ order.push_back(1); });
+    vs.schedule_after(milliseconds(10), [&order, &vs]{
+        order.push_back(2);
+        vs.schedule_after(milliseconds(10), [&order]{ order.push_back(4); });
+    });
+    vs.advance_by(milliseconds(15));
+    assert_true(order == std::vector<int>({1, 2}), "testVirtualTime partial advance");
+    assert_true(vs.elapsed() == milliseconds(15), "testVirtualTime clock");
+    vs.advance_by(milliseconds(10));
+    assert_true(order == std::vector<int>({1, 2, 3, 4}), "testVirtualTime order");
+
+    // End-to-end latency through a pipeline, without sleeping.
+    rx::publish_subject<int> requests;
+    rx::event_recorder<int> replies(vs);
+    auto sent = vs.elapsed();
+    rx::delay(requests.map([](int x){ return x * 2; }), milliseconds(3), &vs)
+    .deliver_on(&vs)
+    .subscribe(replies);
+    requests.send_next(21);
+    vs.advance_by(milliseconds(10));
+    auto got = replies.values();
+    assert_eq(got.size(), size_t(1));
+    assert_eq(got[0].second, 42);
+    assert_true(got[0].first - sent <= milliseconds(5), "testVirtualTime latency budget");
+}
+
+static void testBuffer(void) {
+    auto batches = [](auto o){
+        std::vector<std::vector<int>> out;
+        o.subscribe([&out](rx::batch<int> b){
+            out.emplace_back(b.begin(), b.end());
+        });
+        return out;
+    };
+    using batches_t = std::vector<std::vector<int>>;
+
+    assert_true(batches(count_to(7).buffer(3)) == batches_t({{1, 2, 3}, {4, 5, 6}, {7}}),
+                "testBuffer buffer(n)");
+    assert_true(batches(count_to(7).buffer(3, 2)) == batches_t({{1, 2, 3}, {3, 4, 5}, {5, 6, 7}, {7}}),
+                "testBuffer overlapping");
+    assert_true(batches(count_to(7).buffer(2, 3)) == batches_t({{1, 2}, {4, 5}, {7}}),
+                "testBuffer skipping");
+
+    // flatten goes back to single values.
+    std::vector<int> flat;
+    count_to(7).buffer(3).flatten().subscribe([&flat](int x){ flat.push_back(x); });
+    assert_true(flat == std::vector<int>({1, 2, 3, 4, 5, 6, 7}), "testBuffer flatten");
+
+    // Values are moved out of batches nobody else holds.
+    copy_counter::copies = 0;
+    rx::make_observable<copy_counter>([](auto s){
+        for (int i = 0; i < 4; ++i) {
+            s.send_next(copy_counter(i));
+        }
+        s.send_completed();
+    }).buffer(2).flatten().subscribe([](copy_counter){});
+    assert_eq(copy_counter::copies, 0);
+
+    // Once the pool has buffers to reuse, batching doesn't allocate.
+    {
+        rx::publish_subject<int> subject;
+        long sum = 0;
+        subject.buffer(4).subscribe([&sum](const rx::batch<int> &b){
+            for (int x : b) {
+                sum += x;
+            }
+        });
+        for (int i = 0; i < 8; ++i) {
+            subject.send_next(i);
+        }
+        size_t before = allocation_count;
+        for (int i = 0; i < 400; ++i) {
+            subject.send_next(i);
+        }
+        assert_eq(allocation_count - before, 0);
+        assert_eq(sum, 28 + 399 * 400 / 2);
+    }
+
+    // Batches held by the subscriber keep their values after the pool's
+    // subscription is gone.
+    std::vector<rx::batch<int>> kept;
+    count_to(6).buffer(3).subscribe([&kept](rx::batch<int> b){ kept.push_back(std::move(b)); });
+    assert_eq(kept.size(), size_t(2));
+    assert_eq(kept[1][2], 6);
+
+    // window sends an observable for each run of values, which replays it.
+    std::vector<rx::batch_observable<int>> windows;
+    count_to(5).window(2).subscribe([&windows](rx::batch_observable<int> w){ windows.push_back(w); });
+    assert_eq(windows.size(), size_t(3));
+    for (int pass = 0; pass < 2; ++pass) {
+        std::vector<int> second;
+        bool completed = false;
+        windows[1].subscribe(rx::make_observer([&second](int x){
+            second.push_back(x);
+        }, [](rx::default_error_type){}, [&completed]{
+            completed = true;
+        }));
+        assert_true(second == std::vector<int>({3, 4}), "testBuffer window values");
+        assert_true(completed, "testBuffer window completed");
+    }
+    std::vector<int> last;
+    windows[2].subscribe([&last](int x){ last.push_back(x); });
+    assert_true(last == std::vector<int>({5}), "testBuffer window left over");
+
+    // As with buffer, windows come from a pool, so once they're let go of
+    // windowing doesn't allocate. Holding on to the last one keeps a second
+    // buffer in use.
+    {
+        rx::publish_subject<int> subject;
+        std::vector<rx::batch_observable<int>> held;
+        held.reserve(1);
+        size_t count = 0;
+        subject.window(4).subscribe([&held, &count](const rx::batch_observable<int> &w){
+            held.clear();
+            held.push_back(w);
+            ++count;
+        });
+        for (int i = 0; i < 8; ++i) {
+            subject.send_next(i);
+        }
+        size_t before = allocation_count;
+        for (int i = 0; i < 400; ++i) {
+            subject.send_next(i);
+        }
+        assert_eq(allocation_count - before, 0);
+        assert_eq(count, size_t(102));
+        std::vector<int> values;
+        held[0].subscribe([&values](int x){ values.push_back(x); });
+        assert_true(values == std::vector<int>({396, 397, 398, 399}), "testBuffer held window");
+    }
+}
+
+// Every instruction set the CPU has must agree with the scalar loops, at
+// lengths that leave every size of tail.
+template <typename T>
+static bool simdMatchesScalar(void) {
+    std::vector<T> xs(1003);
+    unsigned seed = 12345;
+    for (T &x : xs) {
+        seed = seed * 1103515245 + 12345;
+        x = T(int(seed >> 16) % 2001 - 1000) / T(std::is_integral<T>::value ? 1 : 8);
+    }
+    auto close = [](double a, double b){
+        return a == b || std::abs(a - b) <= 1e-9 * std::max(std::abs(a), std::abs(b)) + 1e-6;
+    };
+    bool ok = true;
+    for (size_t n : {size_t(0), size_t(1), size_t(7), size_t(16), size_t(33), size_t(70), size_t(1003)}) {
+        std::vector<T> scalar_out(n), out(n);
+        rx::limit_simd_level(rx::simd_level::scalar);
+        auto sum = rx::simd_sum(xs.data(), n);
+        auto m = rx::simd_moments_of(xs.data(), n);
+        size_t count = rx::simd_count(xs.data(), n, rx::simd_compare::greater, T(3));
+        T lo = n ? rx::simd_min(xs.data(), n) : T();
+        T hi = n ? rx::simd_max(xs.data(), n) : T();
+        rx::simd_apply(xs.data(), scalar_out.data(), n, rx::simd_op::multiply, T(3));
+        for (auto level : {rx::simd_level::sse2, rx::simd_level::avx2, rx::simd_level::avx512}) {
+            if (level > rx::supported_simd_level()) {
+                continue;
+            }
+            rx::limit_simd_level(level);
+            auto vm = rx::simd_moments_of(xs.data(), n);
+            ok = ok && close(rx::simd_sum(xs.data(), n), sum);
+            ok = ok && vm.count == m.count && close(vm.mean, m.mean) && close(vm.m2, m.m2);
+            ok = ok && rx::simd_count(xs.data(), n, rx::simd_compare::greater, T(3)) == count;
+            ok = ok && (n == 0 || (rx::simd_min(xs.data(), n) == lo && rx::simd_max(xs.data(), n) == hi));
+            rx::simd_apply(xs.data(), out.data(), n, rx::simd_op::multiply, T(3));
+            ok = ok && out == scalar_out;
+        }
+    }
+    rx::limit_simd_level(rx::simd_level::avx512);
+    return ok;
+}
+
+static void testSimd(void) {
+    assert_true(simdMatchesScalar<float>(), "testSimd float");
+    assert_true(simdMatchesScalar<double>(), "testSimd double");
+    assert_true(simdMatchesScalar<int32_t>(), "testSimd int32_t");
+    assert_true(simdMatchesScalar<int64_t>(), "testSimd int64_t");
+
+    // Floats are summed in doubles at every level, so long sums of values
+    // floats can't represent exactly agree with the scalar loop's.
+    {
+        std::vector<float> tenths(10 * 1000 * 1000, 0.1f);
+        rx::limit_simd_level(rx::simd_level::scalar);
+        double scalar = rx::simd_sum(tenths.data(), tenths.size());
+        bool agree = true;
+        for (auto level : {rx::simd_level::sse2, rx::simd_level::avx2, rx::simd_level::avx512}) {
+            if (level > rx::supported_simd_level()) {
+                continue;
+            }
+            rx::limit_simd_level(level);
+            agree = agree && std::abs(rx::simd_sum(tenths.data(), tenths.size()) - scalar) <= 1e-9 * scalar;
+        }
+        rx::limit_simd_level(rx::simd_level::avx512);
+        assert_true(agree, "testSimd long float sums");
+    }
+
+    // Reductions over batches send one result when the source completes.
+    auto batches = count_to(100).buffer(16);
+    std::vector<double> got;
+    rx::sum(batches).subscribe([&got](int64_t x){ got.push_back(double(x)); });
+    rx::min(batches).subscribe([&got](int x){ got.push_back(x); });
+    rx::max(batches).subscribe([&got](int x){ got.push_back(x); });
+    rx::mean(batches).subscribe([&got](double x){ got.push_back(x); });
+    rx::variance(batches).subscribe([&got](double x){ got.push_back(x); });
+    rx::count_if(batches, rx::simd_compare::less_equal, 10).subscribe([&got](size_t x){ got.push_back(double(x)); });
+    assert_true(got == std::vector<double>({5050, 1, 100, 50.5, 833.25, 10}), "testSimd reductions");
+
+    got.clear();
+    rx::min(count_to(0).buffer(16)).subscribe([&got](int x){ got.push_back(x); });
+    rx::sum(count_to(0).buffer(16)).subscribe([&got](int64_t x){ got.push_back(double(x)); });
+    assert_true(got == std::vector<double>({0}), "testSimd empty");
+
+    std::vector<int> scaled;
+    rx::map_batch(count_to(5).buffer(2), rx::simd_op::multiply, 3).flatten()
+        .subscribe([&scaled](int x){ scaled.push_back(x); });
+    assert_true(scaled == std::vector<int>({3, 6, 9, 12, 15}), "testSimd map_batch");
+
+    std::vector<double> halves;
+    rx::map_batch(count_to(3).buffer(2), [](int x){ return x / 2.0; }).flatten()
+        .subscribe([&halves](double x){ halves.push_back(x); });
+    assert_true(halves == std::vector<double>({0.5, 1, 1.5}), "testSimd map_batch with a function");
+}
+
+// Writes contents to a new temporary file, and returns its path.
+static std::string temp_file(const std::string &contents) {
+    char path[] = "/tmp/rx_test_XXXXXX";
+    int fd = mkstemp(path);
+    ssize_t written = write(fd, contents.data(), contents.size());
+    close(fd);
+    return written == ssize_t(contents.size()) ? path : "";
+}
+
+static void testIo(void) {
+    std::vector<std::string> got;
+    bool completed = false;
+    bool failed = false;
+    auto recorder = [&]{
+        return rx::make_observer([&](rx::string_view r){
+            got.push_back(std::string(r));
+        }, [&](rx::default_error_type){
+            failed = true;
+        }, [&]{
+            completed = true;
+        });
+    };
+    auto reset = [&]{
+        got.clear();
+        completed = failed = false;
+    };
+
+    // Lines point into the mapping, which lasts until the subscription ends,
+    // after the subscriber's completion.
+    std::string lines = temp_file("one\ntwo\n\nthree");
+    std::vector<rx::string_view> views;
+    bool views_valid = false;
+    rx::mapped_file(lines).subscribe([&views](rx::string_view r){
+        views.push_back(r);
+    }, [](rx::default_error_type){}, [&]{
+        views_valid = views.size() == 4 && views[0] == "one" && views[1] == "two" &&
+                      views[2].empty() && views[3] == "three";
+    });
+    assert_true(views_valid, "testIo mapped lines valid until completion");
+
+    // Records are read as they're requested.
+    rx::subscription two(2);
+    rx::mapped_file(lines).subscribe(rx::with_subscription(recorder(), two));
+    assert_eq(int(got.size()), 2);
+    two.request(10);
+    assert_true(got.size() == 4 && got[0] == "one" && completed, "testIo mapped lines on demand");
+    two.dispose();
+
+    std::string binary("abcdefgh", 8);
+    binary += std::string("\0\0\0\3xyz\0\0\0\0", 11);
+    std::string records = temp_file(binary);
+    reset();
+    rx::mapped_file(records, rx::framing::fixed(4)).take(2).subscribe(recorder());
+    assert_true(got.size() == 2 && got[0] == "abcd" && got[1] == "efgh", "testIo fixed records");
+
+    // The length-prefixed records follow 8 bytes in; a truncated record is
+    // an error.
+    std::string prefixed = temp_file(binary.substr(8));
+    reset();
+    rx::mapped_file(prefixed, rx::framing::length_prefixed()).subscribe(recorder());
+    assert_true(got.size() == 2 && got[0] == "xyz" && got[1].empty() && completed,
+                "testIo length-prefixed records");
+    reset();
+    rx::mapped_file(records, rx::framing::fixed(5)).subscribe(recorder());
+    assert_true(got.size() == 3 && failed && !completed, "testIo truncated record fails");
+
+    // Chunks smaller than the records are joined, and others aren't copied.
+    for (size_t chunk : {1, 3, 64}) {
+        reset();
+        rx::split_records(rx::read_chunks(lines, chunk), rx::framing::lines())
+        .subscribe(recorder());
+        assert_true(got.size() == 4 && got[0] == "one" && got[3] == "three" && completed,
+                    "testIo chunked lines");
+        reset();
+        rx::split_records(rx::read_chunks(prefixed, chunk), rx::framing::length_prefixed())
+        .subscribe(recorder());
+        assert_true(got.size() == 2 && got[0] == "xyz" && completed,
+                    "testIo chunked length-prefixed records");
+    }
+
+    std::string empty = temp_file("");
+    reset();
+    rx::mapped_file(empty).subscribe(recorder());
+    assert_true(got.empty() && completed, "testIo empty file completes");
+    reset();
+    rx::read_chunks("/nonexistent/rx_test").subscribe(recorder());
+    assert_true(failed, "testIo missing file fails");
+    for (const std::string &path : {lines, records, prefixed, empty}) {
+        unlink(path.c_str());
+    }
+
+#ifdef __linux__
+    rx::io_loop loop;
+    std::mutex m;
+    std::string received;
+    std::atomic<bool> done{false};
+
+    // Pipes are read as data arrives, until they're closed.
+    int p[2];
+    if (pipe(p) != 0) {
+        assert_true(false, "testIo pipe");
+        return;
+    }
+    rx::subscription piped = rx::read_fd(p[0], &loop).subscribe([&](rx::string_view chunk){
+        std::lock_guard<std::mutex> lock(m);
+        received.append(chunk.data(), chunk.size());
+    }, [](rx::default_error_type){}, [&done]{
+        done = true;
+    });
+    ssize_t written = write(p[1], "hello ", 6);
+    written += write(p[1], "pipe", 4);
+    close(p[1]);
+    assert_true(written == 10 && wait_for([&done]{ return done.load(); }) && received == "hello pipe",
+                "testIo pipe read until closed");
+    close(p[0]);
+
+    // Sockets are only read while there's demand.
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        assert_true(false, "testIo socketpair");
+        return;
+    }
+    std::atomic<int> chunks{0};
+    rx::subscription one(1);
+    rx::read_fd(sv[0], &loop, 4).subscribe(rx::with_subscription(rx::make_observer(
+        [&chunks](rx::string_view){ ++chunks; }), one));
+    written = write(sv[1], "0123456789ab", 12);
+    assert_true(written == 12 && wait_for([&chunks]{ return chunks == 1; }),
+                "testIo socket first chunk");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    assert_eq(chunks, 1);
+    one.request(2);
+    assert_true(wait_for([&chunks]{ return chunks == 3; }), "testIo socket resumed by demand");
+    one.dispose();
+    close(sv[0]);
+    close(sv[1]);
+
+    // A paused descriptor that hangs up isn't watched, so the loop doesn't
+    // spin on the hang-up, and is read again once there's demand.
+    if (pipe(p) != 0) {
+        assert_true(false, "testIo pipe");
+        return;
+    }
+    chunks = 0;
+    done = false;
+    rx::subscription paused(1);
+    rx::read_fd(p[0], &loop, 1).subscribe(rx::with_subscription(rx::make_observer(
+        [&chunks](rx::string_view){ ++chunks; }, [](rx::default_error_type){}, [&done]{ done = true; }), paused));
+    written = write(p[1], "ab", 2);
+    close(p[1]);
+    assert_true(written == 2 && wait_for([&chunks]{ return chunks == 1; }), "testIo hung up first chunk");
+    std::clock_t cpu = std::clock();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    assert_true(double(std::clock() - cpu) / CLOCKS_PER_SEC < 0.05, "testIo paused hang-up is idle");
+    paused.request(2);
+    assert_true(wait_for([&done]{ return done.load(); }) && chunks == 2, "testIo hung up read after pause");
+    close(p[0]);
+
+    // A descriptor already readable when it's subscribed to is read at once,
+    // and paused for lack of demand like any other.
+    if (pipe(p) != 0) {
+        assert_true(false, "testIo pipe");
+        return;
+    }
+    chunks = 0;
+    done = false;
+    written = write(p[1], "abc", 3);
+    rx::subscription early(1);
+    rx::read_fd(p[0], &loop, 1).subscribe(rx::with_subscription(rx::make_observer(
+        [&chunks](rx::string_view){ ++chunks; }, [](rx::default_error_type){}, [&done]{ done = true; }), early));
+    assert_true(written == 3 && wait_for([&chunks]{ return chunks == 1; }), "testIo readable first chunk");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    assert_eq(chunks, 1);
+    early.request(2);
+    assert_true(wait_for([&chunks]{ return chunks == 3; }), "testIo readable resumed by demand");
+    close(p[1]);
+    early.request(1);
+    assert_true(wait_for([&done]{ return done.load(); }), "testIo readable completed");
+    close(p[0]);
+#endif
+}
+
+static void testGroupBy(void) {
+    using group = rx::grouped_observable<int, int>;
+
+    // Each key's values go to its group, which is sent with the first.
+    std::vector<int> keys;
+    std::vector<std::vector<int>> values(3);
+    int completed = 0;
+    rx::group_by(count_to(10), [](int x){ return x % 3; }).subscribe([&](group g){
+        keys.push_back(g.key);
+        g.subscribe(rx::make_observer([&values, key = g.key](int x){
+            values[key].push_back(x);
+        }, [](rx::default_error_type){}, [&completed]{
+            ++completed;
+        }));
+    });
+    assert_true(keys == std::vector<int>({1, 2, 0}), "testGroupBy keys in order of arrival");
+    assert_true(values[0] == std::vector<int>({3, 6, 9}) && values[1] == std::vector<int>({1, 4, 7, 10}),
+                "testGroupBy values by key");
+    assert_eq(completed, 3);
+
+    // The least recently used group ends to make room for a new one.
+    rx::publish_subject<int> source;
+    keys.clear();
+    std::vector<int> ended;
+    rx::group_by(source, [](int x){ return x; }, rx::group_limits().groups(2))
+    .subscribe([&](group g){
+        keys.push_back(g.key);
+        g.subscribe(rx::make_observer([](int){}, [](rx::default_error_type){}, [&ended, key = g.key]{
+            ended.push_back(key);
+        }));
+    });
+    for (int x : {1, 2, 1, 3, 2}) {
+        source.send_next(x);
+    }
+    assert_true(keys == std::vector<int>({1, 2, 3, 2}) && ended == std::vector<int>({2, 1}),
+                "testGroupBy evicts least recently used");
+
+    // Idle groups end when the next value arrives.
+    rx::publish_subject<int> timed;
+    ended.clear();
+    rx::group_by(timed, [](int x){ return x; }, rx::group_limits().idle(std::chrono::milliseconds(10)))
+    .subscribe([&](group g){
+        g.subscribe(rx::make_observer([](int){}, [](rx::default_error_type){}, [&ended, key = g.key]{
+            ended.push_back(key);
+        }));
+    });
+    timed.send_next(1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    assert_true(ended.empty(), "testGroupBy idle groups end lazily");
+    timed.send_next(2);
+    timed.send_next(2);
+    assert_true(ended == std::vector<int>({1}), "testGroupBy evicts idle groups");
+
+    // Sharded, each key's values stay in order, while keys run on several
+    // threads.
+    const int n = 100000;
+    const int key_count = 1000;
+    struct per_key {
+        int last = 0;
+        bool ordered = true;
+    };
+    std::vector<per_key> seen(key_count);
+    std::atomic<long> sum{0};
+    std::atomic<int> groups{0};
+    std::atomic<int> groups_completed{0};
+    std::atomic<bool> done{false};
+    std::mutex m;
+    std::set<std::thread::id> threads;
+    {
+        rx::thread_pool pool(4);
+        rx::group_by(count_to(n), [](int x){ return x % key_count; }, &pool, 8)
+        .subscribe([&](group g){
+            ++groups;
+            g.subscribe(rx::make_observer([&, key = g.key](int x){
+                per_key &k = seen[key];
+                if (k.last == 0) {
+                    std::lock_guard<std::mutex> lock(m);
+                    threads.insert(std::this_thread::get_id());
+                }
+                k.ordered = k.ordered && x > k.last;
+                k.last = x;
+                sum += x;
+            }, [](rx::default_error_type){}, [&groups_completed]{
+                ++groups_completed;
+            }));
+        }, [](rx::default_error_type){}, [&done]{
+            done = true;
+        });
+        assert_true(wait_for([&done]{ return done.load(); }), "testGroupBy sharded completed");
+    }
+    assert_eq(groups, key_count);
+    assert_eq(groups_completed, key_count);
+    assert_true(sum == long(n) * (n + 1) / 2, "testGroupBy sharded sum");
+    assert_true(std::all_of(seen.begin(), seen.end(), [](const per_key &k){
+        return k.ordered;
+    }), "testGroupBy sharded keys in order");
+    assert_true(threads.size() > 1, "testGroupBy sharded across threads");
+
+    // A source blocked on a full shard parks, as with observe_via_ring,
+    // rather than spinning on the thread that subscribed.
+    {
+        std::atomic<int> last{0};
+        rx::thread_pool pool(1);
+        timespec cpu0, cpu1;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+        auto start = std::chrono::steady_clock::now();
+        rx::group_by(count_to(500), [](int){ return 0; }, &pool, 1, rx::group_limits().queue(4))
+        .subscribe([&last](group g){
+            g.subscribe(rx::make_observer([&last](int x){
+                last = x;
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }));
+        });
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+        double cpu = double(cpu1.tv_sec - cpu0.tv_sec) + double(cpu1.tv_nsec - cpu0.tv_nsec) / 1e9;
+        assert_true(cpu < wall / 2, "testGroupBy blocked source parks");
+        assert_true(wait_for([&last]{ return last == 500; }), "testGroupBy blocked source delivered");
+    }
+}
+
+enum class parse_error { bad_digit };
+
+static void testErrorTypes(void) {
+    // Infallible observables leave error storage out of recorded events.
+    static_assert(sizeof(rx::notification<int, rx::never>) < sizeof(rx::notification<int, rx::default_error_type>),
+                  "infallible events are smaller");
+    auto numbers = rx::make_observable<int, rx::never>([](auto s){
+        for (int i = 1; i <= 4; ++i) {
+            s.send_next(i);
+        }
+        s.send_completed();
+    });
+    int sum = 0;
+    bool completed = false;
+    numbers.map([](int x){ return x * 2; }).any().subscribe([&sum](int x){ sum += x; });
+    assert_eq(sum, 20);
+    {
+        rx::event_loop loop;
+        std::atomic<int> delivered{0};
+        numbers.deliver_on(&loop, 2).subscribe([&delivered](int x){ delivered += x; });
+        assert_true(wait_for([&delivered]{ return delivered == 10; }), "testErrorTypes infallible deliver_on");
+    }
+
+    // Cheap error types, and errors converted where error types meet.
+    auto failing = rx::make_observable<int, std::error_code>([](auto s){
+        s.send_next(1);
+        s.send_error(std::make_error_code(std::errc::io_error));
+    });
+    std::error_code code;
+    failing.subscribe([](int){}, [&code](std::error_code e){ code = e; });
+    assert_true(code == std::errc::io_error, "testErrorTypes error_code");
+
+    // catch_to takes the fallback's error type, so it can make a stream
+    // infallible.
+    sum = 0;
+    failing.catch_to(rx::pure_observable<rx::never>(10)).subscribe(
+        rx::make_observer<rx::never>([&sum](int x){ sum += x; }));
+    assert_eq(sum, 11);
+
+    // bind joins error types, converting the source's errors.
+    std::exception_ptr error;
+    failing.bind([](int x){
+        return rx::pure_observable(x);
+    }).subscribe([](int){}, [&error](std::exception_ptr e){ error = e; });
+    try {
+        std::rethrow_exception(error);
+    } catch (const std::system_error &e) {
+        code = e.code();
+    } catch (...) {
+    }
+    assert_true(code == std::errc::io_error, "testErrorTypes bind converts to exception_ptr");
+
+    sum = 0;
+    numbers.bind([](int x){
+        return rx::pure_observable<parse_error>(x);
+    }).subscribe([&sum](int x){ sum += x; }, [](parse_error){}, [&completed]{ completed = true; });
+    assert_true(sum == 10 && completed, "testErrorTypes bind infallible source");
+
+    bool failed = false;
+    numbers.flat_map([](int x){
+        return x == 3 ? rx::error_observable<int>(parse_error::bad_digit).any()
+                      : rx::pure_observable<parse_error>(x).any();
+    }).subscribe([](int){}, [&failed](parse_error e){ failed = e == parse_error::bad_digit; });
+    assert_true(failed, "testErrorTypes flat_map inner error");
+
+    // map_error and with_error_type change the error type.
+    int value = 0;
+    failing.map_error([](std::error_code e){ return e.value(); })
+    .subscribe([](int){}, [&value](int e){ value = e; });
+    assert_eq(value, int(std::errc::io_error));
+    completed = false;
+    numbers.with_error_type<std::exception_ptr>().subscribe([](int){}, [](std::exception_ptr){}, [&completed]{
+        completed = true;
+    });
+    assert_true(completed, "testErrorTypes with_error_type");
+
+    try {
+        throw std::system_error(std::make_error_code(std::errc::timed_out));
+    } catch (...) {
+        Maybe<std::error_code> e = rx::exception_error<std::error_code>::current();
+        assert_true(e.isJust() && *e.orNull() == std::errc::timed_out,
+                    "testErrorTypes system_error to error_code");
+    }
+}
+
+#ifdef RX_TRACE
+struct recording_sink : rx::trace_sink {
+    struct stage {
+        std::string name;
+        uint64_t id, downstream, in, out, self_ns, total_ns, allocations;
+        size_t max_queue_depth;
+    };
+    std::mutex m;
+    std::vector<stage> stages;
+    std::atomic<int> events{0};
+
+    void event(const rx::trace_stage &, rx::trace_clock::time_point,
+               rx::trace_clock::time_point) override {
+        ++events;
+    }
+    void stage_finished(const rx::trace_stage &s) override {
+        std::lock_guard<std::mutex> lock(m);
+        stages.push_back({s.name, s.id, s.downstream ? s.downstream->id : 0, s.events_in,
+                          s.events_out, s.self_ns, s.total_ns, s.allocations,
+                          s.max_queue_depth});
+    }
+    const stage *find(const std::string &name) const {
+        for (const stage &s : stages) {
+            if (s.name == name) {
+                return &s;
+            }
+        }
+        return nullptr;
+    }
+};
+
+static void testTrace(void) {
+    recording_sink sink;
+    rx::set_trace_sink(&sink);
+    int sum = 0;
+    count_to(10)
+    .map([](int x){ return x * 2; })
+    .filter([](int x){ return x % 4 == 0; })
+    .take(3)
+    .subscribe([&sum](int x){ sum += x; });
+    assert_eq(sum, 4 + 8 + 12);
+
+    const recording_sink::stage *source = sink.find("make_observable");
+    const recording_sink::stage *map = sink.find("map");
+    const recording_sink::stage *filter = sink.find("filter");
+    const recording_sink::stage *take = sink.find("take");
+    assert_true(source && map && filter && take, "testTrace stages");
+    assert_true(source->downstream == map->id && map->downstream == filter->id &&
+                filter->downstream == take->id && take->downstream == 0,
+                "testTrace links");
+    // Events include the completion.
+    assert_eq(source->out, 7);
+    assert_eq(map->in, 7);
+    assert_eq(map->out, 7);
+    assert_eq(filter->in, 7);
+    assert_eq(filter->out, 4);
+    assert_eq(take->in, 4);
+    assert_eq(take->out, 4);
+    assert_eq(sink.events, 7 + 7 + 4);
+    assert_true(map->self_ns <= map->total_ns && filter->total_ns <= map->total_ns,
+                "testTrace times");
+    assert_eq(take->allocations, 1);
+
+    // Events queued for a scheduler.
+    sink.stages.clear();
+    std::vector<std::function<void()>> queue;
+    count_to(10)
+    .deliver_with([&queue](auto f){ queue.push_back(f); }, 4)
+    .subscribe([](int){});
+    while (!queue.empty()) {
+        auto f = queue.front();
+        queue.erase(queue.begin());
+        f();
+    }
+    const recording_sink::stage *deliver = sink.find("deliver_on");
+    assert_true(deliver && deliver->max_queue_depth == 11, "testTrace queue depth");
+
+    // The Chrome trace has a slice for each event, and each stage's totals.
+    FILE *f = tmpfile();
+    {
+        rx::chrome_trace_writer writer(f);
+        rx::set_trace_sink(&writer);
+        count_to(3).map([](int x){ return x + 1; }).subscribe([](int){});
+        rx::set_trace_sink(nullptr);
+    }
+    std::string json(size_t(ftell(f)), ' ');
+    rewind(f);
+    json.resize(fread(&json[0], 1, json.size(), f));
+    fclose(f);
+    assert_true(json.compare(0, 15, "{\"traceEvents\":") == 0 &&
+                json.compare(json.size() - 3, 3, "]}\n") == 0, "testTrace json");
+    assert_true(json.find("\"name\":\"map\",\"cat\":\"rx\",\"ph\":\"X\"") != std::string::npos,
+                "testTrace json slices");
+    assert_true(json.find("\"events in\":4") != std::string::npos, "testTrace json totals");
+}
+#endif
+
+#if RX_COROUTINES
+// Sets a flag when a coroutine's frame is destroyed.
+struct frame_guard {
+    bool *destroyed;
+    ~frame_guard() { *destroyed = true; }
+};
+
+static void testCoroutines(void) {
+    auto countdown = [](int n){
+        return rx::make_coroutine([n]() -> rx::coroutine_source<int> {
+            for (int i = n; i > 0; --i) {
+                co_yield i;
+            }
+        });
+    };
+    std::vector<int> got;
+    bool completed = false;
+    countdown(3).subscribe([&got](int x){ got.push_back(x); }, [](rx::default_error_type){},
+                           [&completed]{ completed = true; });
+    assert_true(got == std::vector<int>({3, 2, 1}) && completed, "testCoroutines values");
+
+    // The frame waits for demand, and is destroyed when disposed.
+    got.clear();
+    bool destroyed = false;
+    rx::subscription sub(2);
+    rx::make_coroutine([&destroyed]() -> rx::coroutine_source<int> {
+        frame_guard guard{&destroyed};
+        for (int i = 1;; ++i) {
+            co_yield i;
+        }
+    }).subscribe(rx::with_subscription(rx::make_observer([&got](int x){ got.push_back(x); }), sub));
+    assert_eq(got.size(), 2);
+    sub.request(3);
+    assert_eq(got.size(), 5);
+    assert_true(!destroyed, "testCoroutines suspended");
+    sub.dispose();
+    assert_true(destroyed, "testCoroutines destroyed");
+
+    // Errors, yielded or thrown.
+    int error = 0;
+    rx::make_coroutine([]() -> rx::coroutine_source<int, int> {
+        co_yield 1;
+        co_yield rx::fail(7);
+        co_yield 2;
+    }).subscribe([&error](int x){ error += x; }, [&error](int e){ error += e * 10; });
+    assert_eq(error, 71);
+    bool threw = false;
+    rx::make_coroutine([]() -> rx::coroutine_source<int> {
+        throw std::runtime_error("failed");
+        co_return;
+    }).subscribe([](int){}, [&threw](std::exception_ptr){ threw = true; });
+    assert_true(threw, "testCoroutines exception");
+
+    // Awaiting observables: the first or last value, each value in turn, or
+    // an error.
+    got.clear();
+    rx::make_coroutine([]() -> rx::coroutine_source<int> {
+        Maybe<int> first = co_await rx::next_value(count_to(5));
+        Maybe<int> last = co_await rx::last_value(count_to(5));
+        Maybe<int> none = co_await rx::last_value(count_to(0));
+        co_yield *first.orNull();
+        co_yield *last.orNull();
+        co_yield none.isNothing();
+        auto r = rx::read(count_to(3).map([](int x){ return x * 10; }));
+        for (;;) {
+            Maybe<int> x = co_await r.next();
+            if (x.isNothing()) {
+                break;
+            }
+            co_yield *x.orNull();
+        }
+        bool caught = false;
+        try {
+            co_await rx::next_value(rx::error_observable<int, rx::default_error_type>(
+                std::make_exception_ptr(std::runtime_error("failed"))));
+        } catch (const std::runtime_error &) {
+            caught = true;
+        }
+        co_yield caught ? -1 : 0;
+    }).subscribe([&got](int x){ got.push_back(x); });
+    assert_true(got == std::vector<int>({1, 5, 1, 10, 20, 30, -1}), "testCoroutines await");
+
+    // Reading a source that ignores demand queues its values.
+    got.clear();
+    rx::publish_subject<int> subject;
+    rx::make_coroutine([subject]() -> rx::coroutine_source<int> {
+        auto r = rx::read(subject);
+        for (;;) {
+            Maybe<int> x = co_await r.next();
+            if (x.isNothing()) {
+                break;
+            }
+            co_yield *x.orNull();
+        }
+    }).subscribe([&got](int x){ got.push_back(x); });
+    subject.send_next(1);
+    subject.send_next(2);
+    subject.send_completed();
+    assert_true(got == std::vector<int>({1, 2}), "testCoroutines read subject");
+
+    // Resuming on a queue.
+    rx::event_loop loop;
+    std::atomic<bool> done{false};
+    std::atomic<bool> on_loop{false};
+    rx::make_coroutine([&loop]() -> rx::coroutine_source<bool> {
+        co_await rx::last_value(count_to(3), &loop);
+        co_yield loop.is_current();
+    }).subscribe([&on_loop](bool x){ on_loop = x; }, [](rx::default_error_type){},
+                 [&done]{ done = true; });
+    while (!done) {
+        std::this_thread::yield();
+    }
+    assert_true(on_loop, "testCoroutines resumed on queue");
+
+    // Disposing a source stops what it's waiting for.
+    destroyed = false;
+    rx::publish_subject<int> never;
+    auto waiting = rx::make_coroutine([&destroyed, never]() -> rx::coroutine_source<int> {
+        frame_guard guard{&destroyed};
+        co_await rx::next_value(never);
+        co_yield 1;
+    }).subscribe([](int){});
+    assert_true(!destroyed, "testCoroutines waiting");
+    waiting.dispose();
+    assert_true(destroyed, "testCoroutines wait disposed");
+}
+#endif
+
 int main(void) {
     testMap();
     testBind();
     testBindError();
     testCatchTo();
+    testFilterScan();
+    testTakeSkip();
+    testDistinctUntilChanged();
+    testThrottleProgress();
+    testArena();
+    testAnyObservable();
+    testMoveOnlyPropagation();
+    testImmediateScheduler();
+    testEventLoop();
+    testThreadPool();
+    testBatchedDelivery();
+    testRing();
+    testCancellation();
+    testTakeUntil();
+    testReplaySubjectDispose();
+    testBackpressure();
+    testReplayLimits();
+    testPublishSubject();
+    testPublishSubjectStress();
+    testShare();
+    testParallelMap();
+    testFlatMap();
+    testCombine();
+    testTimers();
+    testVirtualTime();
+    testBuffer();
+    testSimd();
+    testIo();
+    testGroupBy();
+    testErrorTypes();
+#ifdef RX_TRACE
+    testTrace();
+#endif
+#if RX_COROUTINES
+    testCoroutines();
+#endif
+    return failures != 0;
 }
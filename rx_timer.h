@@ -0,0 +1,630 @@
+#pragma once
+
+#include "rx.h"
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace windberry {
+namespace rx {
+
+// Runs functions at given times on a thread of its own, using a
+// hierarchical timing wheel: four levels of 256 slots, each level's slots
+// covering 256 times as much time as the level below's. Scheduling and
+// firing are constant time, however many timers are pending. Timers fire up
+// to a tick late. Timers still pending when it's destroyed are dropped.
+//
+// Any type with the same now, schedule_at and schedule_after methods and
+// clock types can be used with the timed operators below.
+class timer_wheel {
+  public:
+    using clock = std::chrono::steady_clock;
+    using time_point = clock::time_point;
+    using duration = clock::duration;
+
+    explicit timer_wheel(duration tick_ = std::chrono::milliseconds(1))
+        : tick(tick_ > duration::zero() ? tick_ : duration(1)),
+          start(clock::now()),
+          thread([this]{ run(); }) {}
+    timer_wheel(const timer_wheel &) = delete;
+    timer_wheel &operator=(const timer_wheel &) = delete;
+
+    ~timer_wheel() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+
+    time_point now() const { return clock::now(); }
+
+    // Runs f on the timer thread once t has passed.
+    void schedule_at(time_point t, std::function<void()> f) {
+        bool was_idle;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            was_idle = pending == 0;
+            if (was_idle) {
+                // Nothing's in the wheel, so it can skip straight to now.
+                current = ticks_until(now());
+            }
+            uint64_t at = ticks_until(t);
+            // Round up, so the timer never fires early.
+            if (start + duration(tick * at) < t) {
+                ++at;
+            }
+            insert(entry{at > current ? at : current + 1, std::move(f)});
+            ++pending;
+        }
+        if (was_idle) {
+            cv.notify_one();
+        }
+    }
+
+    void schedule_after(duration d, std::function<void()> f) {
+        schedule_at(now() + d, std::move(f));
+    }
+
+  private:
+    static constexpr int levels = 4;
+    static constexpr int bits = 8;
+    static constexpr uint64_t slots = uint64_t(1) << bits;
+    static constexpr uint64_t mask = slots - 1;
+
+    struct entry {
+        uint64_t at;
+        std::function<void()> f;
+    };
+
+    uint64_t ticks_until(time_point t) const {
+        return t > start ? uint64_t((t - start) / tick) : 0;
+    }
+
+    // Puts e in the lowest level whose slots don't wrap around before it's due.
+    void insert(entry e) {
+        for (int level = 0; level < levels; ++level) {
+            int above = bits * (level + 1);
+            if (level == levels - 1 || (e.at >> above) == (current >> above)) {
+                uint64_t slot = (e.at >> (bits * level)) & mask;
+                if (level == levels - 1 && (e.at >> above) != (current >> above)) {
+                    // Too far off for the wheel. It's put back in when this
+                    // slot comes round, until it's close enough.
+                    slot = ((current >> (bits * level)) - 1) & mask;
+                }
+                wheel[level][slot].push_back(std::move(e));
+                return;
+            }
+        }
+    }
+
+    // Moves on one tick, moving timers down from the levels above when the
+    // levels below wrap around, and collects the timers now due.
+    void advance(std::vector<entry> &due) {
+        ++current;
+        int top = 0;
+        while (top + 1 < levels && (current & ((uint64_t(1) << (bits * (top + 1))) - 1)) == 0) {
+            ++top;
+        }
+        for (int level = top; level > 0; --level) {
+            std::vector<entry> moving;
+            moving.swap(wheel[level][(current >> (bits * level)) & mask]);
+            for (auto &e : moving) {
+                insert(std::move(e));
+            }
+        }
+        auto &slot = wheel[0][current & mask];
+        for (auto &e : slot) {
+            due.push_back(std::move(e));
+        }
+        slot.clear();
+    }
+
+    void run() {
+        std::vector<entry> due;
+        std::unique_lock<std::mutex> lock(m);
+        for (;;) {
+            if (stopping) {
+                return;
+            }
+            if (pending == 0) {
+                cv.wait(lock, [this]{ return pending != 0 || stopping; });
+                continue;
+            }
+            uint64_t target = ticks_until(now());
+            if (target <= current) {
+                cv.wait_until(lock, start + duration(tick * (current + 1)));
+                continue;
+            }
+            while (current < target) {
+                advance(due);
+            }
+            pending -= due.size();
+            lock.unlock();
+            for (auto &e : due) {
+                e.f();
+            }
+            due.clear();
+            lock.lock();
+        }
+    }
+
+    const duration tick;
+    const time_point start;
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::array<std::array<std::vector<entry>, slots>, levels> wheel;
+    // The last tick whose timers have been collected.
+    uint64_t current = 0;
+    size_t pending = 0;
+    bool stopping = false;
+    std::thread thread;
+};
+
+struct timeout_expired : std::runtime_error {
+    timeout_expired() : std::runtime_error("rx timeout expired") {}
+};
+
+// The error sent by timeout. Specialize for other error types.
+template <typename E>
+struct timeout_error {
+    static E make() { return E(); }
+};
+
+template <>
+struct timeout_error<std::exception_ptr> {
+    static std::exception_ptr make() { return std::make_exception_ptr(timeout_expired{}); }
+};
+
+template <>
+struct timeout_error<std::error_code> {
+    static std::error_code make() { return std::make_error_code(std::errc::timed_out); }
+};
+
+// Infallible observables have no error to time out with.
+template <>
+struct timeout_error<never> {
+    template <typename U = void>
+    [[noreturn]] static never make() {
+        static_assert(!std::is_void<U>::value,
+                      "Give an infallible observable an error type with with_error_type to time it out");
+        std::terminate();
+    }
+};
+
+// Timer callbacks and the source can send at the same time, so events are
+// passed on under a lock. It's recursive so that a subscriber can make the
+// source send again. Timer callbacks only hold the state weakly, so a
+// finished subscription is freed without waiting for its timers, unless they
+// have events of their own still to send.
+template <typename Observer, typename Timer>
+struct timed_state {
+    using time_point = typename Timer::time_point;
+    using duration = typename Timer::duration;
+
+    Observer s;
+    Timer *timer;
+    duration d;
+    std::recursive_mutex m;
+    bool done = false;
+
+    timed_state(Observer s_, Timer *timer_, duration d_)
+        : s(std::move(s_)), timer(timer_), d(d_) {}
+
+    template <typename State>
+    static void fire_at(const std::shared_ptr<State> &st, time_point t) {
+        std::weak_ptr<State> weak = st;
+        st->timer->schedule_at(t, [weak]{
+            if (auto st = weak.lock()) {
+                State::fire(st);
+            }
+        });
+    }
+
+    template <typename State>
+    static void fire_holding_at(const std::shared_ptr<State> &st, time_point t) {
+        st->timer->schedule_at(t, [st]{ State::fire(st); });
+    }
+
+    static void complete(const std::shared_ptr<timed_state> &st) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (!st->done) {
+            st->done = true;
+            st->s.send_completed();
+        }
+    }
+
+    void send_error(typename Observer::error_type e) {
+        std::lock_guard<std::recursive_mutex> lock(m);
+        if (!done) {
+            done = true;
+            s.send_error(std::move(e));
+        }
+    }
+};
+
+template <typename T, typename E, typename State>
+struct timed_observer {
+    using value_type = T;
+    using error_type = E;
+    std::shared_ptr<State> st;
+
+    inline subscription get_subscription() const { return st->s.get_subscription(); }
+    inline bool is_disposed() const { return st->s.is_disposed(); }
+    inline void request(size_t n) const { st->s.request(n); }
+    inline void send_next(const T &x) const { State::next(st, x); }
+    inline void send_next(T &&x) const { State::next(st, std::move(x)); }
+    inline void send_error(E e) const { st->send_error(std::move(e)); }
+    inline void send_completed() const { State::complete(st); }
+};
+
+template <template <typename, typename, typename> class State, typename Observable, typename Timer>
+auto make_timed(const char *name, const Observable &o, typename Timer::duration d, Timer *timer) {
+    using T = typename Observable::value_type;
+    using E = typename Observable::error_type;
+    assert(timer);
+    return make_operator<T, E>(name, [o, d, timer](auto s){
+        using S = State<T, decltype(s), Timer>;
+        auto st = make_state<S>(s.get_subscription(), std::move(s), timer, d);
+        S::start(st);
+        o.subscribe(timed_observer<T, E, S>{st});
+    });
+}
+
+// Instead of moving a timer each time a value arrives, the deadline is moved,
+// and a timer that fires early sets itself again for the new deadline. So
+// there's at most one timer per subscription.
+template <typename T, typename Observer, typename Timer>
+struct debounce_state : timed_state<Observer, Timer> {
+    using base = timed_state<Observer, Timer>;
+    using base::base;
+    Maybe<T> latest;
+    typename base::time_point deadline;
+    bool armed = false;
+
+    static void start(const std::shared_ptr<debounce_state> &) {}
+
+    template <typename X>
+    static void next(const std::shared_ptr<debounce_state> &st, X &&x) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (st->done) {
+            return;
+        }
+        st->latest = Just<T>(std::forward<X>(x));
+        st->deadline = st->timer->now() + st->d;
+        if (!st->armed) {
+            st->armed = true;
+            base::fire_at(st, st->deadline);
+        }
+    }
+
+    static void fire(const std::shared_ptr<debounce_state> &st) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (st->done || st->s.is_disposed()) {
+            return;
+        }
+        if (st->timer->now() < st->deadline) {
+            base::fire_at(st, st->deadline);
+            return;
+        }
+        st->armed = false;
+        st->send_latest();
+    }
+
+    void send_latest() {
+        if (T *x = latest.orNull()) {
+            T out = std::move(*x);
+            latest = Nothing<T>();
+            this->s.send_next(std::move(out));
+        }
+    }
+
+    static void complete(const std::shared_ptr<debounce_state> &st) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (!st->done) {
+            st->send_latest();
+            st->done = true;
+            st->s.send_completed();
+        }
+    }
+};
+
+// Sends a value once d has passed without another one arriving. A value
+// waiting when the source completes is sent before the completion.
+template <typename Observable, typename Timer>
+auto debounce(const Observable &o, typename Timer::duration d, Timer *timer) {
+    return make_timed<debounce_state>("debounce", o, d, timer);
+}
+
+template <typename T, typename Observer, typename Timer>
+struct throttle_first_state : timed_state<Observer, Timer> {
+    using base = timed_state<Observer, Timer>;
+    using base::base;
+    typename base::time_point window_end;
+    bool open = false;
+
+    static void start(const std::shared_ptr<throttle_first_state> &) {}
+
+    template <typename X>
+    static void next(const std::shared_ptr<throttle_first_state> &st, X &&x) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (st->done) {
+            return;
+        }
+        auto now = st->timer->now();
+        if (st->open && now < st->window_end) {
+            st->s.request(1);
+            return;
+        }
+        st->open = true;
+        st->window_end = now + st->d;
+        st->s.send_next(std::forward<X>(x));
+    }
+
+};
+
+// Sends a value, then drops values until d has passed. Only reads the
+// timer's clock.
+template <typename Observable, typename Timer>
+auto throttle_first(const Observable &o, typename Timer::duration d, Timer *timer) {
+    return make_timed<throttle_first_state>("throttle_first", o, d, timer);
+}
+
+template <typename T, typename Observer, typename Timer>
+struct throttle_last_state : debounce_state<T, Observer, Timer> {
+    using base = timed_state<Observer, Timer>;
+    using debounce_state<T, Observer, Timer>::debounce_state;
+
+    template <typename X>
+    static void next(const std::shared_ptr<throttle_last_state> &st, X &&x) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (st->done) {
+            return;
+        }
+        st->latest = Just<T>(std::forward<X>(x));
+        if (!st->armed) {
+            st->armed = true;
+            base::fire_at(st, st->timer->now() + st->d);
+        }
+    }
+
+    static void fire(const std::shared_ptr<throttle_last_state> &st) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        st->armed = false;
+        if (!st->done && !st->s.is_disposed()) {
+            st->send_latest();
+        }
+    }
+};
+
+// Sends the last value of each span of d starting at a value. A value
+// waiting when the source completes is sent before the completion.
+template <typename Observable, typename Timer>
+auto throttle_last(const Observable &o, typename Timer::duration d, Timer *timer) {
+    return make_timed<throttle_last_state>("throttle_last", o, d, timer);
+}
+
+template <typename T, typename Observer, typename Timer>
+struct sample_state : debounce_state<T, Observer, Timer> {
+    using base = timed_state<Observer, Timer>;
+    using debounce_state<T, Observer, Timer>::debounce_state;
+    using base::complete;
+
+    // Ticks are counted from the subscription, rather than from when the
+    // last one ran, so they don't drift.
+    static void start(const std::shared_ptr<sample_state> &st) {
+        st->deadline = st->timer->now() + st->d;
+        base::fire_at(st, st->deadline);
+    }
+
+    template <typename X>
+    static void next(const std::shared_ptr<sample_state> &st, X &&x) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (!st->done) {
+            st->latest = Just<T>(std::forward<X>(x));
+        }
+    }
+
+    static void fire(const std::shared_ptr<sample_state> &st) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (st->done || st->s.is_disposed()) {
+            return;
+        }
+        st->send_latest();
+        st->deadline += st->d;
+        base::fire_at(st, st->deadline);
+    }
+
+};
+
+// Sends the latest value every d, if a new one has arrived since the last
+// time. A value that arrives after the last tick is dropped when the source
+// completes.
+template <typename Observable, typename Timer>
+auto sample(const Observable &o, typename Timer::duration d, Timer *timer) {
+    return make_timed<sample_state>("sample", o, d, timer);
+}
+
+template <typename T, typename Observer, typename Timer>
+struct timeout_state : timed_state<Observer, Timer> {
+    using base = timed_state<Observer, Timer>;
+    using base::base;
+    typename base::time_point deadline;
+
+    static void start(const std::shared_ptr<timeout_state> &st) {
+        st->deadline = st->timer->now() + st->d;
+        base::fire_at(st, st->deadline);
+    }
+
+    template <typename X>
+    static void next(const std::shared_ptr<timeout_state> &st, X &&x) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (st->done) {
+            return;
+        }
+        st->deadline = st->timer->now() + st->d;
+        st->s.send_next(std::forward<X>(x));
+    }
+
+    static void fire(const std::shared_ptr<timeout_state> &st) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (st->done || st->s.is_disposed()) {
+            return;
+        }
+        if (st->timer->now() < st->deadline) {
+            base::fire_at(st, st->deadline);
+            return;
+        }
+        st->done = true;
+        st->s.send_error(timeout_error<typename Observer::error_type>::make());
+    }
+
+};
+
+// Sends timeout_error<E> if d passes after subscribing, or after a value,
+// without another value arriving. The source is disposed along with the
+// subscriber.
+template <typename Observable, typename Timer>
+auto timeout(const Observable &o, typename Timer::duration d, Timer *timer) {
+    return make_timed<timeout_state>("timeout", o, d, timer);
+}
+
+template <typename T, typename Observer, typename Timer>
+struct delay_state : timed_state<Observer, Timer> {
+    using base = timed_state<Observer, Timer>;
+    using base::base;
+    // Values in order with the times they're due, and then the completion
+    // as Nothing. Only the front one has a timer.
+    std::deque<std::pair<typename base::time_point, Maybe<T>>> queue;
+
+    static void start(const std::shared_ptr<delay_state> &) {}
+
+    template <typename X>
+    static void next(const std::shared_ptr<delay_state> &st, X &&x) {
+        push(st, Just<T>(std::forward<X>(x)));
+    }
+
+    static void push(const std::shared_ptr<delay_state> &st, Maybe<T> &&x) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (st->done) {
+            return;
+        }
+        auto due = st->timer->now() + st->d;
+        st->queue.emplace_back(due, std::move(x));
+        if (st->queue.size() == 1) {
+            base::fire_holding_at(st, due);
+        }
+    }
+
+    static void fire(const std::shared_ptr<delay_state> &st) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        auto now = st->timer->now();
+        while (!st->queue.empty() && st->queue.front().first <= now) {
+            if (st->done || st->s.is_disposed()) {
+                st->queue.clear();
+                return;
+            }
+            Maybe<T> x = std::move(st->queue.front().second);
+            st->queue.pop_front();
+            if (T *v = x.orNull()) {
+                st->s.send_next(std::move(*v));
+            } else {
+                st->done = true;
+                st->s.send_completed();
+            }
+        }
+        if (!st->queue.empty()) {
+            base::fire_holding_at(st, st->queue.front().first);
+        }
+    }
+
+    static void complete(const std::shared_ptr<delay_state> &st) {
+        push(st, Nothing<T>());
+    }
+};
+
+// Sends each value and the completion d later. Errors are sent straight
+// away, and values still waiting are dropped.
+template <typename Observable, typename Timer>
+auto delay(const Observable &o, typename Timer::duration d, Timer *timer) {
+    return make_timed<delay_state>("delay", o, d, timer);
+}
+
+template <typename T, typename Observer, typename Timer>
+struct buffer_with_time_state : timed_state<Observer, Timer> {
+    using base = timed_state<Observer, Timer>;
+    using base::base;
+    std::vector<T> buffer;
+    typename base::time_point deadline;
+
+    static void start(const std::shared_ptr<buffer_with_time_state> &st) {
+        st->deadline = st->timer->now() + st->d;
+        base::fire_at(st, st->deadline);
+    }
+
+    template <typename X>
+    static void next(const std::shared_ptr<buffer_with_time_state> &st, X &&x) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (!st->done) {
+            st->buffer.push_back(std::forward<X>(x));
+        }
+    }
+
+    void flush() {
+        if (!buffer.empty()) {
+            std::vector<T> out;
+            out.swap(buffer);
+            this->s.send_next(std::move(out));
+        }
+    }
+
+    static void fire(const std::shared_ptr<buffer_with_time_state> &st) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (st->done || st->s.is_disposed()) {
+            return;
+        }
+        st->flush();
+        st->deadline += st->d;
+        base::fire_at(st, st->deadline);
+    }
+
+    static void complete(const std::shared_ptr<buffer_with_time_state> &st) {
+        std::lock_guard<std::recursive_mutex> lock(st->m);
+        if (!st->done) {
+            st->flush();
+            st->done = true;
+            st->s.send_completed();
+        }
+    }
+};
+
+// Sends the values that arrived in each span of d as a vector, skipping
+// spans without any. Values waiting when the source completes are sent
+// before the completion.
+template <typename Observable, typename Timer>
+auto buffer_with_time(const Observable &o, typename Timer::duration d, Timer *timer) {
+    using T = typename Observable::value_type;
+    using E = typename Observable::error_type;
+    assert(timer);
+    return make_operator<std::vector<T>, E>("buffer_with_time", [o, d, timer](auto s){
+        using S = buffer_with_time_state<T, decltype(s), Timer>;
+        auto st = make_state<S>(s.get_subscription(), std::move(s), timer, d);
+        S::start(st);
+        o.subscribe(timed_observer<T, E, S>{st});
+    });
+}
+
+}
+}
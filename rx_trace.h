@@ -0,0 +1,294 @@
+#pragma once
+
+// Per-operator instrumentation. Everything here is only used by rx.h when
+// RX_TRACE is defined; otherwise operators are built without it and this
+// header only provides the sink types. RX_TRACE must be defined the same way
+// in every file of a program.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace windberry {
+namespace rx {
+
+struct trace_stage;
+
+using trace_clock = std::chrono::steady_clock;
+
+// Receives what traced stages record. Its methods may be called from any
+// thread, and it must outlive every subscription started while it's set.
+struct trace_sink {
+    virtual ~trace_sink() {}
+
+    // A stage spent start to end handling one event, including the time
+    // spent in the stages after it.
+    virtual void event(const trace_stage &, trace_clock::time_point /*start*/,
+                       trace_clock::time_point /*end*/) {}
+
+    // A scheduler a stage posts to has depth tasks waiting.
+    virtual void queue_depth(const trace_stage &, size_t /*depth*/) {}
+
+    // A stage's subscription has ended, and its counters are final.
+    virtual void stage_finished(const trace_stage &) {}
+};
+
+inline std::atomic<trace_sink *> &trace_sink_slot() {
+    static std::atomic<trace_sink *> sink{nullptr};
+    return sink;
+}
+
+// Sets the sink for subscriptions started from now on. Stages are only
+// traced while there's a sink.
+inline void set_trace_sink(trace_sink *sink) {
+    trace_sink_slot().store(sink, std::memory_order_release);
+}
+
+// One operator in one subscription, from when it's subscribed until its
+// last observer is destroyed.
+struct trace_stage {
+    const char *name;
+    uint64_t id;
+    // The size of the observer the operator was subscribed with.
+    size_t observer_size;
+    trace_sink *sink;
+    // The stage this one sends its events to, or null for the subscriber.
+    std::shared_ptr<trace_stage> downstream;
+
+    std::atomic<uint64_t> events_in{0};
+    std::atomic<uint64_t> events_out{0};
+    // Nanoseconds spent in this stage's send_next, send_error and
+    // send_completed, with and without the stages after it.
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> self_ns{0};
+    // Allocations made by the stage, as reported to trace_allocation.
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> allocated_bytes{0};
+    std::atomic<size_t> max_queue_depth{0};
+
+    trace_stage(const char *name_, size_t observer_size_, trace_sink *sink_,
+                std::shared_ptr<trace_stage> downstream_)
+        : name(name_), id(next_id()), observer_size(observer_size_), sink(sink_),
+          downstream(std::move(downstream_)) {}
+    ~trace_stage() { sink->stage_finished(*this); }
+
+  private:
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> last{0};
+        return ++last;
+    }
+};
+
+// What's running on this thread: the stage whose code is running, and the
+// count of nanoseconds that the stages it calls into should add to.
+struct trace_context {
+    const std::shared_ptr<trace_stage> *current = nullptr;
+    uint64_t *nested_ns = nullptr;
+};
+
+inline trace_context &this_thread_trace() {
+    static thread_local trace_context context;
+    return context;
+}
+
+// Counts an allocation against the stage running on this thread, if any.
+// Operators call it for their per-subscription state; programs can call it
+// from their own operator new to count every allocation.
+inline void trace_allocation(size_t bytes) {
+    if (const std::shared_ptr<trace_stage> *stage = this_thread_trace().current) {
+        (*stage)->allocations.fetch_add(1, std::memory_order_relaxed);
+        (*stage)->allocated_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+}
+
+// Records the depth of a queue the stage running on this thread just posted
+// to.
+inline void trace_queue_depth(size_t depth) {
+    const std::shared_ptr<trace_stage> *current = this_thread_trace().current;
+    if (!current) {
+        return;
+    }
+    trace_stage &stage = **current;
+    size_t max = stage.max_queue_depth.load(std::memory_order_relaxed);
+    while (depth > max &&
+           !stage.max_queue_depth.compare_exchange_weak(max, depth, std::memory_order_relaxed)) {}
+    stage.sink->queue_depth(stage, depth);
+}
+
+// Wraps the observer a traced stage sends to, to count and time the events
+// it sends. The time is charged to the stage downstream.
+template <typename Observer>
+struct traced_observer {
+    using value_type = typename Observer::value_type;
+    using error_type = typename Observer::error_type;
+
+    Observer s;
+    std::shared_ptr<trace_stage> stage;
+
+    inline decltype(auto) get_subscription() const { return s.get_subscription(); }
+    inline bool is_disposed() const { return s.is_disposed(); }
+    inline void request(size_t n) const { s.request(n); }
+
+    template <typename U>
+    inline void send_next(U &&x) const {
+        measure([&]{ s.send_next(std::forward<U>(x)); });
+    }
+    template <typename U>
+    inline void send_error(U &&e) const {
+        measure([&]{ s.send_error(std::forward<U>(e)); });
+    }
+    inline void send_completed() const {
+        measure([&]{ s.send_completed(); });
+    }
+
+  private:
+    template <typename F>
+    void measure(F &&f) const {
+        if (!stage) {
+            f();
+            return;
+        }
+        stage->events_out.fetch_add(1, std::memory_order_relaxed);
+        const std::shared_ptr<trace_stage> &next = stage->downstream;
+        if (next) {
+            next->events_in.fetch_add(1, std::memory_order_relaxed);
+        }
+        trace_context &context = this_thread_trace();
+        trace_context outer = context;
+        uint64_t nested_ns = 0;
+        context.current = next ? &next : nullptr;
+        context.nested_ns = &nested_ns;
+        trace_clock::time_point start = trace_clock::now();
+        f();
+        trace_clock::time_point end = trace_clock::now();
+        context = outer;
+
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        if (outer.nested_ns) {
+            *outer.nested_ns += ns;
+        }
+        if (next) {
+            next->total_ns.fetch_add(ns, std::memory_order_relaxed);
+            next->self_ns.fetch_add(ns - std::min(ns, nested_ns), std::memory_order_relaxed);
+            next->sink->event(*next, start, end);
+        }
+    }
+};
+
+// A generator that traces each subscription to it as a stage, linked to the
+// stage that subscribed to it, if that's traced too.
+template <typename F>
+struct traced_generator {
+    const char *name;
+    F f;
+
+    template <typename Observer>
+    void operator()(Observer s) const {
+        using O = std::decay_t<Observer>;
+        trace_context &context = this_thread_trace();
+        trace_sink *sink = trace_sink_slot().load(std::memory_order_acquire);
+        if (!sink) {
+            f(traced_observer<O>{std::move(s), nullptr});
+            return;
+        }
+        auto stage = std::make_shared<trace_stage>(
+            name, sizeof(O), sink,
+            context.current ? *context.current : std::shared_ptr<trace_stage>());
+        // Whatever this subscribes to sends its events to this stage.
+        const std::shared_ptr<trace_stage> *outer = context.current;
+        context.current = &stage;
+        f(traced_observer<O>{std::move(s), stage});
+        context.current = outer;
+    }
+};
+
+// Writes events in the Chrome trace event format, for chrome://tracing or
+// Perfetto: a slice for each event a stage handles, nested in the slices of
+// the stages that sent it, a counter track for each queue, and each stage's
+// totals when it finishes. Only one in sample_every events is written.
+class chrome_trace_writer : public trace_sink {
+  public:
+    explicit chrome_trace_writer(std::FILE *out_, uint64_t sample_every_ = 1)
+        : out(out_), sample_every(sample_every_ ? sample_every_ : 1), epoch(trace_clock::now()) {
+        std::fputs("{\"traceEvents\":[", out);
+    }
+    ~chrome_trace_writer() {
+        std::fputs("\n]}\n", out);
+        std::fflush(out);
+    }
+
+    void event(const trace_stage &stage, trace_clock::time_point start,
+               trace_clock::time_point end) override {
+        if (sampled.fetch_add(1, std::memory_order_relaxed) % sample_every != 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m);
+        begin_event(stage.name, "X", start);
+        std::fprintf(out, ",\"dur\":%.3f,\"args\":{\"stage\":%llu}}",
+                     micros(end - start), (unsigned long long)stage.id);
+    }
+
+    void queue_depth(const trace_stage &stage, size_t depth) override {
+        std::lock_guard<std::mutex> lock(m);
+        begin_event(stage.name, "C", trace_clock::now());
+        std::fprintf(out, ",\"args\":{\"queue depth\":%zu}}", depth);
+    }
+
+    void stage_finished(const trace_stage &stage) override {
+        std::lock_guard<std::mutex> lock(m);
+        begin_event(stage.name, "i", trace_clock::now());
+        std::fprintf(out,
+                     ",\"s\":\"t\",\"args\":{\"stage\":%llu,\"downstream\":%llu,"
+                     "\"events in\":%llu,\"events out\":%llu,\"total us\":%.3f,"
+                     "\"self us\":%.3f,\"allocations\":%llu,\"allocated bytes\":%llu,"
+                     "\"max queue depth\":%zu,\"observer size\":%zu}}",
+                     (unsigned long long)stage.id,
+                     (unsigned long long)(stage.downstream ? stage.downstream->id : 0),
+                     (unsigned long long)stage.events_in.load(),
+                     (unsigned long long)stage.events_out.load(),
+                     stage.total_ns.load() / 1000.0, stage.self_ns.load() / 1000.0,
+                     (unsigned long long)stage.allocations.load(),
+                     (unsigned long long)stage.allocated_bytes.load(),
+                     stage.max_queue_depth.load(), stage.observer_size);
+    }
+
+  private:
+    template <typename Duration>
+    static double micros(Duration d) {
+        return std::chrono::duration<double, std::micro>(d).count();
+    }
+
+    static unsigned thread_number() {
+        static std::atomic<unsigned> last{0};
+        static thread_local unsigned n = ++last;
+        return n;
+    }
+
+    void begin_event(const char *name, const char *phase, trace_clock::time_point t) {
+        std::fputs(first ? "\n{\"name\":\"" : ",\n{\"name\":\"", out);
+        first = false;
+        for (const char *c = name; *c; ++c) {
+            if (*c == '"' || *c == '\\') {
+                std::fputc('\\', out);
+            }
+            std::fputc(*c, out);
+        }
+        std::fprintf(out, "\",\"cat\":\"rx\",\"ph\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+                     phase, thread_number(), micros(t - epoch));
+    }
+
+    std::FILE *out;
+    uint64_t sample_every;
+    trace_clock::time_point epoch;
+    std::atomic<uint64_t> sampled{0};
+    std::mutex m;
+    bool first = true;
+};
+
+}
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "rx.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace windberry {
+namespace rx {
+
+// A scheduler and timer whose clock only moves when it's told to, for
+// testing and benchmarking time-based and asynchronous pipelines without
+// sleeping. Functions run on the thread that advances the clock, in order of
+// their times, and in the order they were scheduled for the same time. The
+// clock reads the time of the function being run.
+//
+// Functions can be scheduled from any thread.
+class virtual_scheduler {
+  public:
+    using clock = std::chrono::steady_clock;
+    using time_point = clock::time_point;
+    using duration = clock::duration;
+
+    virtual_scheduler() = default;
+    virtual_scheduler(const virtual_scheduler &) = delete;
+    virtual_scheduler &operator=(const virtual_scheduler &) = delete;
+
+    time_point now() const {
+        std::lock_guard<std::mutex> lock(m);
+        return current;
+    }
+
+    // Time since the scheduler was created.
+    duration elapsed() const { return now() - time_point(); }
+
+    void schedule_at(time_point t, std::function<void()> f) {
+        std::lock_guard<std::mutex> lock(m);
+        queue.emplace(std::make_pair(t < current ? current : t, next_seq++), std::move(f));
+    }
+
+    void schedule_after(duration d, std::function<void()> f) {
+        std::lock_guard<std::mutex> lock(m);
+        queue.emplace(std::make_pair(current + d, next_seq++), std::move(f));
+    }
+
+    // Runs f the next time the clock is advanced, at the current time.
+    void post(std::function<void()> f) { schedule_after(duration::zero(), std::move(f)); }
+
+    // Runs everything due up to t, including anything scheduled by what it
+    // runs, and leaves the clock at t.
+    void advance_to(time_point t) {
+        for (;;) {
+            std::function<void()> f;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if (queue.empty() || queue.begin()->first.first > t) {
+                    if (current < t) {
+                        current = t;
+                    }
+                    return;
+                }
+                auto it = queue.begin();
+                current = it->first.first;
+                f = std::move(it->second);
+                queue.erase(it);
+            }
+            f();
+        }
+    }
+
+    void advance_by(duration d) { advance_to(now() + d); }
+
+    // Runs everything due now, without moving the clock.
+    void run_pending() { advance_to(now()); }
+
+    size_t pending() const {
+        std::lock_guard<std::mutex> lock(m);
+        return queue.size();
+    }
+
+  private:
+    mutable std::mutex m;
+    time_point current;
+    uint64_t next_seq = 0;
+    std::map<std::pair<time_point, uint64_t>, std::function<void()>> queue;
+};
+
+template <>
+struct schedule_on<virtual_scheduler *> {
+    inline auto operator()(virtual_scheduler *q) {
+        assert(q);
+        return [q](auto f){ q->post(std::move(f)); };
+    }
+};
+
+// A subscriber that records each event with the virtual time it arrived.
+// Copies share the same record.
+template <typename T, typename E = default_error_type>
+class event_recorder {
+  public:
+    using value_type = T;
+    using error_type = E;
+    using time_point = virtual_scheduler::time_point;
+    using duration = virtual_scheduler::duration;
+
+    struct event {
+        duration at;
+        event_type type;
+        Maybe<T> value;
+        Maybe<E> error;
+    };
+
+    explicit event_recorder(const virtual_scheduler &scheduler)
+        : st(std::make_shared<state>(scheduler)) {}
+
+    void send_next(const T &x) const { add(event_type::next, Just(x), Nothing<E>()); }
+    void send_next(T &&x) const { add(event_type::next, Just(std::move(x)), Nothing<E>()); }
+    void send_error(E e) const { add(event_type::error, Nothing<T>(), Just(std::move(e))); }
+    void send_completed() const { add(event_type::completed, Nothing<T>(), Nothing<E>()); }
+
+    std::vector<event> events() const {
+        std::lock_guard<std::mutex> lock(st->m);
+        return st->events;
+    }
+
+    // The values in order, each with the time it arrived.
+    std::vector<std::pair<duration, T>> values() const {
+        std::lock_guard<std::mutex> lock(st->m);
+        std::vector<std::pair<duration, T>> out;
+        for (const auto &e : st->events) {
+            if (const T *x = e.value.orNull()) {
+                out.emplace_back(e.at, *x);
+            }
+        }
+        return out;
+    }
+
+    // When the error or completion arrived, if one has.
+    Maybe<duration> finished_at() const {
+        std::lock_guard<std::mutex> lock(st->m);
+        for (const auto &e : st->events) {
+            if (e.type != event_type::next) {
+                return Just(e.at);
+            }
+        }
+        return Nothing<duration>();
+    }
+
+    bool completed() const { return finished(event_type::completed); }
+    bool errored() const { return finished(event_type::error); }
+
+  private:
+    struct state {
+        const virtual_scheduler &scheduler;
+        std::mutex m;
+        std::vector<event> events;
+        explicit state(const virtual_scheduler &scheduler_) : scheduler(scheduler_) {}
+    };
+
+    void add(event_type type, Maybe<T> &&x, Maybe<E> &&e) const {
+        duration at = st->scheduler.elapsed();
+        std::lock_guard<std::mutex> lock(st->m);
+        st->events.push_back(event{at, type, std::move(x), std::move(e)});
+    }
+
+    bool finished(event_type type) const {
+        std::lock_guard<std::mutex> lock(st->m);
+        return !st->events.empty() && st->events.back().type == type;
+    }
+
+    std::shared_ptr<state> st;
+};
+
+}
+}